@@ -0,0 +1,67 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_CHECKPOINT_HPP
+#define MUTK_CHECKPOINT_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace mutk {
+
+/*
+A checkpoint records the progress of a long run over a VCF/BCF file, so
+that a run that is killed or preempted can resume where it stopped.
+
+    records     number of input records whose output is complete
+    contig/pos  the last of those records, for logging and sanity checks
+    offsets     the size of each output file after those records
+    sums        named partial sums, e.g. the state of the log-likelihood
+                reduction (see BlockSum)
+
+Checkpoints are saved by writing a temporary file next to `path`, syncing
+it, and renaming it over `path`. A reader therefore sees either the old or
+the new checkpoint, never a partial one. Sums are stored as hexadecimal
+floats so that a resumed run reproduces them exactly.
+*/
+struct checkpoint_t {
+    std::uint64_t records{0};
+    std::string contig;
+    std::int64_t pos{-1};
+    std::vector<std::int64_t> offsets;
+    std::map<std::string, std::vector<double>> sums;
+};
+
+void save_checkpoint(const std::filesystem::path &path, const checkpoint_t &checkpoint);
+
+// Returns nothing if `path` does not exist
+std::optional<checkpoint_t> load_checkpoint(const std::filesystem::path &path);
+
+} // namespace mutk
+
+#endif // MUTK_CHECKPOINT_HPP
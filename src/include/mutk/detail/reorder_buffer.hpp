@@ -0,0 +1,102 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_DETAIL_REORDER_BUFFER_HPP
+#define MUTK_DETAIL_REORDER_BUFFER_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace mutk {
+namespace detail {
+
+// Restores the order of items that are finished out of order. Every item
+// has a sequence number, starting at 0, and Pop returns them in sequence
+// order. Items are kept in a ring of `capacity` slots, so Push blocks while
+// an item is `capacity` or more ahead of the next one to be popped. Pop
+// blocks until the next item arrives. Once closed, Push fails and Pop
+// returns the items that are already in order.
+template<typename T>
+class ReorderBuffer {
+public:
+    explicit ReorderBuffer(std::size_t capacity) : slots_(capacity) {}
+
+    bool Push(std::size_t sequence, T value) {
+        std::unique_lock<std::mutex> lock{mutex_};
+        not_full_.wait(lock, [&]{ return closed_ || sequence < next_ + slots_.size(); });
+        if(closed_) {
+            return false;
+        }
+        slots_[sequence % slots_.size()].emplace(std::move(value));
+        const bool wake = (sequence == next_);
+        lock.unlock();
+        // Only the next item can unblock Pop
+        if(wake) {
+            ready_.notify_one();
+        }
+        return true;
+    }
+
+    std::optional<T> Pop() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        auto &slot = slots_[next_ % slots_.size()];
+        ready_.wait(lock, [&]{ return closed_ || slot.has_value(); });
+        if(!slot) {
+            return std::nullopt;
+        }
+        std::optional<T> value = std::move(slot);
+        slot.reset();
+        next_ += 1;
+        lock.unlock();
+        not_full_.notify_all();
+        return value;
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            closed_ = true;
+        }
+        not_full_.notify_all();
+        ready_.notify_all();
+    }
+
+private:
+    std::vector<std::optional<T>> slots_;
+    std::size_t next_{0};
+    bool closed_{false};
+
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable ready_;
+};
+
+} // namespace detail
+} // namespace mutk
+
+#endif // MUTK_DETAIL_REORDER_BUFFER_HPP
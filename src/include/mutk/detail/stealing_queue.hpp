@@ -0,0 +1,129 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_DETAIL_STEALING_QUEUE_HPP
+#define MUTK_DETAIL_STEALING_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace mutk {
+namespace detail {
+
+// A set of task queues, one per worker, for work stealing. A worker takes
+// tasks from the front of its own queue, and once that is empty it steals
+// from the back of the queues of other workers. Pop blocks while every
+// queue is empty. Once closed, Pop drains the remaining tasks.
+template<typename T>
+class StealingQueue {
+public:
+    explicit StealingQueue(std::size_t num_workers) : queues_(num_workers) {}
+
+    // Add a task to the queue of `worker`
+    void Push(std::size_t worker, T value) {
+        {
+            auto &queue = queues_[worker];
+            std::lock_guard<std::mutex> lock{queue.mutex};
+            queue.items.push_back(std::move(value));
+            std::lock_guard<std::mutex> guard{mutex_};
+            pending_ += 1;
+        }
+        not_empty_.notify_one();
+    }
+
+    std::optional<T> Pop(std::size_t worker) {
+        for(;;) {
+            if(auto value = Take(worker)) {
+                return value;
+            }
+            std::unique_lock<std::mutex> lock{mutex_};
+            not_empty_.wait(lock, [&]{ return closed_ || pending_ > 0; });
+            if(pending_ == 0) {
+                return std::nullopt;
+            }
+            // The task was visible when it was counted, but another worker
+            // may take it before this one gets to it
+        }
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+    }
+
+    std::size_t num_workers() const { return queues_.size(); }
+
+private:
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<T> items;
+    };
+
+    std::optional<T> Take(std::size_t worker) {
+        const std::size_t n = queues_.size();
+        for(std::size_t k = 0; k < n; ++k) {
+            auto &queue = queues_[(worker + k) % n];
+            std::unique_lock<std::mutex> lock{queue.mutex};
+            if(queue.items.empty()) {
+                continue;
+            }
+            std::optional<T> value;
+            if(k == 0) {
+                value.emplace(std::move(queue.items.front()));
+                queue.items.pop_front();
+            } else {
+                value.emplace(std::move(queue.items.back()));
+                queue.items.pop_back();
+            }
+            std::lock_guard<std::mutex> guard{mutex_};
+            pending_ -= 1;
+            return value;
+        }
+        return std::nullopt;
+    }
+
+    std::vector<queue_t> queues_;
+
+    // The number of tasks in the queues. It changes while the queue that
+    // holds the task is locked, so a task is counted exactly while it is
+    // visible and Pop never spins on a task that can not be taken yet.
+    // Locks are taken in the order queue_t::mutex, then mutex_.
+    std::size_t pending_{0};
+    bool closed_{false};
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+};
+
+} // namespace detail
+} // namespace mutk
+
+#endif // MUTK_DETAIL_STEALING_QUEUE_HPP
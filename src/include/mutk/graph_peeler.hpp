@@ -27,41 +27,191 @@
 
 #include "message.hpp"
 #include "graph.hpp"
+#include "mutation.hpp"
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace mutk {
 
-struct workspace_t {
-    std::vector<mutk::message_t> messages;
+// Contractions that read at least this many values of a single factor are
+// handed to BLAS when they have the shape of a matrix product.
+constexpr std::size_t DEFAULT_BLAS_THRESHOLD = 4096;
+
+// Messages are stored as T. Float messages can be summed in double by
+// setting `double_sums`, which costs little and avoids most rounding error.
+// BLAS is not used for double sums of float messages.
+//
+// `operators[i]` is set if model component i was tagged as a k-alleles
+// transition.
+//
+// A workspace keeps the messages of its last peel. `dirty[i]` is set when
+// slot i has changed since then, and PeelForward only recomputes the steps
+// that depend on a dirty slot. Clear `log_scales` to force a full peel,
+// e.g. after changing `double_sums` or `blas_threshold`.
+template<class T>
+struct basic_workspace_t {
+    std::vector<mutk::basic_message_t<T>> messages;
+    std::vector<std::optional<kalleles_operator_t>> operators;
+    std::vector<std::uint8_t> dirty;
+    std::vector<double> log_scales; // one per step of the plan
+    bool double_sums{false};
+    std::size_t blas_threshold{DEFAULT_BLAS_THRESHOLD};
 };
 
+using workspace_t = basic_workspace_t<float_t>;
+
+// Workspace for peeling several families that share a GraphPeeler at once.
+// Data and intermediate factors have a trailing lane axis with one lane per
+// family, so that every lane is updated by the same instruction stream.
+//
+// Lanes can instead hold the points of a parameter grid: model components
+// get one lane per grid point and the data of a single family is shared by
+// every lane, so one peel yields a likelihood profile.
+struct lane_workspace_t {
+    std::size_t num_lanes{0};
+    message_size_t num_alleles{0};
+    std::vector<mutk::message_t> messages;
+    // laned[i] is set if messages[i] has a lane axis. Otherwise it is
+    // shared by every lane.
+    std::vector<std::uint8_t> laned;
+    // operators[i][lane] is set if model component i of that lane was
+    // tagged as a k-alleles transition. A component is applied as an
+    // operator only if every lane is tagged.
+    std::vector<std::vector<std::optional<kalleles_operator_t>>> operators;
+    bool double_sums{false};
+    std::size_t blas_threshold{DEFAULT_BLAS_THRESHOLD};
+};
 
 /*
 GraphPeeler is relationship-graph peeling algorithm using a
 Shenoy-Shafer architecture.
+
+The likelihood of a site is computed by variable elimination. Every factor
+lives in a slot of a workspace: model components come first, followed by
+data components and the intermediate factors of the contraction plan. The
+plan only depends on the structure of the graph, so it can be shared by
+every family with the same structure (see PeelerCache).
+
+If gametes are split, every diploid parent of a child with two parents
+passes on a haploid gamete variable. P(child|mom,dad) then factors into
+P(gamete|parent) and the union of two gametes, and the largest cliques
+hold n^2 gamete pairs instead of n(n+1)/2 genotypes per parent. Gamete
+variables are numbered after the vertices of graph().
 */
 class GraphPeeler {
 public:
+    using vertex_t = RelationshipGraph::vertex_descriptor;
+
+    // The prior of a founder, or the transition probabilities of a child
+    // given its parents. The child comes first and the parents follow in
+    // the order of the child's in-edges. A factor is stored in row-major
+    // order with one axis per variable.
+    //
+    // A Gamete component is P(gamete|parent) and a Zygote component
+    // joins the gametes, and any haploid parents, of a child.
+    struct model_component_t {
+        enum struct kind_t { Founder, Transition, Gamete, Zygote };
+
+        kind_t kind;
+        std::vector<variable_t> variables;
+        std::vector<float> edge_lengths; // 0 for the child
+        std::vector<Ploidy> ploidies;
+    };
+
+    // One step of variable elimination. The factors in `inputs` are
+    // multiplied over `scope` and the last variable of `scope` is summed out.
+    // The remaining variables form the scope of `output`. The product is
+    // never stored; every output value is accumulated as it is streamed.
+    //
+    // If one input spans all of `scope` and every other input only depends
+    // on the summed variable, `matrix` is the position of that input, and
+    // the step is a matrix-vector product (or a matrix-matrix product over
+    // lanes). Otherwise it is -1.
+    struct contraction_t {
+        std::vector<int> inputs;
+        int output;
+        std::vector<variable_t> scope;
+        int matrix{-1};
+    };
+
     GraphPeeler() = default;
 
-    static GraphPeeler Create(RelationshipGraph graph);
+    static GraphPeeler Create(RelationshipGraph graph, bool split_gametes = false);
 
-    float PeelForward(workspace_t &work) const;
+    // Returns the log-likelihood of the potentials in `work`.
+    // Implemented for float and double workspaces.
+    template<class T>
+    double PeelForward(basic_workspace_t<T> &work) const;
 
-    template<class Arg>
-    void SetModelPotentials(workspace_t &work, message_size_t n, Arg arg) const;
+    // Fill the model components of `work` for sites with `n` alleles.
+    // `arg(component, n)` must return the factor of a model component, with
+    // its axes in the order of `component.variables`. The factor is stored
+    // in the axis order of the plan. Data components are not modified.
+    // If `arg` returns a model_potential_t with a k-alleles tag, the
+    // transition is applied as a structured operator.
+    template<class T, class Arg>
+    void SetModelPotentials(basic_workspace_t<T> &work, message_size_t n, Arg arg) const {
+        UpdateModelPotentials(work, n, arg, [](const model_component_t &) { return true; });
+    }
+
+    // Refill only the model components for which `select(component)` is
+    // true, e.g. IsPrior when only the founder priors have changed. The
+    // next peel reuses every message that does not depend on them.
+    template<class T, class Arg, class Select>
+    void UpdateModelPotentials(basic_workspace_t<T> &work, message_size_t n, Arg arg,
+        Select select) const;
+
+    // Founder priors depend on theta and the reference biases, while
+    // every other model component depends on the mutation rate
+    static bool IsPrior(const model_component_t &component) {
+        return component.kind == model_component_t::kind_t::Founder;
+    }
 
-    void SetDataPotentials(workspace_t &work, message_size_t n,
+    // Fill the data components of `work`. `data[i]` is the likelihood of
+    // the data of `data_vertices()[i]` for sites with `n` alleles.
+    template<class T>
+    void SetDataPotentials(basic_workspace_t<T> &work, message_size_t n,
         const std::vector<mutk::message_t> &data) const;
 
-    workspace_t CreateWorkspace() const;
+    template<class T = float_t>
+    basic_workspace_t<T> CreateWorkspace(bool double_sums = false) const {
+        basic_workspace_t<T> work;
+        work.messages.resize(scopes_.size());
+        work.dirty.assign(scopes_.size(), 1);
+        work.double_sums = double_sums;
+        return work;
+    }
+
+    // Peel all lanes of `work`, using the model potentials of `model`
+    // for every lane. Writes one log-likelihood per lane to `result`.
+    void PeelForward(const workspace_t &model, lane_workspace_t &work,
+        double *result) const;
+
+    // Fill the data components of one lane of `work`
+    void SetDataPotentials(lane_workspace_t &work, std::size_t lane,
+        message_size_t n, const std::vector<mutk::message_t> &data) const;
+
+    // Peel all lanes of `work` using its own model potentials
+    void PeelForward(lane_workspace_t &work, double *result) const;
+
+    // Copy the model potentials of `model` into one lane of `work`
+    void SetModelPotentials(lane_workspace_t &work, std::size_t lane,
+        const workspace_t &model) const;
+
+    // Fill the data components of `work`, shared by every lane
+    void SetDataPotentials(lane_workspace_t &work, message_size_t n,
+        const std::vector<mutk::message_t> &data) const;
 
-    // const std::vector<potential_t>& potentials() const {
-    //     return potentials_;
-    // }
+    lane_workspace_t CreateLaneWorkspace(std::size_t num_lanes,
+        bool double_sums = false) const;
 
     const auto & graph() const {
         return graph_;
@@ -71,14 +221,130 @@ public:
         return tree_;
     }
 
+    const std::vector<model_component_t> & model_components() const {
+        return model_components_;
+    }
+
+    const std::vector<vertex_t> & data_vertices() const {
+        return data_vertices_;
+    }
+
+    const std::vector<contraction_t> & plan() const {
+        return plan_;
+    }
+
+    const std::vector<variable_t> & scope(int slot) const {
+        return scopes_[slot];
+    }
+
+    int num_slots() const {
+        return static_cast<int>(scopes_.size());
+    }
+
+    Ploidy ploidy(variable_t v) const {
+        return ploidies_[+v];
+    }
+
+    std::size_t num_variables() const {
+        return ploidies_.size();
+    }
+
 protected:
     RelationshipGraph graph_;
     JunctionTree tree_;
 
+    std::vector<model_component_t> model_components_;
+    std::vector<vertex_t> data_vertices_;
+    std::vector<Ploidy> ploidies_;
+
+    std::vector<std::vector<variable_t>> scopes_;
+    std::vector<contraction_t> plan_;
+    std::vector<int> results_; // slots that hold a factor with an empty scope
+
 private:
+    void CreatePlan(const std::vector<std::vector<vertex_t>> &cliques);
 
+    // Peel the lanes of `work`. Model and data factors are read from
+    // `sources`, and `laned` marks those with a lane axis. `operators[i]`
+    // holds the k-alleles operator of model component i, either one shared
+    // by every lane or one per lane, and is empty if it is not tagged.
+    void PeelLanes(const std::vector<const float_t *> &sources,
+        const std::vector<std::uint8_t> &laned,
+        const std::vector<std::vector<kalleles_operator_t>> &operators,
+        lane_workspace_t &work, double *result) const;
 };
 
+template<class T, class Arg, class Select>
+void GraphPeeler::UpdateModelPotentials(basic_workspace_t<T> &work, message_size_t n, Arg arg,
+    Select select) const
+{
+    assert(work.messages.size() == scopes_.size());
+    work.dirty.resize(scopes_.size(), 1);
+    work.operators.resize(model_components_.size());
+    for(std::size_t i = 0; i < model_components_.size(); ++i) {
+        const auto &component = model_components_[i];
+        if(!select(component)) {
+            continue;
+        }
+        work.dirty[i] = 1;
+        const auto &order = scopes_[i];
+        const std::size_t rank = order.size();
+
+        // The peeler stores factors in the axis order of scope(i)
+        message_shape_t shape(rank);
+        for(std::size_t a = 0; a < rank; ++a) {
+            shape[a] = message_axis_size(n, ploidies_[+order[a]]);
+        }
+        std::vector<std::size_t> dims(rank), strides(rank);
+        std::size_t stride = 1;
+        for(std::size_t a = rank; a-- > 0;) {
+            auto j = std::find(component.variables.begin(), component.variables.end(),
+                order[a]) - component.variables.begin();
+            dims[j] = shape[a];
+            strides[j] = stride;
+            stride *= shape[a];
+        }
+
+        auto ret = arg(component, n);
+        constexpr bool tagged = std::is_same_v<decltype(ret), model_potential_t>;
+        const auto &value = [&]() -> const auto & {
+            if constexpr(tagged) {
+                return ret.value;
+            } else {
+                return ret;
+            }
+        }();
+        assert(value.size() == stride);
+        work.operators[i].reset();
+        if constexpr(tagged) {
+            if(ret.kalleles) {
+                if(rank != 2 || component.ploidies[0] != component.ploidies[1]) {
+                    throw std::invalid_argument("a k-alleles operator must join two variables of the same ploidy.");
+                }
+                work.operators[i] = ret.kalleles;
+            }
+        }
+        auto &msg = work.messages[i];
+        msg = basic_message_t<T>::from_shape(shape);
+
+        // Copy the factor while moving its axes
+        std::vector<std::size_t> index(rank, 0);
+        std::size_t offset = 0;
+        for(auto x : value) {
+            msg.data()[offset] = static_cast<T>(x);
+            for(std::size_t j = rank; j-- > 0;) {
+                index[j] += 1;
+                offset += strides[j];
+                if(index[j] < dims[j]) {
+                    break;
+                }
+                offset -= strides[j]*dims[j];
+                index[j] = 0;
+            }
+        }
+    }
+}
+
 } // namespace mutk
 
 #endif // MUTK_RELATIONSHIP_GRAPH_HPP
@@ -26,6 +26,7 @@
 #define MUTK_INHERITANCE_MODEL_HPP
 
 #include <type_traits>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
@@ -39,8 +39,7 @@
 
 namespace mutk {
 
-using float_t = float;
-using tensor_t = xt::xarray<float_t>;
+using tensor_t = message_t;
 using shape_t = tensor_t::shape_type;
 using strides_t = tensor_t::strides_type;
 
@@ -25,10 +25,13 @@
 #ifndef MUTK_MESSAGE_HPP
 #define MUTK_MESSAGE_HPP
 
+#include <cstddef>
+#include <type_traits>
 #include <utility>
 
 #include <xtensor-blas/xlinalg.hpp>
 #include <xtensor/xarray.hpp>
+#include <xtensor/xstorage.hpp>
 #include <xtensor/xio.hpp>
 #include <xtensor/xgenerator.hpp>
 
@@ -59,8 +62,29 @@ std::pair<variable_t,Ploidy> unmake_message_label(message_label_t label) {
     return std::make_pair(variable_t{ll/2}, Ploidy{(ll & 0x1)+1});
 }
 
+// Messages are stored as float_t unless a peeler is asked for more precision
 using float_t = float;
-using message_t = xt::xarray<float_t>;
+
+// Almost every message is tiny, so allocations would dominate the cost of
+// creating and copying them. Messages keep their shape and strides inline
+// up to rank MESSAGE_INLINE_RANK and their values inline up to
+// MESSAGE_INLINE_SIZE elements. 225 values is a 15x15 table: a haploid
+// pairwise factor for 15 alleles, a diploid pairwise factor for five
+// alleles, or a diploid vector for up to 20 alleles. Copies only touch
+// the values in use, so the cost of the larger buffer is its footprint,
+// about 1 KB per float message, and workspaces reuse their messages.
+// Larger messages spill to the heap. The sizes are part of the message
+// type, so they are fixed for every translation unit.
+constexpr std::size_t MESSAGE_INLINE_RANK = 6;
+constexpr std::size_t MESSAGE_INLINE_SIZE = 225;
+
+template<class T>
+using message_storage_t = xt::svector<T, MESSAGE_INLINE_SIZE>;
+
+template<class T>
+using basic_message_t = xt::xarray_container<message_storage_t<T>,
+    xt::layout_type::row_major, xt::svector<std::size_t, MESSAGE_INLINE_RANK>>;
+using message_t = basic_message_t<float_t>;
 using message_shape_t = message_t::shape_type;
 using message_size_t = message_t::size_type;
 
@@ -0,0 +1,109 @@
+/*
+# Copyright (c) 2023 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_MODELFIT_HPP
+#define MUTK_MODELFIT_HPP
+
+#include "checkpoint.hpp"
+#include "graph_peeler.hpp"
+#include "mutation.hpp"
+#include "pedigree.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace mutk {
+
+// Sites with more alleles are skipped
+constexpr int MODELFIT_MAX_ALLELES = 5;
+
+// Build the relationship graph of `pedigree`. Members tagged as haploid
+// (haploid, gamete, p=1, or ploidy=1) have one copy of each autosome, and
+// founder tags drop the parents of a member. `samples` are the samples of
+// the input, and sample i becomes sample_id_t{i}.
+RelationshipGraph build_pedigree_graph(const Pedigree &pedigree,
+    const std::vector<std::string> &samples, float mu);
+
+// The factor of a model component of a GraphPeeler under `model` at a site
+// with `n` alleles, with its axes in the order of `component.variables`.
+// Clones of the same ploidy are tagged as k-alleles transitions.
+model_potential_t create_model_potential(const MutationModel &model,
+    const GraphPeeler::model_component_t &component, message_size_t n);
+
+/*
+ModelFit computes the log-likelihood of every site of a VCF/BCF file, or of
+a site store (see SiteStore), given a pedigree.
+
+Records are annotated with INFO/LL and written to `output`. With
+`split_families`, each family of the pedigree is peeled separately and gets
+a sites-only output named after its first member. Families with the same
+structure share a GraphPeeler (see PeelerCache).
+
+`threads` sets the number of peeling workers and the size of the pool that
+compresses the input and outputs. A run with a `checkpoint` saves its
+progress every `checkpoint_interval` records and resumes from it if the
+file exists. A site store is written as a table of positions and
+log-likelihoods instead.
+*/
+class ModelFit {
+public:
+    struct options_t {
+        double mu{1e-8};
+        double theta{0.001};
+        double ref_bias_hom{0.0};
+        double ref_bias_het{0.0};
+        double ref_bias_hap{0.0};
+
+        int threads{1};  // 0 uses every core
+        bool index{false};
+        bool split_families{false};
+        std::uint64_t region_size{0}; // 0 reads the input with one thread
+        std::filesystem::path checkpoint{};
+        std::uint64_t checkpoint_interval{1000000};
+
+        std::filesystem::path ped{};
+        std::filesystem::path input{};
+        std::filesystem::path output{}; // empty writes to stdout
+
+        // Called after every checkpoint is saved, e.g. to report progress
+        std::function<void(const checkpoint_t&)> on_checkpoint{};
+    };
+
+    explicit ModelFit(options_t options);
+
+    // Returns the total log-likelihood
+    double Run();
+
+    const options_t & options() const { return options_; }
+
+private:
+    options_t options_;
+};
+
+} // namespace mutk
+
+#endif // MUTK_MODELFIT_HPP
@@ -29,6 +29,8 @@
 
 #include <cmath>
 #include <iterator>
+#include <memory>
+#include <optional>
 #include <utility>
 
 #include <boost/math/special_functions/binomial.hpp>
@@ -37,6 +39,28 @@
 
 namespace mutk {
 
+// A k-alleles transition between two haploid variables,
+// P(j|i) = a*I(j == i) + b. Diploids transmit both alleles independently
+// with the haploid transition. A peeler applies such a transition in O(n)
+// time for haploids and O(n^2) time for diploids.
+struct kalleles_operator_t {
+    double a;
+    double b;
+};
+
+// A model factor that is tagged with the k-alleles transition it holds,
+// e.g. from MutationModel::TransitionOperator. The peeler applies tagged
+// transitions as structured operators. `value` must be the dense form of
+// `kalleles`, and is used by peels that contract every factor densely.
+struct model_potential_t {
+    message_t value;
+    std::optional<kalleles_operator_t> kalleles;
+};
+
+namespace detail {
+struct matrix_cache_t;
+} // namespace detail
+
 // A k-alleles model. See Lewis 2001 and Tuffley and Steel 1997.
 //
 // P(j|i) = 1/k * (1-exp(-beta*t)) + I(j == i)*exp(-beta*t)
@@ -56,7 +80,8 @@ public:
     using array_t = mutk::message_t;
 
     MutationModel(float_t k, float_t theta, float_t hom_bias, float_t het_bias, float_t hap_bias) : 
-        k_{k}, theta_{theta}, hom_bias_{hom_bias}, het_bias_{het_bias}, hap_bias_{hap_bias} {
+        k_{k}, theta_{theta}, hom_bias_{hom_bias}, het_bias_{het_bias}, hap_bias_{hap_bias},
+        cache_{MakeCache()} {
 
         float_t e = theta/(k-1.0f);
 
@@ -83,12 +108,43 @@ public:
     float_t het_bias() const { return het_bias_; }
     float_t hap_bias() const { return hap_bias_; }
 
+    // The parameters of the transition matrix of a branch of length t
+    kalleles_operator_t TransitionOperator(float_t t) const;
+
+    // The prior of a founder at a site with n alleles. Allele 0 is the
+    // reference, and the biases shift weight towards or away from it.
+    array_t CreatePriorHaploid(message_size_t n) const;
+    array_t CreatePriorDiploid(message_size_t n) const;
+
+    // ret(i,j) = P(j|i)
+    array_t CreateTransitionMatrix(message_size_t n, float_t t) const;
+    // ret(i,j) = E[num of mutations | i,j]*P(j|i)
+    array_t CreateMeanMatrix(message_size_t n, float_t t) const;
+    // ret(i,j) = P(j & x mutations | i)
+    array_t CreateCountMatrix(message_size_t n, float_t t, int x) const;
+
+    // Cached versions of the above. A matrix only depends on k, n, t and
+    // its kind, so every potential that shares an edge length shares one
+    // matrix. The cache belongs to the model and is shared by its copies.
+    // It holds at most one matrix per edge length, allele count and kind,
+    // and is freed with the last copy. References stay valid as long as a
+    // copy of the model lives. Thread-safe; lookups of cached matrices only
+    // take a shared lock.
+    const array_t & TransitionMatrix(message_size_t n, float_t t) const;
+    const array_t & MeanMatrix(message_size_t n, float_t t) const;
+    const array_t & CountMatrix(message_size_t n, float_t t, int x) const;
+
+    std::size_t num_cached_matrices() const;
+
 protected:
+    static std::shared_ptr<detail::matrix_cache_t> MakeCache();
+
     float_t k_;
     float_t theta_;
     float_t hom_bias_;
     float_t het_bias_;
     float_t hap_bias_;
+    std::shared_ptr<detail::matrix_cache_t> cache_;
 };
 
 namespace mutation_semiring {
@@ -307,7 +363,7 @@ private:
 
 namespace detail {
 // Find right most minimum number. Increase that number by one. Set all values to the left of it to zero
-template<class BidirIt, class ValueType>
+template<class BidirIt>
 bool next_multiset(BidirIt first, BidirIt last) {
     if(first == last) {
         return false;
@@ -323,8 +379,7 @@ bool next_multiset(BidirIt first, BidirIt last) {
 
 template<class T>
 auto MutationMessageBuilder<T>::Create(int n) const -> message_type {
-    message_type::shape_type shape = Shape(n);
-    message_type msg(shape);
+    message_type msg = message_type::from_shape(Shape(n));
 
     using BidirIt = typename std::vector<int>::iterator;
 
@@ -374,7 +429,7 @@ auto MutationMessageBuilder<T>::Create(int n) const -> message_type {
             counter += 1;
         } while(std::any_of(std::next(partitions.begin()), partitions.end(), do_next_order));
 
-        msg.flat(idx++) = mutation_type::Cast(total) / counter;
+        msg.flat(idx++) = mutation_type::AsFloat(total) / counter;
     } while(std::any_of(partitions.begin(), partitions.end(), do_next_multiset));
 
     return msg;
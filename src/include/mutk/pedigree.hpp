@@ -133,6 +133,15 @@ public:
 
     const MemberTable& table() { return table_; }
 
+    // Split the pedigree into families, i.e. groups of members connected
+    // through parent links. Families are ordered by their first member, and
+    // members keep their relative order.
+    std::vector<Pedigree> SplitFamilies() const;
+
+    // The samples of every member, in the order of the members. A sample
+    // that belongs to more than one member is listed once.
+    std::vector<std::string> SampleNames() const;
+
 private:
     MemberTable table_;
     std::unordered_map<std::string,MemberTable::size_type> names_;
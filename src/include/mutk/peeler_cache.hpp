@@ -0,0 +1,94 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_PEELER_CACHE_HPP
+#define MUTK_PEELER_CACHE_HPP
+
+#include "graph.hpp"
+#include "graph_peeler.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace mutk {
+
+/*
+PeelerCache shares GraphPeelers between families whose relationship graphs
+are isomorphic, i.e. they have the same topology, vertex ploidies, edge lengths,
+and vertices with data. The junction tree, contraction plan, and model
+potentials of a peeler can then be computed once for all of them.
+Only the mapping from samples to data potentials differs between
+families.
+
+Graphs are bucketed by a canonical hash computed by color refinement.
+Every candidate match is verified, so a hash collision or a highly symmetric
+graph only costs an extra peeler.
+
+PeelerCache is not thread-safe. Build the entries before peeling starts.
+*/
+class PeelerCache {
+public:
+    using vertex_t = RelationshipGraph::vertex_descriptor;
+
+    struct entry_t {
+        std::shared_ptr<const GraphPeeler> peeler;
+        // vertex_map[v] is the vertex of peeler->graph() that matches
+        // vertex v of the family graph
+        std::vector<vertex_t> vertex_map;
+        // data_samples[i] are the family samples attached to
+        // peeler->data_vertices()[i]
+        std::vector<std::vector<sample_id_t>> data_samples;
+    };
+
+    // If `split_gametes` is set, peelers are created with gamete variables
+    explicit PeelerCache(bool split_gametes = false) : split_gametes_{split_gametes} {}
+
+    entry_t Get(const RelationshipGraph &graph);
+
+    // The number of distinct peelers
+    std::size_t size() const {
+        return num_peelers_;
+    }
+
+private:
+    struct shared_t {
+        std::shared_ptr<const GraphPeeler> peeler;
+        std::vector<vertex_t> canonical_order;
+    };
+    std::unordered_map<std::size_t, std::vector<shared_t>> buckets_;
+    std::size_t num_peelers_{0};
+    bool split_gametes_{false};
+};
+
+// Hash a graph so that isomorphic graphs have the same hash. Labels and
+// sample ids are ignored. If `order` is not null, it receives the vertices
+// sorted by their refined colors.
+std::size_t canonical_graph_hash(const RelationshipGraph &graph,
+    std::vector<RelationshipGraph::vertex_descriptor> *order = nullptr);
+
+} // namespace mutk
+
+#endif // MUTK_PEELER_CACHE_HPP
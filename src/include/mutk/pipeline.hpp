@@ -0,0 +1,685 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_PIPELINE_HPP
+#define MUTK_PIPELINE_HPP
+
+#include "reduction.hpp"
+#include "vcf.hpp"
+#include "detail/bounded_queue.hpp"
+#include "detail/reorder_buffer.hpp"
+#include "detail/stealing_queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace mutk {
+
+// The estimated cost of peeling a site with `n_allele` alleles, relative to
+// a monomorphic site. The largest factors are transition matrices over the
+// genotypes of a parent and child, which grow as the square of the number
+// of diploid genotypes. A 5-allele site costs 25 times a biallelic one.
+constexpr double site_cost(int n_allele) {
+    const double g = (n_allele < 1) ? 1.0 : n_allele*(n_allele+1)/2.0;
+    return g*g;
+}
+
+// Sites are handed to workers in chunks of about this cost
+constexpr double DEFAULT_CHUNK_COST = 32*site_cost(2);
+
+namespace detail {
+
+// Split [0, n) into consecutive chunks whose total `cost(i)` reaches
+// `chunk_cost`, except for the last. Returns the first index of every chunk
+// followed by n.
+template<typename cost_t>
+std::vector<std::size_t> split_by_cost(std::size_t n, double chunk_cost, cost_t cost) {
+    std::vector<std::size_t> bounds = {0};
+    double total = 0.0;
+    for(std::size_t i = 0; i < n; ++i) {
+        total += cost(i);
+        if(total >= chunk_cost && i+1 < n) {
+            bounds.push_back(i+1);
+            total = 0.0;
+        }
+    }
+    if(n > 0) {
+        bounds.push_back(n);
+    }
+    return bounds;
+}
+
+} // namespace detail
+
+/*
+CostExecutor runs ranges of items on a pool of worker threads, balanced by
+their estimated cost.
+
+Submit splits the items of a task into consecutive chunks of about
+`chunk_cost` (see site_cost) and deals them out to the workers, so that each
+worker gets a contiguous run of a task's chunks. A worker that runs out of
+chunks steals from the end of another worker's run, so a cluster of
+expensive items does not leave the rest of the pool waiting.
+
+Chunks can be submitted before or after Start and from any one thread.
+Close ends the submissions, and the workers exit once every chunk is done.
+The first exception thrown by a worker stops the others.
+*/
+template<typename task_t>
+class CostExecutor {
+public:
+    struct options_t {
+        int num_workers{1};
+        double chunk_cost{DEFAULT_CHUNK_COST};
+    };
+
+    explicit CostExecutor(options_t options) : options_{options},
+        chunks_{static_cast<std::size_t>(std::max(options.num_workers, 1))} {
+        options_.num_workers = std::max(options_.num_workers, 1);
+        options_.chunk_cost = std::max(options_.chunk_cost, 0.0);
+    }
+
+    CostExecutor(const CostExecutor&) = delete;
+    CostExecutor& operator=(const CostExecutor&) = delete;
+
+    ~CostExecutor() {
+        stop_ = true;
+        chunks_.Close();
+        Join();
+    }
+
+    // Queue the items [0, n) of `task`, where `cost(i)` is the estimated
+    // cost of item i. Returns the number of chunks.
+    template<typename cost_t>
+    std::size_t Submit(task_t task, std::size_t n, cost_t cost) {
+        const auto bounds = detail::split_by_cost(n, options_.chunk_cost, cost);
+        const std::size_t num_chunks = bounds.size()-1;
+        const std::size_t num_workers = options_.num_workers;
+        // Each task starts where the last one ended, so tasks with fewer
+        // chunks than workers do not all land on the first few workers
+        const std::size_t spread = std::max(num_chunks, num_workers);
+        for(std::size_t c = 0; c < num_chunks; ++c) {
+            const std::size_t worker = (next_worker_ + c*num_workers/spread) % num_workers;
+            chunks_.Push(worker, chunk_t{task, bounds[c], bounds[c+1]});
+        }
+        next_worker_ = (next_worker_ + std::min(num_chunks, num_workers)) % num_workers;
+        return num_chunks;
+    }
+
+    // No more chunks will be submitted
+    void Close() { chunks_.Close(); }
+
+    // Start the workers. `make_worker()` is called once per worker on the
+    // calling thread, so factories do not need to be thread safe. Workers
+    // call `body(worker, task, first, last)` for every chunk. The last
+    // worker to exit calls `on_exit(error)`, where `error` is the first
+    // exception thrown by `body` or null.
+    template<typename factory_t, typename body_t, typename exit_t>
+    void Start(factory_t make_worker, body_t body, exit_t on_exit);
+
+    template<typename factory_t, typename body_t>
+    void Start(factory_t make_worker, body_t body) {
+        Start(make_worker, body, [](std::exception_ptr) {});
+    }
+
+    // Wait for the workers to exit. Returns the first exception thrown by
+    // `body`, or null.
+    std::exception_ptr Join() {
+        for(auto &&t : threads_) {
+            t.join();
+        }
+        threads_.clear();
+        return error_;
+    }
+
+    const options_t & options() const { return options_; }
+
+private:
+    struct chunk_t {
+        task_t task;
+        std::size_t first;
+        std::size_t last;
+    };
+
+    options_t options_;
+    detail::StealingQueue<chunk_t> chunks_;
+    std::size_t next_worker_{0};
+
+    std::vector<std::thread> threads_;
+    std::atomic<int> active_workers_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
+
+template<typename task_t>
+template<typename factory_t, typename body_t, typename exit_t>
+void CostExecutor<task_t>::Start(factory_t make_worker, body_t body, exit_t on_exit) {
+    using worker_t = decltype(make_worker());
+    auto worker_states = std::make_shared<std::vector<worker_t>>();
+    worker_states->reserve(options_.num_workers);
+    for(int i = 0; i < options_.num_workers; ++i) {
+        worker_states->push_back(make_worker());
+    }
+
+    active_workers_ = options_.num_workers;
+    for(int i = 0; i < options_.num_workers; ++i) {
+        threads_.emplace_back([this, i, worker_states, body, on_exit]() mutable {
+            auto &worker = (*worker_states)[i];
+            try {
+                while(!stop_) {
+                    auto chunk = chunks_.Pop(i);
+                    if(!chunk) {
+                        break;
+                    }
+                    body(worker, chunk->task, chunk->first, chunk->last);
+                }
+            } catch(...) {
+                {
+                    std::lock_guard<std::mutex> lock{error_mutex_};
+                    if(!error_) {
+                        error_ = std::current_exception();
+                    }
+                }
+                stop_ = true;
+                chunks_.Close();
+            }
+            if(--active_workers_ == 0) {
+                // every other worker has exited, so error_ is final
+                on_exit(error_);
+            }
+        });
+    }
+}
+
+/*
+SitePipeline processes the records of a vcf::Reader in three stages:
+
+  1. A reader thread parses records into batches.
+  2. A CostExecutor processes the records of each batch, in chunks of
+     about `chunk_cost` (see site_cost), so a cluster of multi-allelic
+     sites does not leave the rest of the pool waiting.
+  3. The calling thread passes the results to an output function in the
+     order that the records were read. Finished batches wait in a
+     detail::ReorderBuffer until every earlier batch has been output.
+
+Batches are recycled through a fixed pool, so a slow stage stalls the
+stages upstream of it instead of letting memory grow without bound. The
+output is the same for any number of workers.
+*/
+template<typename result_t>
+class SitePipeline {
+public:
+    struct options_t {
+        int num_workers{1};
+        int batch_size{256};
+        int max_batches{0}; // 0 picks a default based on num_workers
+        std::uint64_t skip_records{0}; // records to discard, e.g. when resuming
+        double chunk_cost{DEFAULT_CHUNK_COST};
+    };
+
+    explicit SitePipeline(options_t options) : options_{options} {
+        options_.num_workers = std::max(options_.num_workers, 1);
+        options_.batch_size = std::max(options_.batch_size, 1);
+        options_.chunk_cost = std::max(options_.chunk_cost, 0.0);
+        if(options_.max_batches <= 0) {
+            options_.max_batches = 2*options_.num_workers+2;
+        }
+    }
+
+    // `make_worker()` is called once per worker and returns a callable with
+    // the signature `result_t(const bcf_hdr_t*, bcf1_t*)`. Each worker owns
+    // its state, e.g. buffers and peeling workspaces. Records are unpacked
+    // by the workers according to `reader.unpack()`.
+    //
+    // `output(const bcf_hdr_t*, bcf1_t*, result_t&)` is called on the calling
+    // thread for every record, in input order.
+    template<typename factory_t, typename output_t>
+    void operator()(vcf::Reader &reader, factory_t make_worker, output_t output);
+
+    const options_t & options() const { return options_; }
+
+private:
+    struct batch_t {
+        std::size_t sequence{0};
+        std::size_t size{0};
+        std::vector<std::unique_ptr<bcf1_t, vcf::detail::bcf_free_t>> records;
+        std::vector<result_t> results;
+        std::atomic<std::size_t> remaining{0}; // records not yet processed
+    };
+
+    options_t options_;
+};
+
+template<typename result_t>
+template<typename factory_t, typename output_t>
+void SitePipeline<result_t>::operator()(vcf::Reader &reader, factory_t make_worker, output_t output) {
+    const std::size_t num_batches = options_.max_batches;
+    const std::size_t batch_size = options_.batch_size;
+
+    // allocate every batch up front
+    std::vector<batch_t> batches(num_batches);
+    for(auto &&batch : batches) {
+        batch.records.reserve(batch_size);
+        for(std::size_t i = 0; i < batch_size; ++i) {
+            batch.records.emplace_back(bcf_init());
+            if(!batch.records.back()) {
+                throw std::bad_alloc{};
+            }
+        }
+        batch.results.resize(batch_size);
+    }
+
+    detail::BoundedQueue<batch_t*> free_queue{num_batches};
+    detail::ReorderBuffer<batch_t*> done_queue{num_batches};
+    CostExecutor<batch_t*> executor{{options_.num_workers, options_.chunk_cost}};
+    for(auto &&batch : batches) {
+        free_queue.Push(&batch);
+    }
+
+    // The first exception thrown by any stage shuts down the pipeline and
+    // is rethrown on the calling thread. Nothing is output after it, so a
+    // failed run does not keep writing the batches that were finished.
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock{error_mutex};
+            if(!error) {
+                error = e;
+            }
+        }
+        failed = true;
+        free_queue.Close();
+        executor.Close();
+        done_queue.Close();
+    };
+
+    // Stage 2: process batches. The worker that finishes a batch passes it
+    // on.
+    executor.Start(make_worker,
+        [&](auto &work, batch_t *b, std::size_t first, std::size_t last) {
+        try {
+            for(std::size_t j = first; j < last; ++j) {
+                reader.Unpack(b->records[j].get());
+                b->results[j] = work(reader.header(), b->records[j].get());
+            }
+        } catch(...) {
+            fail(std::current_exception());
+            throw;
+        }
+        if((b->remaining -= last-first) == 0) {
+            done_queue.Push(b->sequence, b);
+        }
+    }, [&](std::exception_ptr) { done_queue.Close(); });
+
+    // Stage 1: parse records into batches
+    std::thread reader_thread([&]() {
+        try {
+            // Records handled by an earlier run are read and discarded
+            if(options_.skip_records > 0) {
+                std::unique_ptr<bcf1_t, vcf::detail::bcf_free_t> skipped{bcf_init()};
+                if(!skipped) {
+                    throw std::bad_alloc{};
+                }
+                for(std::uint64_t i = 0; i < options_.skip_records; ++i) {
+                    if(!reader.Read(skipped.get())) {
+                        throw std::runtime_error("input ended before the records to skip.");
+                    }
+                }
+            }
+            std::size_t sequence = 0;
+            bool more = true;
+            while(more) {
+                auto batch = free_queue.Pop();
+                if(!batch) {
+                    break;
+                }
+                batch_t *b = *batch;
+                b->size = 0;
+                while(b->size < batch_size) {
+                    if(!reader.Read(b->records[b->size].get())) {
+                        more = false;
+                        break;
+                    }
+                    b->size += 1;
+                }
+                if(b->size == 0) {
+                    break;
+                }
+                b->sequence = sequence++;
+                b->remaining = b->size;
+                executor.Submit(b, b->size,
+                    [&](std::size_t j) { return site_cost(b->records[j]->n_allele); });
+            }
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        executor.Close();
+    });
+
+    // Stage 3: output results in input order
+    try {
+        while(auto batch = done_queue.Pop()) {
+            batch_t *b = *batch;
+            for(std::size_t j = 0; j < b->size && !failed; ++j) {
+                output(reader.header(), b->records[j].get(), b->results[j]);
+            }
+            if(failed) {
+                break;
+            }
+            free_queue.Push(b);
+        }
+    } catch(...) {
+        fail(std::current_exception());
+    }
+
+    reader_thread.join();
+    executor.Join();
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Call `body(worker, i)` for every i in [0, n) using `num_workers` threads.
+// Each thread owns a worker created by `make_worker()` on the calling thread.
+// The indexes are run by a CostExecutor in chunks whose total `cost(i)` is
+// about `chunk_cost`. The first exception thrown by `body` stops the loop
+// and is rethrown on the calling thread.
+template<typename factory_t, typename cost_t, typename body_t>
+void parallel_for(std::size_t n, double chunk_cost, cost_t cost, int num_workers,
+    factory_t make_worker, body_t body) {
+    CostExecutor<std::nullptr_t> executor{{num_workers, chunk_cost}};
+    executor.Submit(nullptr, n, cost);
+    executor.Close();
+    executor.Start(make_worker,
+        [&](auto &worker, std::nullptr_t, std::size_t first, std::size_t last) {
+        for(std::size_t i = first; i < last; ++i) {
+            body(worker, i);
+        }
+    });
+    if(auto error = executor.Join()) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Call `body(worker, i)` for every i in [0, n), with chunks of `chunk_size`
+// indexes
+template<typename factory_t, typename body_t>
+void parallel_for(std::size_t n, std::size_t chunk_size, int num_workers,
+    factory_t make_worker, body_t body) {
+    parallel_for(n, static_cast<double>(std::max<std::size_t>(chunk_size, 1)),
+        [](std::size_t) { return 1.0; }, num_workers, make_worker, body);
+}
+
+// Returns the sum of `f(i)` for every i in [0, n) using `num_workers`
+// threads. Values are summed in blocks of `block_size` that do not depend
+// on the number of threads, and the blocks are combined in order, so the
+// result has the same bits as BlockSum::Add over the values in order.
+template<typename body_t>
+double parallel_sum(std::size_t n, std::size_t block_size, int num_workers, body_t f) {
+    block_size = std::max<std::size_t>(block_size, 1);
+    std::vector<double> partials((n + block_size - 1)/block_size);
+    parallel_for(partials.size(), 1, num_workers, []() { return 0; },
+        [&](int, std::size_t b) {
+        CompensatedSum sum;
+        const std::size_t last = std::min(n, (b+1)*block_size);
+        for(std::size_t i = b*block_size; i < last; ++i) {
+            sum.Add(f(i));
+        }
+        partials[b] = sum.value();
+    });
+    BlockSum total(block_size);
+    for(auto x : partials) {
+        total.AddBlock(x);
+    }
+    return total.value();
+}
+
+/*
+RegionPipeline processes an indexed VCF/BCF file by splitting it into
+regions of roughly equal record counts (see vcf::plan_regions). Each worker
+thread opens its own vcf::RegionReader, so decoding scales with the number
+of workers instead of being limited to a single reader thread.
+
+Completed records are passed to the output function in coordinate order.
+Workers stream the records of a region in batches of `batch_size`, and a
+region holds at most `max_batches` batches until they are output. A worker
+that gets ahead of the output waits for one to be returned. At most
+`max_pending` regions are in flight, so memory is bounded by
+`max_pending*max_batches*batch_size` records, whatever the size of a
+region.
+*/
+template<typename result_t>
+class RegionPipeline {
+public:
+    struct options_t {
+        int num_workers{1};
+        std::uint64_t records_per_region{100000};
+        int max_pending{0}; // 0 picks a default based on num_workers
+        int batch_size{256};
+        int max_batches{4}; // per region
+        int unpack{vcf::unpack::NONE}; // fields to decode for each record
+    };
+
+    explicit RegionPipeline(options_t options) : options_{options} {
+        options_.num_workers = std::max(options_.num_workers, 1);
+        if(options_.max_pending <= 0) {
+            options_.max_pending = 2*options_.num_workers;
+        }
+        options_.max_pending = std::max(options_.max_pending, options_.num_workers);
+        options_.batch_size = std::max(options_.batch_size, 1);
+        options_.max_batches = std::max(options_.max_batches, 1);
+    }
+
+    // `make_worker` and `output` have the same requirements as in
+    // SitePipeline. `samples` restricts the samples read from `path`.
+    template<typename factory_t, typename output_t>
+    void operator()(const std::filesystem::path &path, const std::vector<const char*> &samples,
+        factory_t make_worker, output_t output);
+
+    const options_t & options() const { return options_; }
+
+private:
+    struct batch_t {
+        std::size_t size{0};
+        std::vector<std::unique_ptr<bcf1_t, vcf::detail::bcf_free_t>> records;
+        std::vector<result_t> results;
+    };
+
+    // Batches cycle between the worker of a region, through `filled`, and
+    // the output, through `empty`. The worker closes `filled` once the
+    // region is done.
+    struct shard_t {
+        std::unique_ptr<vcf::RegionReader> reader;
+        std::vector<batch_t> batches;
+        detail::BoundedQueue<batch_t*> filled;
+        detail::BoundedQueue<batch_t*> empty;
+
+        explicit shard_t(std::size_t max_batches) : filled{max_batches}, empty{max_batches} {}
+    };
+
+    options_t options_;
+};
+
+template<typename result_t>
+template<typename factory_t, typename output_t>
+void RegionPipeline<result_t>::operator()(const std::filesystem::path &path,
+    const std::vector<const char*> &samples, factory_t make_worker, output_t output) {
+    const auto regions = vcf::plan_regions(path, options_.records_per_region);
+    const std::size_t batch_size = options_.batch_size;
+    const std::size_t max_batches = options_.max_batches;
+    std::vector<std::unique_ptr<shard_t>> shards;
+    shards.reserve(regions.size());
+    for(std::size_t r = 0; r < regions.size(); ++r) {
+        shards.push_back(std::make_unique<shard_t>(max_batches));
+    }
+
+    // A worker must hold a ticket to start a region, and tickets are only
+    // returned after a region is output. This bounds the number of regions
+    // in memory. Because regions are claimed in order, the region that is
+    // next to be output is always being worked on, and its batches are
+    // always being returned, so this cannot deadlock.
+    const std::size_t max_pending = options_.max_pending;
+    detail::BoundedQueue<int> tickets{max_pending};
+    for(std::size_t i = 0; i < max_pending; ++i) {
+        tickets.Push(0);
+    }
+
+    // Nothing is output after the first exception
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock{error_mutex};
+            if(!error) {
+                error = e;
+            }
+        }
+        failed = true;
+        tickets.Close();
+        for(auto &&shard : shards) {
+            shard->filled.Close();
+            shard->empty.Close();
+        }
+    };
+
+    using worker_t = decltype(make_worker());
+    std::vector<worker_t> worker_states;
+    worker_states.reserve(options_.num_workers);
+    for(int i = 0; i < options_.num_workers; ++i) {
+        worker_states.push_back(make_worker());
+    }
+
+    std::atomic<std::size_t> next_region{0};
+    std::vector<std::thread> worker_threads;
+    for(int i = 0; i < options_.num_workers; ++i) {
+        worker_threads.emplace_back([&, i]() {
+            auto &work = worker_states[i];
+            try {
+                while(tickets.Pop()) {
+                    std::size_t r = next_region++;
+                    if(r >= regions.size()) {
+                        // wake any workers still waiting for a ticket
+                        tickets.Close();
+                        break;
+                    }
+                    shard_t &shard = *shards[r];
+                    shard.reader = std::make_unique<vcf::RegionReader>(path, regions[r], samples);
+                    shard.reader->SetUnpack(options_.unpack);
+                    shard.batches.resize(max_batches);
+                    for(auto &&batch : shard.batches) {
+                        batch.records.reserve(batch_size);
+                        for(std::size_t j = 0; j < batch_size; ++j) {
+                            batch.records.emplace_back(bcf_init());
+                            if(!batch.records.back()) {
+                                throw std::bad_alloc{};
+                            }
+                        }
+                        batch.results.resize(batch_size);
+                        shard.empty.Push(&batch);
+                    }
+
+                    bool more = true;
+                    while(more) {
+                        auto batch = shard.empty.Pop();
+                        if(!batch) {
+                            break; // the pipeline has failed
+                        }
+                        batch_t *b = *batch;
+                        b->size = 0;
+                        while(b->size < batch_size) {
+                            bcf1_t *record = shard.reader->Next();
+                            if(record == nullptr) {
+                                more = false;
+                                break;
+                            }
+                            b->results[b->size] = work(shard.reader->header(), record);
+                            if(bcf_copy(b->records[b->size].get(), record) == nullptr) {
+                                throw std::bad_alloc{};
+                            }
+                            b->size += 1;
+                        }
+                        if(b->size > 0 && !shard.filled.Push(b)) {
+                            break;
+                        }
+                    }
+                    shard.filled.Close();
+                }
+            } catch(...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+
+    // Output regions in coordinate order
+    try {
+        for(std::size_t r = 0; r < regions.size() && !failed; ++r) {
+            shard_t &shard = *shards[r];
+            while(auto batch = shard.filled.Pop()) {
+                batch_t *b = *batch;
+                for(std::size_t j = 0; j < b->size && !failed; ++j) {
+                    output(shard.reader->header(), b->records[j].get(), b->results[j]);
+                }
+                if(failed) {
+                    break;
+                }
+                shard.empty.Push(b);
+            }
+            if(failed) {
+                break;
+            }
+            // The worker is done with the region once it closes `filled`
+            shard.batches.clear();
+            shard.batches.shrink_to_fit();
+            shard.reader.reset();
+            tickets.Push(0);
+        }
+    } catch(...) {
+        fail(std::current_exception());
+    }
+
+    for(auto &&t : worker_threads) {
+        t.join();
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace mutk
+
+#endif // MUTK_PIPELINE_HPP
@@ -0,0 +1,104 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_PL_DECODER_HPP
+#define MUTK_PL_DECODER_HPP
+
+#include "message.hpp"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace mutk {
+
+// How the PLs of a single sample were encoded in a record.
+enum struct PlEncoding : std::int8_t {
+    Missing = 0,  // first value is missing; data is uninformative
+    Haploid = 1,  // n values
+    Diploid = 2,  // n(n+1)/2 values
+    Invalid = 3   // any other width
+};
+
+/*
+PlDecoder converts the FORMAT/PL block of a record into a matrix of
+genotype likelihoods in a single pass.
+
+Each sample occupies one row of num_diploids(n) values, and each row is
+normalized so that its most likely genotype has a likelihood of 1. Rows of
+samples with missing data are filled with 1s. Integer PLs are converted
+using a lookup table, and the width of each row is measured without
+branching so that the inner loops can be vectorized by the compiler.
+*/
+class PlDecoder {
+public:
+    // PLs larger than this underflow a float and are decoded as 0.
+    static constexpr int TABLE_SIZE = 512;
+
+    PlDecoder() = default;
+
+    // Decode `num_samples` rows of `stride` PLs from a record with `num_alleles` alleles.
+    // If `columns` is given, row i is decoded from column `columns[i]` of `pl`,
+    // e.g. a gather map from vcf::SampleIndex.
+    void Decode(const std::int32_t *pl, int num_samples, int stride, int num_alleles,
+        const int *columns = nullptr);
+
+    // Copy the likelihoods of `sample` into a message for a node of ploidy `ploidy`.
+    // Haploid nodes can use haploid PLs or the homozygotes of diploid PLs.
+    // Returns false if the encoding of the sample can not be used.
+    bool Extract(int sample, Ploidy ploidy, message_t *msg) const;
+
+    int num_samples() const { return num_samples_; }
+    int num_alleles() const { return num_alleles_; }
+    message_size_t width() const { return width_; }
+
+    PlEncoding encoding(int sample) const { return encodings_[sample]; }
+
+    const float_t * row(int sample) const {
+        return values_.data() + sample*width_;
+    }
+
+    // Convert a normalized PL to a likelihood via the lookup table.
+    static float_t Unphred(std::int32_t pl) {
+        return table()[clamp_index(static_cast<std::uint32_t>(pl))];
+    }
+
+private:
+    static const std::array<float_t, TABLE_SIZE> & table();
+
+    static constexpr std::uint32_t clamp_index(std::uint32_t x) {
+        return (x < TABLE_SIZE-1) ? x : TABLE_SIZE-1;
+    }
+
+    int num_samples_{0};
+    int num_alleles_{0};
+    message_size_t width_{0};
+
+    std::vector<float_t> values_;
+    std::vector<PlEncoding> encodings_;
+};
+
+} // namespace mutk
+
+#endif // MUTK_PL_DECODER_HPP
@@ -29,6 +29,7 @@
 #include "mutation.hpp"
 
 #include <boost/container/flat_set.hpp>
+#include <optional>
 #include <vector>
 
 namespace mutk {
@@ -73,6 +74,17 @@ class Potential {
     virtual message_t Create(message_size_t n, some_t) = 0;
     virtual message_t Create(message_size_t n, mean_t) = 0;
 
+    // The k-alleles transition held by Create(n, ANY), if it is one
+    virtual std::optional<kalleles_operator_t> TransitionOperator() const {
+        return std::nullopt;
+    }
+
+    // Create(n, ANY) tagged with TransitionOperator(), so that GraphPeeler
+    // can apply it as a structured operator
+    model_potential_t CreateModelPotential(message_size_t n) {
+        return {Create(n, ANY), TransitionOperator()};
+    }
+
     static constexpr any_t  ANY{0};
     static constexpr mean_t MEAN{1};
     static constexpr some_t ZERO{0};
@@ -140,6 +152,53 @@ void mutk::MutationPotential::AddTransition(message_t::size_type child, message_
     one_count_builder_.AddTransition(child, parent, weight, {model_.k(), (float_t)u});
 }
 
+// P(child|parent) when the parent clones itself along a branch of length
+// `u`. The axes follow the labels. Clones of the same ploidy are k-alleles
+// transitions.
+class CloningPotential : public Potential {
+ public:
+    template<typename... Args>
+    CloningPotential(const MutationModel &model, float_t u, Args&&... args) :
+        Potential(std::forward<Args>(args)...), model_{model}, u_{u}
+    { }
+
+    virtual message_t Create(message_size_t n, any_t) override;
+    virtual message_t Create(message_size_t n, some_t) override;
+    virtual message_t Create(message_size_t n, mean_t) override;
+
+    virtual std::optional<kalleles_operator_t> TransitionOperator() const override;
+
+ protected:
+    struct Impl;
+
+    MutationModel model_;
+    float_t u_;
+};
+
+// P(child|parent) when the parent self-fertilizes. The two gametes mutate
+// along branches of lengths `u` and `v`. The axes follow the labels. Only
+// a haploid parent with a haploid child is a k-alleles transition.
+class SelfingPotential : public Potential {
+ public:
+    template<typename... Args>
+    SelfingPotential(const MutationModel &model, float_t u, float_t v, Args&&... args) :
+        Potential(std::forward<Args>(args)...), model_{model}, u_{u}, v_{v}
+    { }
+
+    virtual message_t Create(message_size_t n, any_t) override;
+    virtual message_t Create(message_size_t n, some_t) override;
+    virtual message_t Create(message_size_t n, mean_t) override;
+
+    virtual std::optional<kalleles_operator_t> TransitionOperator() const override;
+
+ protected:
+    struct Impl;
+
+    MutationModel model_;
+    float_t u_;
+    float_t v_;
+};
+
 // Possible Potentials:
 // 2 x 2 -> 2 (selfing)
 // 2 x 2 -> 1 (selfing)
@@ -0,0 +1,109 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_REDUCTION_HPP
+#define MUTK_REDUCTION_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace mutk {
+
+// Neumaier's variant of Kahan summation
+class CompensatedSum {
+public:
+    CompensatedSum() = default;
+    CompensatedSum(double sum, double compensation) : sum_{sum}, compensation_{compensation} {}
+
+    void Add(double x) {
+        double t = sum_ + x;
+        if(std::fabs(sum_) >= std::fabs(x)) {
+            compensation_ += (sum_ - t) + x;
+        } else {
+            compensation_ += (x - t) + sum_;
+        }
+        sum_ = t;
+    }
+
+    double value() const {
+        return sum_ + compensation_;
+    }
+
+    double sum() const { return sum_; }
+    double compensation() const { return compensation_; }
+
+private:
+    double sum_{0.0};
+    double compensation_{0.0};
+};
+
+/*
+BlockSum adds a sequence of values so that the result only depends on the
+values and their order. Values are summed with compensation in blocks of
+`block_size`, and the block sums are combined pairwise, like a binary
+counter, so that only O(log n) partial sums are kept.
+
+Because block boundaries are fixed, the blocks can be summed in parallel
+and passed to AddBlock in order (see parallel_sum in pipeline.hpp), and the
+result is bitwise identical to adding every value on one thread.
+*/
+class BlockSum {
+public:
+    static constexpr std::size_t DEFAULT_BLOCK_SIZE = 4096;
+
+    explicit BlockSum(std::size_t block_size = DEFAULT_BLOCK_SIZE);
+
+    void Add(double x) {
+        block_.Add(x);
+        if(++count_ == block_size_) {
+            AddBlock(block_.value());
+            block_ = {};
+            count_ = 0;
+        }
+    }
+
+    // Add the sum of a complete block. Must not be mixed with a partial
+    // block from Add().
+    void AddBlock(double partial);
+
+    double value() const;
+
+    std::size_t block_size() const { return block_size_; }
+
+    // The state of the sum as a list of values, e.g. for checkpoints
+    std::vector<double> State() const;
+    void SetState(const std::vector<double> &state);
+
+private:
+    std::size_t block_size_;
+    std::size_t count_{0};
+    CompensatedSum block_;
+    std::vector<std::pair<double, int>> levels_; // pairwise sums and their levels
+};
+
+} // namespace mutk
+
+#endif // MUTK_REDUCTION_HPP
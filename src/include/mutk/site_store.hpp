@@ -0,0 +1,168 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_SITE_STORE_HPP
+#define MUTK_SITE_STORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace mutk {
+
+/*
+A site store is a compact, binary copy of the PLs that an analysis needs
+from a VCF/BCF file. It is written once with SiteStoreWriter and then
+memory-mapped by SiteStore, so that repeated scans avoid decompressing and
+parsing the VCF.
+
+Sites are grouped into blocks of `block_size` sites. Each block stores its
+columns contiguously:
+
+    rid         int32[n]
+    pos         int64[n]
+    n_allele    uint8[n]
+    stride      uint8[n]    PL values per sample
+    pl_offset   uint64[n]   first PL of each site within the block
+    missing     uint64[ceil(n*num_samples/64)]   bitmap of missing PLs
+    width       uint8[n*num_samples]   non-padding PLs of each sample
+    pl          uint8 or uint16[sum(stride)*num_samples]
+
+PLs are stored as uint8 when every PL in the block fits, and as uint16
+otherwise. Larger PLs are clamped to 65535, which is still far beyond the
+point where their likelihood underflows. Every column starts on an 8-byte
+boundary.
+*/
+
+class SiteStoreWriter {
+public:
+    static constexpr int DEFAULT_BLOCK_SIZE = 4096;
+
+    SiteStoreWriter(const std::filesystem::path &path,
+        const std::vector<std::string> &contig_names,
+        const std::vector<std::string> &sample_names,
+        int block_size = DEFAULT_BLOCK_SIZE);
+
+    SiteStoreWriter(const SiteStoreWriter&) = delete;
+    SiteStoreWriter& operator=(const SiteStoreWriter&) = delete;
+
+    ~SiteStoreWriter();
+
+    // Add a site. `pl` holds `stride` values per sample in htslib's
+    // encoding, and may be null if `stride` is 0.
+    void Add(std::int32_t rid, std::int64_t pos, int n_allele,
+        const std::int32_t *pl, int stride);
+
+    // Write the final block and the block index.
+    void Close();
+
+    std::uint64_t num_sites() const { return num_sites_; }
+
+private:
+    void FlushBlock();
+
+    std::ofstream output_;
+    int num_samples_;
+    int block_size_;
+    std::uint64_t num_sites_{0};
+    std::vector<std::uint64_t> block_offsets_;
+
+    // columns of the current block
+    std::vector<std::int32_t> rid_;
+    std::vector<std::int64_t> pos_;
+    std::vector<std::uint8_t> n_allele_;
+    std::vector<std::uint8_t> stride_;
+    std::vector<std::uint64_t> pl_offset_;
+    std::vector<std::uint8_t> missing_;
+    std::vector<std::uint8_t> width_;
+    std::vector<std::uint16_t> pl_;
+};
+
+class SiteStore {
+public:
+    struct site_t {
+        std::int32_t rid;
+        std::int64_t pos;
+        int n_allele;
+        int stride;
+    };
+
+    explicit SiteStore(const std::filesystem::path &path);
+
+    SiteStore(const SiteStore&) = delete;
+    SiteStore& operator=(const SiteStore&) = delete;
+
+    ~SiteStore();
+
+    // Returns true if `path` begins with the magic bytes of a site store.
+    static bool IsSiteStore(const std::filesystem::path &path);
+
+    std::uint64_t num_sites() const { return num_sites_; }
+    std::size_t num_blocks() const { return blocks_.size(); }
+    int block_size() const { return block_size_; }
+    int num_samples() const { return static_cast<int>(sample_names_.size()); }
+
+    const std::vector<std::string> & contig_names() const { return contig_names_; }
+    const std::vector<std::string> & sample_names() const { return sample_names_; }
+
+    site_t site(std::uint64_t i) const;
+
+    bool is_missing(std::uint64_t i, int sample) const;
+
+    // Reconstruct the PLs of site `i` in htslib's encoding, including the
+    // missing and vector_end sentinels. Returns the number of values.
+    int GetPl(std::uint64_t i, std::vector<std::int32_t> *pl) const;
+
+private:
+    struct block_t {
+        std::uint32_t size;
+        std::uint32_t pl_bytes;
+        const std::int32_t *rid;
+        const std::int64_t *pos;
+        const std::uint8_t *n_allele;
+        const std::uint8_t *stride;
+        const std::uint64_t *pl_offset;
+        const std::uint64_t *missing;
+        const std::uint8_t *width;
+        const void *pl;
+    };
+
+    std::pair<const block_t*, std::uint32_t> locate(std::uint64_t i) const;
+
+    const char *data_{nullptr};
+    std::size_t size_{0};
+
+    int block_size_{0};
+    std::uint64_t num_sites_{0};
+    std::vector<std::string> contig_names_;
+    std::vector<std::string> sample_names_;
+    std::vector<block_t> blocks_;
+};
+
+} // namespace mutk
+
+#endif // MUTK_SITE_STORE_HPP
@@ -22,13 +22,22 @@ SOFTWARE.
 #ifndef MUTK_VCF_HPP
 #define MUTK_VCF_HPP
 
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/tbx.h>
+#include <htslib/thread_pool.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <chrono>
+#include <cstdint>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace mutk {
@@ -50,8 +59,79 @@ struct header_free_t {
 struct bcf_free_t {
     void operator()(void *ptr) const { bcf_destroy(static_cast<bcf1_t *>(ptr)); }
 };
+struct index_free_t {
+    void operator()(void *ptr) const { hts_idx_destroy(static_cast<hts_idx_t *>(ptr)); }
+};
+struct tbx_free_t {
+    void operator()(void *ptr) const { tbx_destroy(static_cast<tbx_t *>(ptr)); }
+};
+struct synced_reader_free_t {
+    void operator()(void *ptr) const { bcf_sr_destroy(static_cast<bcf_srs_t *>(ptr)); }
+};
+
+// Construct a sample list in the format used by bcf_hdr_set_samples
+inline std::string join_samples(const std::vector<const char*> &samples, bool inverse) {
+    std::string str;
+    if(inverse) {
+        str += "^";
+    }
+    for(std::size_t i=0;i<samples.size();++i) {
+        if(i > 0) {
+            str += ",";
+        }
+        str += samples[i];
+    }
+    return str;
+}
 }  // namespace detail
 
+// Fields that can be declared for unpacking. Core fields, e.g. `pos` and
+// `n_allele`, are always available. Fields that are not declared stay
+// packed until an htslib accessor unpacks them on demand.
+namespace unpack {
+constexpr int NONE = 0;
+constexpr int ALLELES = BCF_UN_STR;
+constexpr int FILTER = BCF_UN_FLT;
+constexpr int INFO = BCF_UN_INFO;
+constexpr int FORMAT = BCF_UN_FMT;
+constexpr int ALL = BCF_UN_ALL;
+} // namespace unpack
+
+/*
+ThreadPool owns a pool of htslib worker threads that several files share
+for BGZF compression and decompression. Attach it to readers and writers
+with SetThreadPool. The pool must outlive every file that uses it, so
+declare it before them.
+*/
+class ThreadPool {
+   public:
+    // A pool of `n` threads. With fewer than two threads no pool is created
+    // and files are processed on the calling thread.
+    explicit ThreadPool(int n) {
+        if(n > 1) {
+            pool_.pool = hts_tpool_init(n);
+            if(pool_.pool == nullptr) {
+                throw std::runtime_error("unable to create thread pool.");
+            }
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        if(pool_.pool != nullptr) {
+            hts_tpool_destroy(pool_.pool);
+        }
+    }
+
+    // Returns nullptr if the pool has no threads
+    htsThreadPool *get() { return (pool_.pool != nullptr) ? &pool_ : nullptr; }
+
+   protected:
+    htsThreadPool pool_{nullptr, 0};
+};
+
 class Reader {
    public:
     explicit Reader(const std::filesystem::path &path) {
@@ -67,26 +147,57 @@ class Reader {
 
     bcf_hdr_t *header() { return header_.get(); }
     const bcf_hdr_t *header() const { return header_.get(); }
-    
+
+    bool is_bcf() const { return hts_get_format(input_.get())->format == bcf; }
 
     std::pair<const char *const*, int> samples() const {
         return {header()->samples, bcf_hdr_nsamples(header())};
     }
 
+    // Restrict the samples that are decoded. Unused samples are dropped
+    // while parsing, so this must be called before the first record is read.
     int SetSamples(const std::vector<const char*> &samples, bool inverse=false) {
+        if(started_) {
+            throw std::logic_error("unable to change samples after reading has started.");
+        }
         if(samples.empty()) {
             return bcf_hdr_set_samples(header(), nullptr, 0);
         }
-        std::string str;
-        if(inverse) {
-            str += "^";
+        std::string str = detail::join_samples(samples, inverse);
+        return bcf_hdr_set_samples(header(), str.c_str(), 0);
+    }
+
+    // Use a pool of `n` threads to decompress BGZF input.
+    int SetThreads(int n) {
+        return (n > 1) ? hts_set_threads(input_.get(), n) : 0;
+    }
+
+    // Decompress BGZF input with a pool that is shared with other files.
+    int SetThreadPool(ThreadPool &pool) {
+        return (pool.get() != nullptr) ? hts_set_thread_pool(input_.get(), pool.get()) : 0;
+    }
+
+    // Declare the fields, as a combination of unpack:: flags, that Unpack
+    // will decode.
+    void SetUnpack(int fields) { unpack_ = fields; }
+    int unpack() const { return unpack_; }
+
+    // Decode the declared fields of a record. This is separate from Read so
+    // that the work can be done on a different thread.
+    void Unpack(bcf1_t *record) const {
+        if(unpack_ != unpack::NONE) {
+            bcf_unpack(record, unpack_);
         }
-        str += samples[0];
-        for(int i=1;i<samples.size();++i) {
-            str += ",";
-            str += samples[i];
+    }
+
+    // Read the next record. Returns false at the end of the input.
+    bool Read(bcf1_t *record) {
+        started_ = true;
+        int ret = bcf_read(input_.get(), header_.get(), record);
+        if(ret < -1) {
+            throw std::runtime_error("unable to read record from input.");
         }
-        return bcf_hdr_set_samples(header(), str.c_str(), 0);
+        return (ret == 0);
     }
 
     template <typename callback_t>
@@ -95,6 +206,8 @@ class Reader {
    protected:
     std::unique_ptr<htsFile, detail::file_free_t> input_;
     std::unique_ptr<bcf_hdr_t, detail::header_free_t> header_;
+    int unpack_{unpack::NONE};
+    bool started_{false};
 };
 
 template <typename callback_t>
@@ -104,11 +217,393 @@ void Reader::operator()(callback_t callback) {
         throw std::invalid_argument("unable to allocate vcf record.");
     }
     // process all sites
-    while(bcf_read(input_.get(), header_.get(), record.get()) == 0) {
+    while(Read(record.get())) {
+        Unpack(record.get());
         callback(header(), record.get());
     }
 }
 
+/*
+SampleIndex maps sample names to the columns of a header. It is built once
+per header and answers lookups through a hash table. A gather map lists the
+column of each sample of a family, so one decoded record can feed many
+families without subsetting the header for each of them.
+*/
+class SampleIndex {
+   public:
+    SampleIndex() = default;
+    explicit SampleIndex(const bcf_hdr_t *header);
+    SampleIndex(const char *const *names, int num_names);
+
+    int size() const { return static_cast<int>(columns_.size()); }
+
+    // Returns the column of `name`, or -1 if it is not in the index.
+    int Find(const std::string &name) const {
+        auto it = columns_.find(name);
+        return (it != columns_.end()) ? it->second : -1;
+    }
+
+    // Returns the column of every name. Throws if a name is not indexed.
+    template<typename range_t>
+    std::vector<int> GatherMap(const range_t &names) const {
+        std::vector<int> ret;
+        for(auto &&name : names) {
+            std::string str(name);
+            int col = Find(str);
+            if(col < 0) {
+                throw std::invalid_argument("sample '" + str + "' not found in header.");
+            }
+            ret.push_back(col);
+        }
+        return ret;
+    }
+
+   protected:
+    std::unordered_map<std::string, int> columns_;
+};
+
+// A half-open, 0-based interval [beg, end) on a contig.
+// `num_records` is the number of records the index predicts for the region.
+struct region_t {
+    std::string contig;
+    int rid;
+    hts_pos_t beg;
+    hts_pos_t end;
+    std::uint64_t num_records;
+
+    // Format the region as a 1-based, closed region string for htslib
+    std::string str() const {
+        if(beg == 0 && end == HTS_POS_MAX) {
+            return contig;
+        }
+        return contig + ":" + std::to_string(beg+1) + "-" + std::to_string(end);
+    }
+};
+
+// Split an indexed VCF/BCF file into regions that each contain roughly
+// `records_per_region` records. Record counts come from the index and
+// contig lengths from the header. Records are assumed to be spread evenly
+// along each contig. Contigs without a length are never split. Regions are
+// returned in the order of the contigs in the header.
+inline std::vector<region_t> plan_regions(const std::filesystem::path &path,
+    std::uint64_t records_per_region) {
+    records_per_region = std::max<std::uint64_t>(records_per_region, 1);
+
+    Reader reader{path};
+    const bcf_hdr_t *header = reader.header();
+
+    // tabix indexes number contigs independently of the header, while
+    // CSI indexes of BCF files use the header's ids.
+    std::unique_ptr<tbx_t, detail::tbx_free_t> tbx;
+    std::unique_ptr<hts_idx_t, detail::index_free_t> csi;
+    const hts_idx_t *idx = nullptr;
+    const char **names = nullptr;
+    int num_names = 0;
+    if(reader.is_bcf()) {
+        csi.reset(bcf_index_load(path.string().c_str()));
+        idx = csi.get();
+        if(idx != nullptr) {
+            names = bcf_index_seqnames(idx, header, &num_names);
+        }
+    } else {
+        tbx.reset(tbx_index_load(path.string().c_str()));
+        if(tbx) {
+            idx = tbx->idx;
+            names = tbx_seqnames(tbx.get(), &num_names);
+        }
+    }
+    if(idx == nullptr) {
+        throw std::runtime_error("unable to load index for input file: '" + path.string() + "'.");
+    }
+    std::unique_ptr<const char*[], detail::buffer_free_t> names_guard{names};
+
+    std::vector<region_t> regions;
+    for(int k = 0; k < num_names; ++k) {
+        // bcf_index_seqnames skips contigs without records, and CSI indexes
+        // of BCF files are numbered by header id. Tabix lists every contig.
+        int rid = bcf_hdr_name2id(header, names[k]);
+        if(rid < 0) {
+            throw std::runtime_error("index contains a contig missing from the header: '"
+                + std::string(names[k]) + "'.");
+        }
+        const int tid = reader.is_bcf() ? rid : k;
+        std::uint64_t mapped = 0, unmapped = 0;
+        if(hts_idx_get_stat(idx, tid, &mapped, &unmapped) < 0 || mapped == 0) {
+            continue;
+        }
+        hts_pos_t length = static_cast<hts_pos_t>(header->id[BCF_DT_CTG][rid].val->info[0]);
+        std::uint64_t num_chunks = (mapped + records_per_region - 1) / records_per_region;
+        if(length <= 0 || num_chunks <= 1) {
+            regions.push_back({names[k], rid, 0, HTS_POS_MAX, mapped});
+            continue;
+        }
+        num_chunks = std::min<std::uint64_t>(num_chunks, length);
+        for(std::uint64_t i = 0; i < num_chunks; ++i) {
+            hts_pos_t beg = static_cast<hts_pos_t>(length*i/num_chunks);
+            hts_pos_t end = (i+1 == num_chunks) ? HTS_POS_MAX
+                : static_cast<hts_pos_t>(length*(i+1)/num_chunks);
+            regions.push_back({names[k], rid, beg, end, mapped/num_chunks});
+        }
+    }
+    std::sort(regions.begin(), regions.end(), [](const region_t &a, const region_t &b) {
+        return (a.rid < b.rid) || (a.rid == b.rid && a.beg < b.beg);
+    });
+    return regions;
+}
+
+// RegionReader reads the records of one region of an indexed file.
+// Each record is returned by exactly one of a set of adjacent regions,
+// the one that contains its starting position.
+class RegionReader {
+   public:
+    RegionReader(const std::filesystem::path &path, const region_t &region,
+        const std::vector<const char*> &samples = {}, bool inverse=false) :
+        readers_{bcf_sr_init()}, region_{region} {
+        if(!readers_) {
+            throw std::bad_alloc{};
+        }
+        bcf_sr_set_opt(readers_.get(), BCF_SR_REQUIRE_IDX);
+        if(bcf_sr_set_regions(readers_.get(), region_.str().c_str(), 0) < 0) {
+            throw std::invalid_argument("unable to set region: '" + region_.str() + "'.");
+        }
+        if(bcf_sr_add_reader(readers_.get(), path.string().c_str()) == 0) {
+            throw std::runtime_error("unable to open indexed input file: '" + path.string() + "'.");
+        }
+        // bcf_sr_set_samples only maps samples across readers. Subsetting the
+        // header drops the other samples while parsing, like Reader::SetSamples,
+        // so both readers give records with the same columns.
+        if(!samples.empty()) {
+            std::string str = detail::join_samples(samples, inverse);
+            if(bcf_hdr_set_samples(header(), str.c_str(), 0) != 0) {
+                throw std::invalid_argument("unable to select samples from input.");
+            }
+        }
+    }
+
+    bcf_hdr_t *header() { return bcf_sr_get_header(readers_.get(), 0); }
+    const bcf_hdr_t *header() const { return bcf_sr_get_header(readers_.get(), 0); }
+
+    const region_t & region() const { return region_; }
+
+    // Declare the fields, as a combination of unpack:: flags, that Next
+    // will decode.
+    void SetUnpack(int fields) { unpack_ = fields; }
+    int unpack() const { return unpack_; }
+
+    // Return the next record, or nullptr at the end of the region. The
+    // record is owned by the reader and is valid until the next call.
+    bcf1_t * Next() {
+        while(bcf_sr_next_line(readers_.get()) > 0) {
+            bcf1_t *record = bcf_sr_get_line(readers_.get(), 0);
+            // skip records that start in a preceding region
+            if(record->pos >= region_.beg) {
+                if(unpack_ != unpack::NONE) {
+                    bcf_unpack(record, unpack_);
+                }
+                return record;
+            }
+        }
+        if(readers_->errnum != 0) {
+            throw std::runtime_error("unable to read records from region: '" + region_.str() + "'.");
+        }
+        return nullptr;
+    }
+
+   protected:
+    std::unique_ptr<bcf_srs_t, detail::synced_reader_free_t> readers_;
+    region_t region_;
+    int unpack_{unpack::NONE};
+};
+
+// Header lines for the annotations that mutk adds to records
+// Annotations written by mutk. INFO tags are filled with update_info_float
+// and FORMAT tags with update_format_float, one value per genotype of every
+// sample.
+namespace header_line {
+constexpr const char LL[] = "##INFO=<ID=LL,Number=1,Type=Float,"
+    "Description=\"Log likelihood of the site data given the pedigree\">";
+constexpr const char DNP[] = "##INFO=<ID=DNP,Number=1,Type=Float,"
+    "Description=\"Probability of at least one de novo mutation\">";
+constexpr const char GP[] = "##FORMAT=<ID=GP,Number=G,Type=Float,"
+    "Description=\"Genotype posterior probabilities\">";
+} // namespace header_line
+
+/*
+Writer streams records to a VCF or BCF file. The format is picked from the
+file name: ".bcf" writes compressed BCF, ".gz" or ".bgz" writes bgzipped VCF,
+and anything else (including "-" for stdout) writes plain VCF.
+
+The output header is a copy of the input header. Add annotation header
+lines with AddHeaderLine before the first record is written. For compressed
+output, a CSI index can be built while writing, so the output does not need
+a second pass to be indexed. The exception is a resumed output: the records
+of the interrupted run are not in the index, so Close() reindexes the whole
+file with a second pass. This only happens when an index was requested.
+*/
+class Writer {
+   public:
+    // If `resume_offset` is not negative, an existing output is truncated to
+    // that offset, as returned by Flush(), and appended to. Its header is
+    // kept: header() is read from the output, so it already holds any lines
+    // the interrupted run added, and AddHeaderLine can not be used. `header`
+    // must have the same samples. If `build_index` is set, the index is
+    // rebuilt by reading the whole output again when it is closed.
+    Writer(const std::filesystem::path &path, const bcf_hdr_t *header, bool build_index=false,
+        std::int64_t resume_offset=-1) :
+        path_{path}, build_index_{build_index}, resumed_{resume_offset >= 0} {
+        std::string ext = path_.extension().string();
+        std::string mode = (ext == ".bcf") ? "wb" : (ext == ".gz" || ext == ".bgz") ? "wz" : "w";
+        if(build_index_ && mode.size() == 1) {
+            throw std::invalid_argument("unable to index uncompressed output: '" + path_.string() + "'.");
+        }
+        if(resumed_) {
+            std::error_code ec;
+            std::filesystem::resize_file(path_, resume_offset, ec);
+            if(ec) {
+                throw std::runtime_error("unable to resume output file: '" + path_.string() + "'.");
+            }
+            std::unique_ptr<htsFile, detail::file_free_t> existing{hts_open(path_.string().c_str(), "r")};
+            if(existing) {
+                header_.reset(bcf_hdr_read(existing.get()));
+            }
+            if(!header_) {
+                throw std::runtime_error("unable to read header of output file: '" + path_.string() + "'.");
+            }
+            if(bcf_hdr_nsamples(header_.get()) != bcf_hdr_nsamples(header)) {
+                throw std::invalid_argument("output file does not match the input: '" + path_.string() + "'.");
+            }
+            mode[0] = 'a';
+            header_written_ = true;
+        } else {
+            header_.reset(bcf_hdr_dup(header));
+            if(!header_) {
+                throw std::invalid_argument("unable to copy header for output.");
+            }
+        }
+        output_.reset(hts_open(path_.string().c_str(), mode.c_str()));
+        if(!output_) {
+            throw std::runtime_error("unable to open output file: '" + path_.string() + "'.");
+        }
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    ~Writer() {
+        try {
+            Close();
+        } catch(...) {
+            // destructors must not throw; call Close() to see errors
+        }
+    }
+
+    bcf_hdr_t *header() { return header_.get(); }
+    const bcf_hdr_t *header() const { return header_.get(); }
+
+    // Compress output with a pool that is shared with other files. Many
+    // writers can share one pool without creating threads for each of them.
+    int SetThreadPool(ThreadPool &pool) {
+        return (pool.get() != nullptr) ? hts_set_thread_pool(output_.get(), pool.get()) : 0;
+    }
+
+    void AddHeaderLine(const char *line) {
+        if(header_written_) {
+            throw std::logic_error("unable to modify header after it has been written.");
+        }
+        if(bcf_hdr_append(header(), line) != 0 || bcf_hdr_sync(header()) != 0) {
+            throw std::invalid_argument("unable to add header line: '" + std::string(line) + "'.");
+        }
+    }
+
+    // Write a record. It must use the ids of header(); records read with a
+    // header that header() was copied from qualify.
+    void Write(bcf1_t *record) {
+        if(!header_written_) {
+            WriteHeader();
+        }
+        if(bcf_write(output_.get(), header(), record) != 0) {
+            throw std::runtime_error("unable to write record to output.");
+        }
+    }
+
+    // Flush buffered records to the operating system and return the size of
+    // the file. Compressed output ends on a block boundary, so the file can
+    // be truncated to this offset and appended to.
+    std::int64_t Flush() {
+        if(!header_written_) {
+            WriteHeader();
+        }
+        if(hts_flush(output_.get()) != 0) {
+            throw std::runtime_error("unable to flush output: '" + path_.string() + "'.");
+        }
+        hFILE *file = (output_->format.compression == bgzf) ? output_->fp.bgzf->fp : output_->fp.hfile;
+        if(hflush(file) != 0) {
+            throw std::runtime_error("unable to flush output: '" + path_.string() + "'.");
+        }
+        return htell(file);
+    }
+
+    // Flush the output, save the index, and close the file.
+    void Close() {
+        if(!output_) {
+            return;
+        }
+        if(!header_written_) {
+            WriteHeader();
+        }
+        int ret = 0;
+        if(build_index_ && !resumed_) {
+            ret = bcf_idx_save(output_.get());
+        }
+        ret |= hts_close(output_.release());
+        if(build_index_ && resumed_ && ret == 0) {
+            // the index of a resumed output must cover the records of both runs
+            std::string fnidx = path_.string() + ".csi";
+            ret = bcf_index_build3(path_.string().c_str(), fnidx.c_str(), 14, 0);
+        }
+        if(ret != 0) {
+            throw std::runtime_error("unable to finish writing output: '" + path_.string() + "'.");
+        }
+    }
+
+   protected:
+    void WriteHeader() {
+        if(bcf_hdr_write(output_.get(), header()) != 0) {
+            throw std::runtime_error("unable to write header to output.");
+        }
+        header_written_ = true;
+        if(build_index_) {
+            std::string fnidx = path_.string() + ".csi";
+            if(bcf_idx_init(output_.get(), header(), 14, fnidx.c_str()) != 0) {
+                throw std::runtime_error("unable to initialize index: '" + fnidx + "'.");
+            }
+        }
+    }
+
+    std::unique_ptr<htsFile, detail::file_free_t> output_;
+    std::unique_ptr<bcf_hdr_t, detail::header_free_t> header_;
+    std::filesystem::path path_;
+    bool build_index_;
+    bool resumed_;
+    bool header_written_{false};
+};
+
+// Create a copy of a header without samples, for sites-only output.
+inline std::unique_ptr<bcf_hdr_t, detail::header_free_t> make_sites_header(const bcf_hdr_t *header) {
+    std::unique_ptr<bcf_hdr_t, detail::header_free_t> ret{bcf_hdr_subset(header, 0, nullptr, nullptr)};
+    if(!ret) {
+        throw std::invalid_argument("unable to create sites-only header.");
+    }
+    return ret;
+}
+
+// Copy the site-level fields of `src` into `dst`, dropping all sample data.
+inline void copy_site(const bcf_hdr_t *header, bcf1_t *src, bcf1_t *dst) {
+    if(bcf_copy(dst, src) == nullptr || bcf_subset(header, dst, 0, nullptr) != 0) {
+        throw std::runtime_error("unable to copy site-level fields of record.");
+    }
+}
+
 // Templates and functions for handling buffers used by htslib
 template <typename T>
 struct buffer_t {  // NOLINT(cppcoreguidelines-pro-type-member-init)
@@ -153,6 +648,12 @@ inline int get_info_int32(const bcf_hdr_t *header, bcf1_t *record, const char *t
     return detail::realloc_check(n, p, buffer);
 }
 
+inline int get_info_float(const bcf_hdr_t *header, bcf1_t *record, const char *tag, buffer_t<float> *buffer) {
+    float *p = buffer->data.get();
+    int n = bcf_get_info_float(header, record, tag, &p, &buffer->capacity);  // NOLINT
+    return detail::realloc_check(n, p, buffer);
+}
+
 inline int get_format_float(const bcf_hdr_t *header, bcf1_t *record, const char *tag, buffer_t<float> *buffer) {
     float *p = buffer->data.get();
     int n = bcf_get_format_float(header, record, tag, &p, &buffer->capacity);  // NOLINT
@@ -171,6 +672,14 @@ inline int get_genotypes(const bcf_hdr_t *header, bcf1_t *record, buffer_t<int32
     return detail::realloc_check(n, p, buffer);
 }
 
+inline int update_info_float(const bcf_hdr_t *header, bcf1_t *record, const char *tag, const float *values, int n) {
+    return bcf_update_info_float(header, record, tag, values, n);  // NOLINT
+}
+
+inline int update_format_float(const bcf_hdr_t *header, bcf1_t *record, const char *tag, const float *values, int n) {
+    return bcf_update_format_float(header, record, tag, values, n);  // NOLINT
+}
+
 inline bool is_missing(int32_t x) {
     return (x == bcf_int32_missing);
 }
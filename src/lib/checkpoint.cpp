@@ -0,0 +1,236 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include "unit_testing.hpp"
+
+#include <mutk/checkpoint.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using mutk::checkpoint_t;
+
+namespace {
+constexpr char MAGIC[] = "mutk-checkpoint";
+constexpr int VERSION = 1;
+
+[[noreturn]] void throw_corrupt(const std::filesystem::path &path) {
+    throw std::runtime_error("checkpoint file is corrupt: '" + path.string() + "'.");
+}
+
+bool has_space(const std::string &str) {
+    return std::any_of(str.begin(), str.end(),
+        [](unsigned char c) { return std::isspace(c); });
+}
+
+// Make the contents of `path` durable. Syncing a directory makes a rename
+// inside it durable.
+void sync_file(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("unable to open checkpoint file: '" + path.string() + "'.");
+    }
+    int ret = ::fsync(fd);
+    ::close(fd);
+    if(ret != 0) {
+        throw std::runtime_error("unable to sync checkpoint file: '" + path.string() + "'.");
+    }
+}
+} // namespace
+
+void mutk::save_checkpoint(const std::filesystem::path &path, const checkpoint_t &checkpoint) {
+    if(has_space(checkpoint.contig)) {
+        throw std::invalid_argument("contig names in checkpoints must not contain spaces.");
+    }
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if(!out) {
+            throw std::runtime_error("unable to open checkpoint file: '" + tmp.string() + "'.");
+        }
+        out << MAGIC << ' ' << VERSION << '\n';
+        out << "records " << checkpoint.records << '\n';
+        if(!checkpoint.contig.empty()) {
+            out << "contig " << checkpoint.contig << '\n';
+        }
+        out << "pos " << checkpoint.pos << '\n';
+        for(auto offset : checkpoint.offsets) {
+            out << "offset " << offset << '\n';
+        }
+        out << std::hexfloat;
+        for(auto && [name, values] : checkpoint.sums) {
+            if(name.empty() || has_space(name)) {
+                throw std::invalid_argument("invalid checkpoint sum name: '" + name + "'.");
+            }
+            out << "sum " << name;
+            for(auto value : values) {
+                out << ' ' << value;
+            }
+            out << '\n';
+        }
+        out << "end\n";
+        out.close();
+        if(!out) {
+            throw std::runtime_error("unable to write checkpoint file: '" + tmp.string() + "'.");
+        }
+    }
+    sync_file(tmp);
+    std::filesystem::rename(tmp, path);
+    auto dir = path.parent_path();
+    sync_file(dir.empty() ? std::filesystem::path{"."} : dir);
+}
+
+std::optional<checkpoint_t> mutk::load_checkpoint(const std::filesystem::path &path) {
+    std::ifstream in(path);
+    if(!in) {
+        if(!std::filesystem::exists(path)) {
+            return std::nullopt;
+        }
+        throw std::runtime_error("unable to open checkpoint file: '" + path.string() + "'.");
+    }
+
+    std::string magic;
+    int version = 0;
+    if(!(in >> magic >> version) || magic != MAGIC) {
+        throw_corrupt(path);
+    }
+    if(version != VERSION) {
+        throw std::runtime_error("unsupported checkpoint version in '" + path.string() + "'.");
+    }
+
+    checkpoint_t ret;
+    std::string line;
+    std::getline(in, line);
+    bool complete = false;
+    while(std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if(key == "end") {
+            complete = true;
+            break;
+        } else if(key == "records") {
+            fields >> ret.records;
+        } else if(key == "contig") {
+            fields >> ret.contig;
+        } else if(key == "pos") {
+            fields >> ret.pos;
+        } else if(key == "offset") {
+            std::int64_t offset = -1;
+            fields >> offset;
+            ret.offsets.push_back(offset);
+        } else if(key == "sum") {
+            // libstdc++ can not read hexfloats from streams
+            std::string name, value;
+            fields >> name;
+            auto &values = ret.sums[name];
+            while(fields >> value) {
+                char *end = nullptr;
+                double x = std::strtod(value.c_str(), &end);
+                if(*end != '\0') {
+                    throw_corrupt(path);
+                }
+                values.push_back(x);
+            }
+            // Reading values stops at the end of the line
+            fields.clear();
+            if(name.empty()) {
+                throw_corrupt(path);
+            }
+        } else {
+            throw_corrupt(path);
+        }
+        if(fields.fail()) {
+            throw_corrupt(path);
+        }
+    }
+    if(!complete) {
+        throw_corrupt(path);
+    }
+    return ret;
+}
+
+// LCOV_EXCL_START
+TEST_CASE("checkpoint_t.load_checkpoint") {
+    auto path = std::filesystem::temp_directory_path() / "mutk-checkpoint-test.txt";
+    std::filesystem::remove(path);
+
+    CHECK_FALSE(mutk::load_checkpoint(path));
+
+    checkpoint_t checkpoint;
+    checkpoint.records = 123456789012;
+    checkpoint.contig = "chr1";
+    checkpoint.pos = 987654;
+    checkpoint.offsets = {0, 65536, 1234};
+    checkpoint.sums["log_likelihood"] = {3.0, -12345.678901234567, 1e-13, -1e300, 2.0};
+    checkpoint.sums["sites"] = {1.0/3.0};
+    checkpoint.sums["empty"] = {};
+    mutk::save_checkpoint(path, checkpoint);
+
+    auto loaded = mutk::load_checkpoint(path);
+    REQUIRE(loaded);
+    CHECK(loaded->records == checkpoint.records);
+    CHECK(loaded->contig == checkpoint.contig);
+    CHECK(loaded->pos == checkpoint.pos);
+    CHECK(loaded->offsets == checkpoint.offsets);
+    CHECK(loaded->sums == checkpoint.sums);
+
+    // A newer checkpoint replaces the old one
+    checkpoint.records += 1;
+    checkpoint.offsets.clear();
+    mutk::save_checkpoint(path, checkpoint);
+    loaded = mutk::load_checkpoint(path);
+    REQUIRE(loaded);
+    CHECK(loaded->records == checkpoint.records);
+    CHECK(loaded->offsets.empty());
+    auto tmp = path;
+    tmp += ".tmp";
+    CHECK_FALSE(std::filesystem::exists(tmp));
+
+    checkpoint.sums["bad name"] = {1.0};
+    CHECK_THROWS_AS(mutk::save_checkpoint(path, checkpoint), std::invalid_argument);
+
+    // A truncated checkpoint is rejected
+    {
+        std::ofstream out(path, std::ios::trunc);
+        out << "mutk-checkpoint 1\nrecords 10\n";
+    }
+    CHECK_THROWS_AS(mutk::load_checkpoint(path), std::runtime_error);
+    {
+        std::ofstream out(path, std::ios::trunc);
+        out << "not a checkpoint\n";
+    }
+    CHECK_THROWS_AS(mutk::load_checkpoint(path), std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+// LCOV_EXCL_STOP
@@ -30,12 +30,50 @@
 #include <boost/graph/topological_sort.hpp>
 
 #include <mutk/graph_builder.hpp>
+#include <mutk/graph_peeler.hpp>
 
 using mutk::member_id_t;
 
 static mutk::RelationshipGraph
 simplify_graph(mutk::RelationshipGraph &graph);
 
+// Autosomes are diploid whatever the sex of a member. Haploid members,
+// e.g. gametes, are their own type. A child with two parents is diploid.
+mutk::InheritanceModel::InheritanceModel() {
+    auto autosomal = AddType("autosomal", 2);
+    auto haploid = AddType("haploid", 1);
+    map_name_to_type_.emplace("male", autosomal);
+    map_name_to_type_.emplace("female", autosomal);
+
+    for(auto child : {autosomal, haploid}) {
+        patterns_.push_back({{child}, {0}});
+        for(auto parent : {autosomal, haploid}) {
+            patterns_.push_back({{child, parent}, {0, 0}});
+        }
+    }
+    for(auto parent_a : {autosomal, haploid}) {
+        for(auto parent_b : {autosomal, haploid}) {
+            patterns_.push_back({{autosomal, parent_a, parent_b}, {0, 0, 0}});
+        }
+    }
+}
+
+mutk::InheritanceModel::chromosome_type_t
+mutk::InheritanceModel::AddType(std::string_view name, int ploidy) {
+    if(ploidy != 1 && ploidy != 2) {
+        throw std::invalid_argument("Chromosome type '" + std::string(name) + "' has invalid ploidy.");
+    }
+    chromosome_type_t type{static_cast<int>(ploidies_.size())};
+    if(!map_name_to_type_.emplace(std::string(name), type).second) {
+        throw std::invalid_argument("Chromosome type '" + std::string(name) + "' is not unique.");
+    }
+    sexes_.emplace_back(name);
+    ploidies_.push_back(ploidy);
+    return type;
+}
+
+mutk::GraphBuilder::GraphBuilder() = default;
+
 // Convert `name` into a member id. If `name` is already registered, it
 // return the registered id number. Otherwise add `name` to the registry.
 member_id_t mutk::GraphBuilder::LookupName(const std::string &name) {
@@ -181,6 +219,49 @@ mutk::RelationshipGraph mutk::GraphBuilder::CreateInitialGraph(const Inheritance
 //  0 -> 0; . -> .
 //  2 -> 1; aa -> a
 
+// Bypass vertices without data that have one child, so that unbranched
+// chains (e.g. member -> tissue -> library) become a single edge. K-alleles
+// transitions compose by adding their lengths, T(s)T(t) = T(s+t), so the
+// composed edge has the exact transition matrix of the chain. (A chain
+// peeled over fewer than k alleles differs slightly, because it drops the
+// paths through alleles that are not in the data.) A haploid vertex is kept
+// if it is the only parent of a diploid child, because both alleles of the
+// child descend from the same mutated copy and no single edge can express
+// that.
+template<class Range>
+void collapse_chains(mutk::RelationshipGraph &graph, const Range &topo_order) {
+    using mutk::Ploidy;
+
+    auto lengths = get(boost::edge_length, graph);
+    auto data = get(boost::vertex_data, graph);
+    auto ploidies = get(boost::vertex_ploidy, graph);
+
+    for(auto && v : topo_order) {
+        if(!data[v].empty() || in_degree(v,graph) == 0 || out_degree(v,graph) != 1) {
+            continue;
+        }
+        auto in_edge_range = boost::make_iterator_range(in_edges(v,graph));
+        auto out_edge = *out_edges(v,graph).first;
+        auto child = target(out_edge, graph);
+        // If the total in-degree of child and v is > 3 then we can't
+        // simplify this node because child would have more than 2
+        // in edges.
+        if(in_degree(child,graph)+in_degree(v,graph) > 3) {
+            continue;
+        }
+        if(ploidies[v] == Ploidy::Haploid && ploidies[child] == Ploidy::Diploid &&
+            in_degree(child,graph) == 1) {
+            continue;
+        }
+        auto len = lengths[out_edge];
+        for(auto &&e : in_edge_range) {
+            auto grand = source(e, graph);
+            add_edge(grand, child, {len+lengths[e]}, graph);
+        }
+        clear_vertex(v, graph);
+    }
+}
+
 mutk::RelationshipGraph
 simplify_graph(mutk::RelationshipGraph &graph) {
     using boost::make_iterator_range;
@@ -192,7 +273,6 @@ simplify_graph(mutk::RelationshipGraph &graph) {
     auto topo_order = boost::adaptors::reverse(rev_topo_order);
 
     // Simplify the original graph
-    auto lengths = get(boost::edge_length, graph);
     auto data = get(boost::vertex_data, graph);
 
     // Clear all leaf vertexes that do not have samples, starting from the tips
@@ -216,27 +296,7 @@ simplify_graph(mutk::RelationshipGraph &graph) {
         }
     }
 
-    // try to bypass nodes with no data that have one out_edge
-    for(auto && v : topo_order) {
-        if(!data[v].empty() || in_degree(v,graph) == 0 || out_degree(v,graph) != 1) {
-            continue;
-        }
-        auto in_edge_range = boost::make_iterator_range(in_edges(v,graph));
-        auto out_edge = *out_edges(v,graph).first;
-        auto child = target(out_edge, graph);
-        // If the total in-degree of child and v is > 3 then we can't
-        // simplify this node because child would have more than 2
-        // in edges.
-        if(in_degree(child,graph)+in_degree(v,graph) > 3) {
-            continue;
-        }
-        auto len = lengths[out_edge];
-        for(auto &&e : in_edge_range) {
-            auto grand = source(e, graph);
-            add_edge(grand, child, {len+lengths[e]}, graph);
-        }
-        clear_vertex(v, graph);
-    }
+    collapse_chains(graph, topo_order);
 
     // Construct new graph in topological order
     RelationshipGraph new_graph;
@@ -415,7 +475,195 @@ TEST_CASE("simplify_graph() simplifies relationship graphs") {
         CHECK(get_length(2,4,out_graph) == 0.1f);
     }
 }
-// LCOV_EXCL_STOP
 
+TEST_CASE("collapse_chains() composes unbranched chains") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::sample_id_t;
+
+    auto get_length = [](RelationshipGraph::vertex_descriptor a, RelationshipGraph::vertex_descriptor b,
+        const RelationshipGraph &g) -> float {
+        auto e = edge(a,b,g);
+        if(e.second) {
+            return get(boost::edge_length, g, e.first);
+        }
+        return NAN;
+    };
+
+    auto get_name = [](RelationshipGraph::vertex_descriptor a, const RelationshipGraph &g) -> std::string {
+        return get(boost::vertex_label, g, a);
+    };
+
+    // Peel a graph of diploids with k-alleles transitions. The data of a
+    // sample only depends on its label. Every one of the k alleles is
+    // peeled, as intermediate vertices would otherwise drop the paths
+    // through alleles that are not in the data.
+    auto peel = [](const RelationshipGraph &graph) {
+        const std::size_t n = 3;
+        const std::size_t g = mutk::num_diploids(n);
+        mutk::MutationModel model(n, 0.001, 0, 0, 0);
+        auto peeler = GraphPeeler::Create(graph);
+        auto work = peeler.CreateWorkspace<double>();
+        peeler.SetModelPotentials(work, n, [&](const GraphPeeler::model_component_t &pot,
+            std::size_t) {
+            if(pot.variables.size() == 1) {
+                message_t msg = message_t::from_shape({g});
+                msg.fill(1.0f/g);
+                return mutk::model_potential_t{msg, std::nullopt};
+            }
+            // P(x/y|a/b) from the haploid transition of the edge
+            auto op = model.TransitionOperator(pot.edge_lengths[1]);
+            auto m = [&](int i, int j) { return op.a*(i == j) + op.b; };
+            message_t msg = message_t::from_shape({g, g});
+            for(std::size_t c = 0; c < g; ++c) {
+                auto [x, y] = mutk::diploid_alleles(c);
+                for(std::size_t p = 0; p < g; ++p) {
+                    auto [a, b] = mutk::diploid_alleles(p);
+                    msg(c, p) = m(a, x)*m(b, y) + ((x != y) ? m(a, y)*m(b, x) : 0.0);
+                }
+            }
+            return mutk::model_potential_t{msg, op};
+        });
+        std::vector<message_t> data;
+        for(auto v : peeler.data_vertices()) {
+            const auto &label = get(boost::vertex_label, peeler.graph(), v);
+            message_t msg = message_t::from_shape({g});
+            for(std::size_t i = 0; i < g; ++i) {
+                msg(i) = (label == "A") ? 1.0f/(1+i) : 0.1f + 0.15f*((i+2) % 5);
+            }
+            data.push_back(msg);
+        }
+        peeler.SetDataPotentials(work, n, data);
+        return peeler.PeelForward(work);
+    };
+
+    SUBCASE("somatic chain") {
+        RelationshipGraph graph(4);
+        add_edge(0,1,0.5f,graph);
+        add_edge(1,2,0.25f,graph);
+        add_edge(2,3,0.125f,graph);
+
+        auto labels = get(boost::vertex_label, graph);
+        labels[0] = "A";
+        labels[1] = "T";
+        labels[2] = "L";
+        labels[3] = "C";
+
+        auto ploidies = get(boost::vertex_ploidy, graph);
+        for(auto v : mutk::make_vertex_range(graph)) {
+            ploidies[v] = Ploidy::Diploid;
+        }
+
+        auto data = get(boost::vertex_data, graph);
+        data[0].push_back(sample_id_t{0});
+        data[3].push_back(sample_id_t{1});
+
+        RelationshipGraph chain = graph;
+        auto out_graph = simplify_graph(graph);
+
+        CHECK(num_vertices(out_graph) == 2);
+        CHECK(get_name(0,out_graph) == "A");
+        CHECK(get_name(1,out_graph) == "C");
+
+        CHECK(num_edges(out_graph) == 1);
+        CHECK(get_length(0,1,out_graph) == 0.875f);
+
+        // k-alleles transitions compose by adding their lengths, so the
+        // collapsed edge has the transition matrix of the whole chain
+        CHECK(peel(out_graph) == doctest::Approx(peel(chain)));
+    }
+    SUBCASE("haploid clone of a diploid") {
+        RelationshipGraph graph(4);
+        add_edge(0,1,0.5f,graph);
+        add_edge(1,2,0.25f,graph);
+        add_edge(2,3,0.125f,graph);
+
+        auto labels = get(boost::vertex_label, graph);
+        labels[0] = "A";
+        labels[1] = "H";
+        labels[2] = "D";
+        labels[3] = "C";
+
+        auto ploidies = get(boost::vertex_ploidy, graph);
+        ploidies[0] = Ploidy::Diploid;
+        ploidies[1] = Ploidy::Haploid;
+        ploidies[2] = Ploidy::Diploid;
+        ploidies[3] = Ploidy::Diploid;
+
+        auto data = get(boost::vertex_data, graph);
+        data[0].push_back(sample_id_t{0});
+        data[3].push_back(sample_id_t{1});
+
+        auto out_graph = simplify_graph(graph);
+
+        CHECK(num_vertices(out_graph) == 3);
+        CHECK(get_name(0,out_graph) == "A");
+        CHECK(get_name(1,out_graph) == "H");
+        CHECK(get_name(2,out_graph) == "C");
+
+        CHECK(num_edges(out_graph) == 2);
+        CHECK(get_length(0,1,out_graph) == 0.5f);
+        CHECK(get_length(1,2,out_graph) == 0.375f);
+    }
+}
 
+TEST_CASE("GraphBuilder.BuildGraph") {
+    using mutk::RelationshipGraph;
+    using mutk::sample_id_t;
+    using mutk::Ploidy;
+
+    auto find = [](const std::string &name, const RelationshipGraph &g) {
+        for(auto v : mutk::make_vertex_range(g)) {
+            if(get(boost::vertex_label, g, v) == name) {
+                return v;
+            }
+        }
+        FAIL("missing vertex " << name);
+        return RelationshipGraph::vertex_descriptor{};
+    };
 
+    mutk::InheritanceModel model;
+
+    mutk::GraphBuilder builder;
+    builder.AddSingle("A", "male", {});
+    builder.AddSingle("B", "female", {"B1"});
+    builder.AddTrio("C", "autosomal", {"C1"}, "A", 1.0f, "B", 2.0f);
+    builder.AddPair("D", "haploid", {"D1"}, "C", 0.5f);
+    builder.SetSamples({"D1", "C1", "B1", "X"});
+
+    auto graph = builder.BuildGraph(model, 0.25f);
+    REQUIRE(num_vertices(graph) == 4);
+    CHECK(num_edges(graph) == 3);
+
+    auto a = find("A", graph);
+    auto b = find("B", graph);
+    auto c = find("C", graph);
+    auto d = find("D", graph);
+    CHECK(get(boost::vertex_ploidy, graph, a) == Ploidy::Diploid);
+    CHECK(get(boost::vertex_ploidy, graph, c) == Ploidy::Diploid);
+    CHECK(get(boost::vertex_ploidy, graph, d) == Ploidy::Haploid);
+    CHECK(get(boost::vertex_data, graph, a).empty());
+    CHECK(get(boost::vertex_data, graph, b) == std::vector<sample_id_t>{sample_id_t{2}});
+    CHECK(get(boost::vertex_data, graph, c) == std::vector<sample_id_t>{sample_id_t{1}});
+    CHECK(get(boost::vertex_data, graph, d) == std::vector<sample_id_t>{sample_id_t{0}});
+    CHECK(get(boost::edge_length, graph, edge(a, c, graph).first) == 0.25f);
+    CHECK(get(boost::edge_length, graph, edge(b, c, graph).first) == 0.5f);
+    CHECK(get(boost::edge_length, graph, edge(c, d, graph).first) == 0.125f);
+
+    mutk::GraphBuilder unknown_sex;
+    unknown_sex.AddSingle("A", "unknown", {});
+    CHECK_THROWS_AS(unknown_sex.BuildGraph(model, 1.0f), std::invalid_argument);
+
+    // a child with two parents is diploid
+    mutk::GraphBuilder haploid_child;
+    haploid_child.AddSingle("A", "male", {});
+    haploid_child.AddSingle("B", "female", {});
+    haploid_child.AddTrio("C", "haploid", {}, "A", 1.0f, "B", 1.0f);
+    CHECK_THROWS_AS(haploid_child.BuildGraph(model, 1.0f), std::invalid_argument);
+
+    CHECK_THROWS_AS(model.AddType("haploid", 1), std::invalid_argument);
+    CHECK_THROWS_AS(model.AddType("triploid", 3), std::invalid_argument);
+}
+// LCOV_EXCL_STOP
@@ -29,13 +29,21 @@
 
 #include <boost/heap/d_ary_heap.hpp>
 
+#include <cblas.h>
+
+#include <algorithm>
+#include <numeric>
+#include <type_traits>
+
 #include "junction_tree.hpp"
+#include "kernels.hpp"
 
 using mutk::junction_tree::component_t;
 using mutk::junction_tree::clique_t;
 using mutk::make_adj_vertex_range;
 using mutk::make_vertex_range;
 using mutk::make_inv_vertex_range;
+using mutk::variable_t;
 
 static std::vector<clique_t>
 triangulate_graph(const mutk::RelationshipGraph &graph);
@@ -43,19 +51,695 @@ triangulate_graph(const mutk::RelationshipGraph &graph);
 static std::vector<component_t>
 calculate_components(const mutk::RelationshipGraph &graph);
 
-mutk::GraphPeeler mutk::GraphPeeler::Create(mutk::RelationshipGraph graph) {
+static mutk::RelationshipGraph
+split_gametes(mutk::RelationshipGraph graph);
+
+mutk::GraphPeeler mutk::GraphPeeler::Create(mutk::RelationshipGraph graph, bool split) {
+    using kind_t = model_component_t::kind_t;
+
     GraphPeeler peeler;
 
     peeler.graph_ = std::move(graph);
 
-    auto components = calculate_components(peeler.graph_);
-    auto cliques = triangulate_graph(peeler.graph_);
+    // Variables are the vertices of the family graph, plus any gametes
+    const std::size_t num_members = num_vertices(peeler.graph_);
+    auto variables = split ? split_gametes(peeler.graph_) : peeler.graph_;
+
+    auto components = calculate_components(variables);
+    auto cliques = triangulate_graph(variables);
+
+    peeler.tree_ = create_junction_tree(variables, components, cliques);
+
+    for(auto v : make_vertex_range(variables)) {
+        peeler.ploidies_.push_back(get(boost::vertex_ploidy, variables, v));
+    }
+
+    // Model components: a prior for each founder and a transition
+    // for every other vertex
+    for(auto v : make_vertex_range(variables)) {
+        auto & pot = peeler.model_components_.emplace_back();
+        pot.kind = (v >= num_members) ? kind_t::Gamete :
+                   (in_degree(v, variables) == 0) ? kind_t::Founder : kind_t::Transition;
+        pot.variables.push_back(variable_t(v));
+        pot.edge_lengths.push_back(0.0f);
+        pot.ploidies.push_back(peeler.ploidies_[v]);
+        for(auto e : boost::make_iterator_range(in_edges(v, variables))) {
+            auto w = source(e, variables);
+            pot.variables.push_back(variable_t(w));
+            pot.edge_lengths.push_back(get(boost::edge_length, variables, e));
+            pot.ploidies.push_back(peeler.ploidies_[w]);
+            if(w >= num_members) {
+                pot.kind = kind_t::Zygote;
+            }
+        }
+    }
+    // Data components
+    for(auto v : make_vertex_range(peeler.graph_)) {
+        if(!get(boost::vertex_data, peeler.graph_, v).empty()) {
+            peeler.data_vertices_.push_back(v);
+        }
+    }
+
+    for(auto && pot : peeler.model_components_) {
+        peeler.scopes_.push_back(pot.variables);
+    }
+    for(auto v : peeler.data_vertices_) {
+        peeler.scopes_.push_back({variable_t(v)});
+    }
 
-    peeler.tree_ = create_junction_tree(peeler.graph_, components, cliques);
+    peeler.CreatePlan(cliques);
 
     return peeler;
 }
 
+// Give every diploid parent of a child with two parents a haploid gamete
+// vertex between them. The parent keeps the length of the edge and the
+// gamete joins the child with length 0. The in-edges of a child keep their
+// order so that model components list the parents as before.
+mutk::RelationshipGraph
+split_gametes(mutk::RelationshipGraph graph) {
+    using mutk::Ploidy;
+    using vertex_t = mutk::RelationshipGraph::vertex_descriptor;
+
+    const std::size_t num_members = num_vertices(graph);
+    for(vertex_t v = 0; v < num_members; ++v) {
+        if(in_degree(v, graph) != 2) {
+            continue;
+        }
+        std::vector<std::pair<vertex_t, float>> parents;
+        for(auto e : boost::make_iterator_range(in_edges(v, graph))) {
+            parents.emplace_back(source(e, graph), get(boost::edge_length, graph, e));
+        }
+        clear_in_edges(v, graph);
+        for(auto [p, length] : parents) {
+            if(get(boost::vertex_ploidy, graph, p) != Ploidy::Diploid) {
+                add_edge(p, v, {length}, graph);
+                continue;
+            }
+            auto g = add_vertex(graph);
+            put(boost::vertex_label, graph, g, get(boost::vertex_label, graph, p) +
+                "/" + get(boost::vertex_label, graph, v));
+            put(boost::vertex_ploidy, graph, g, Ploidy::Haploid);
+            add_edge(p, g, {length}, graph);
+            add_edge(g, v, {0.0f}, graph);
+        }
+    }
+    return graph;
+}
+
+// Build a variable-elimination plan that follows the elimination order
+// used to construct the junction tree.
+void mutk::GraphPeeler::CreatePlan(const std::vector<clique_t> &cliques) {
+    std::vector<int> active(scopes_.size());
+    std::iota(active.begin(), active.end(), 0);
+
+    for(auto && clique : cliques) {
+        const variable_t v = variable_t(clique.front());
+
+        contraction_t step;
+        std::vector<int> remaining;
+        for(int slot : active) {
+            const auto & sc = scopes_[slot];
+            if(std::find(sc.begin(), sc.end(), v) != sc.end()) {
+                step.inputs.push_back(slot);
+                for(auto w : sc) {
+                    if(w != v && std::find(step.scope.begin(), step.scope.end(), w) == step.scope.end()) {
+                        step.scope.push_back(w);
+                    }
+                }
+            } else {
+                remaining.push_back(slot);
+            }
+        }
+        assert(!step.inputs.empty());
+        step.output = static_cast<int>(scopes_.size());
+        scopes_.push_back(step.scope);
+        step.scope.push_back(v);
+
+        if(scopes_.back().empty()) {
+            results_.push_back(step.output);
+        } else {
+            remaining.push_back(step.output);
+        }
+        active = std::move(remaining);
+        plan_.push_back(std::move(step));
+    }
+    assert(active.empty());
+
+    // Order the axes of every factor like the loops of the contraction that
+    // consumes it. The summed variable is then the innermost axis of every
+    // input, and every input is read with stride 1 in the inner loop and
+    // monotone strides elsewhere. Consumers come after producers, so the
+    // plan is processed backwards.
+    std::vector<int> consumer(scopes_.size(), -1);
+    for(std::size_t k = 0; k < plan_.size(); ++k) {
+        for(int slot : plan_[k].inputs) {
+            consumer[slot] = static_cast<int>(k);
+        }
+    }
+    auto restrict_to = [](const std::vector<variable_t> &order,
+        const std::vector<variable_t> &vars) {
+        std::vector<variable_t> ret;
+        for(auto w : order) {
+            if(std::find(vars.begin(), vars.end(), w) != vars.end()) {
+                ret.push_back(w);
+            }
+        }
+        return ret;
+    };
+    for(std::size_t k = plan_.size(); k-- > 0;) {
+        auto & step = plan_[k];
+        if(int c = consumer[step.output]; c >= 0) {
+            const variable_t v = step.scope.back();
+            step.scope = restrict_to(plan_[c].scope, scopes_[step.output]);
+            scopes_[step.output] = step.scope;
+            step.scope.push_back(v);
+        }
+        for(int slot : step.inputs) {
+            scopes_[slot] = restrict_to(step.scope, scopes_[slot]);
+        }
+    }
+
+    // Find the steps that are matrix products
+    for(auto && step : plan_) {
+        int matrix = -1;
+        bool vector_only = true;
+        for(std::size_t k = 0; k < step.inputs.size(); ++k) {
+            const auto size = scopes_[step.inputs[k]].size();
+            if(size == step.scope.size() && matrix == -1 && size > 1) {
+                matrix = static_cast<int>(k);
+            } else if(size != 1) {
+                vector_only = false;
+            }
+        }
+        step.matrix = vector_only ? matrix : -1;
+    }
+}
+
+template<class T>
+void mutk::GraphPeeler::SetDataPotentials(basic_workspace_t<T> &work, message_size_t n,
+    const std::vector<mutk::message_t> &data) const
+{
+    assert(work.messages.size() == scopes_.size());
+    assert(data.size() == data_vertices_.size());
+    const std::size_t offset = model_components_.size();
+    for(std::size_t i = 0; i < data.size(); ++i) {
+        assert(data[i].size() == message_axis_size(n, ploidies_[data_vertices_[i]]));
+        auto & msg = work.messages[offset+i];
+        msg = basic_message_t<T>::from_shape({data[i].size()});
+        std::copy(data[i].begin(), data[i].end(), msg.begin());
+    }
+    work.dirty.resize(scopes_.size(), 1);
+    std::fill(work.dirty.begin() + offset, work.dirty.begin() + offset + data.size(), 1);
+}
+
+template void mutk::GraphPeeler::SetDataPotentials<float>(basic_workspace_t<float> &,
+    message_size_t, const std::vector<mutk::message_t> &) const;
+template void mutk::GraphPeeler::SetDataPotentials<double>(basic_workspace_t<double> &,
+    message_size_t, const std::vector<mutk::message_t> &) const;
+
+namespace {
+// Index of the unordered genotype x/y
+constexpr std::size_t genotype_index(std::size_t x, std::size_t y) {
+    return (x <= y) ? y*(y+1)/2 + x : x*(x+1)/2 + y;
+}
+
+// The number of alleles from the size of an axis
+std::size_t num_alleles(std::size_t size, mutk::Ploidy ploidy) {
+    if(ploidy == mutk::Ploidy::Haploid) {
+        return size;
+    }
+    std::size_t n = 0;
+    while(mutk::num_diploids(n) < size) {
+        ++n;
+    }
+    return n;
+}
+
+// Apply a k-alleles operator to `x`, summing over the child if `sum_child` is
+// set and over the parent otherwise. `x` and `y` have `lanes` values per
+// genotype. Lane l uses `ops[l*op_stride]`, so a stride of 0 shares one
+// operator.
+template<class T>
+void apply_kalleles(const mutk::kalleles_operator_t *ops, std::size_t op_stride,
+    mutk::Ploidy ploidy, bool sum_child, std::size_t size, const T *x,
+    std::size_t lanes, T *y)
+{
+    if(ploidy == mutk::Ploidy::Haploid) {
+        // (a*I + b*J)x = a*x + b*sum(x)
+        for(std::size_t l = 0; l < lanes; ++l) {
+            const auto &op = ops[l*op_stride];
+            double total = 0.0;
+            for(std::size_t i = 0; i < size; ++i) {
+                total += x[i*lanes+l];
+            }
+            for(std::size_t i = 0; i < size; ++i) {
+                y[i*lanes+l] = static_cast<T>(op.a*x[i*lanes+l] + op.b*total);
+            }
+        }
+        return;
+    }
+
+    // Expand x into a symmetric matrix over ordered pairs of alleles, apply
+    // the haploid operator on both sides, and fold the result back.
+    const std::size_t n = num_alleles(size, ploidy);
+    std::vector<double> mat(n*n), sums(n);
+    for(std::size_t l = 0; l < lanes; ++l) {
+        const auto &op = ops[l*op_stride];
+        for(std::size_t i = 0; i < n; ++i) {
+            for(std::size_t j = 0; j < n; ++j) {
+                double v = x[genotype_index(i, j)*lanes+l];
+                mat[i*n+j] = (sum_child || i == j) ? v : 0.5*v;
+            }
+        }
+        // M*X
+        std::fill(sums.begin(), sums.end(), 0.0);
+        for(std::size_t i = 0; i < n; ++i) {
+            for(std::size_t j = 0; j < n; ++j) {
+                sums[j] += mat[i*n+j];
+            }
+        }
+        for(std::size_t i = 0; i < n; ++i) {
+            for(std::size_t j = 0; j < n; ++j) {
+                mat[i*n+j] = op.a*mat[i*n+j] + op.b*sums[j];
+            }
+        }
+        // (M*X)*M
+        for(std::size_t i = 0; i < n; ++i) {
+            double total = 0.0;
+            for(std::size_t j = 0; j < n; ++j) {
+                total += mat[i*n+j];
+            }
+            for(std::size_t j = 0; j < n; ++j) {
+                mat[i*n+j] = op.a*mat[i*n+j] + op.b*total;
+            }
+        }
+        for(std::size_t j = 0; j < n; ++j) {
+            for(std::size_t i = 0; i <= j; ++i) {
+                double v = mat[i*n+j];
+                y[genotype_index(i, j)*lanes+l] = static_cast<T>((sum_child || i == j) ? v : 2.0*v);
+            }
+        }
+    }
+}
+void gemv(std::size_t m, std::size_t n, const float *a, const float *x, float *y) {
+    cblas_sgemv(CblasRowMajor, CblasNoTrans, m, n, 1.0f, a, n, x, 1, 0.0f, y, 1);
+}
+
+void gemv(std::size_t m, std::size_t n, const double *a, const double *x, double *y) {
+    cblas_dgemv(CblasRowMajor, CblasNoTrans, m, n, 1.0, a, n, x, 1, 0.0, y, 1);
+}
+
+// Multiply the inputs of `step` other than its matrix into `vec`
+template<class T>
+void multiply_vectors(const mutk::GraphPeeler::contraction_t &step,
+    const std::vector<const T *> &inputs, std::size_t size, std::vector<T> *vec)
+{
+    vec->assign(size, T{1});
+    for(std::size_t k = 0; k < inputs.size(); ++k) {
+        if(static_cast<int>(k) == step.matrix) {
+            continue;
+        }
+        for(std::size_t j = 0; j < size; ++j) {
+            (*vec)[j] *= inputs[k][j];
+        }
+    }
+}
+// The k-alleles operator that can replace the matrix of `step`, if any
+const mutk::kalleles_operator_t * find_operator(
+    const std::vector<std::optional<mutk::kalleles_operator_t>> &operators,
+    const mutk::GraphPeeler::contraction_t &step)
+{
+    if(step.matrix < 0) {
+        return nullptr;
+    }
+    const auto slot = static_cast<std::size_t>(step.inputs[step.matrix]);
+    if(slot >= operators.size() || !operators[slot]) {
+        return nullptr;
+    }
+    return &*operators[slot];
+}
+} // namespace
+
+// Compute the strides of a factor with scope `sc` inside `scope`
+static void set_strides(const std::vector<mutk::variable_t> &scope,
+    const std::vector<mutk::variable_t> &sc, const std::vector<std::size_t> &dims,
+    std::size_t *strides)
+{
+    std::size_t stride = 1;
+    for(std::size_t j = sc.size(); j-- > 0;) {
+        auto a = std::find(scope.begin(), scope.end(), sc[j]) - scope.begin();
+        strides[a] = stride;
+        stride *= dims[a];
+    }
+}
+
+template<class T>
+double mutk::GraphPeeler::PeelForward(basic_workspace_t<T> &work) const {
+    assert(work.messages.size() == scopes_.size());
+
+    const auto & kernels = mutk::kernels::active();
+    kernels::kernel_table_t::contract_fn<T> contract;
+    void (*rescale)(T *, std::size_t, std::size_t, double *);
+    if constexpr(std::is_same_v<T, float>) {
+        contract = work.double_sums ? kernels.contract_mixed : kernels.contract;
+        rescale = kernels.rescale;
+    } else {
+        static_assert(std::is_same_v<T, double>);
+        contract = kernels.contract_double;
+        rescale = kernels.rescale_double;
+    }
+
+    // Steps are skipped if none of their inputs changed since the last peel
+    auto & dirty = work.dirty;
+    dirty.resize(scopes_.size(), 1);
+    if(work.log_scales.size() != plan_.size()) {
+        work.log_scales.assign(plan_.size(), 0.0);
+        std::fill(dirty.begin(), dirty.end(), 1);
+    }
+
+    double log_scale = 0.0;
+    std::vector<std::size_t> dims;
+    std::vector<const T *> inputs;
+    std::vector<std::uint8_t> laned;
+    std::vector<std::size_t> strides;
+    std::vector<std::size_t> scratch;
+    std::vector<T> vec;
+    for(std::size_t s = 0; s < plan_.size(); ++s) {
+        const auto & step = plan_[s];
+        const bool changed = std::any_of(step.inputs.begin(), step.inputs.end(),
+            [&](int slot) { return dirty[slot] != 0; });
+        dirty[step.output] = changed;
+        if(!changed) {
+            log_scale += work.log_scales[s];
+            continue;
+        }
+
+        const auto & scope = step.scope;
+        const std::size_t rank = scope.size();
+        dims.assign(rank, 0);
+        inputs.clear();
+        for(int slot : step.inputs) {
+            const auto & sc = scopes_[slot];
+            const auto & msg = work.messages[slot];
+            assert(msg.dimension() == sc.size() || sc.size() == 1);
+            inputs.push_back(msg.data());
+            for(std::size_t j = 0; j < sc.size(); ++j) {
+                auto a = std::find(scope.begin(), scope.end(), sc[j]) - scope.begin();
+                dims[a] = (sc.size() == 1) ? msg.size() : msg.shape(j);
+            }
+        }
+        laned.assign(inputs.size(), 1);
+        strides.assign(inputs.size()*rank, 0);
+        for(std::size_t k = 0; k < inputs.size(); ++k) {
+            set_strides(scope, scopes_[step.inputs[k]], dims, &strides[k*rank]);
+        }
+
+        scratch.resize(rank + inputs.size());
+
+        message_shape_t shape(dims.begin(), dims.end()-1);
+        auto & output = work.messages[step.output];
+        output = basic_message_t<T>::from_shape(shape);
+
+        const std::size_t inner = dims.back();
+        const std::size_t outer = output.size();
+        const auto * op = find_operator(work.operators, step);
+        if(op != nullptr) {
+            multiply_vectors(step, inputs, inner, &vec);
+            const int slot = step.inputs[step.matrix];
+            apply_kalleles(op, 0, ploidies_[+scope.back()],
+                model_components_[slot].variables[0] == scope.back(),
+                inner, vec.data(), 1, output.data());
+        } else if(step.matrix >= 0 && !work.double_sums && outer*inner >= work.blas_threshold) {
+            multiply_vectors(step, inputs, inner, &vec);
+            gemv(outer, inner, inputs[step.matrix], vec.data(), output.data());
+        } else {
+            contract(inputs.size(), inputs.data(), laned.data(), strides.data(),
+                dims.data(), rank, 1, scratch.data(), output.data());
+        }
+
+        // rescale to avoid underflow
+        double &step_scale = work.log_scales[s];
+        step_scale = 0.0;
+        rescale(output.data(), output.size(), 1, &step_scale);
+        log_scale += step_scale;
+        if(std::isinf(log_scale)) {
+            // Later steps were not run, so the next peel starts over
+            work.log_scales.clear();
+            return log_scale;
+        }
+    }
+    std::fill(dirty.begin(), dirty.end(), 0);
+    for(int slot : results_) {
+        log_scale += std::log(static_cast<double>(work.messages[slot].data()[0]));
+    }
+    return log_scale;
+}
+
+template double mutk::GraphPeeler::PeelForward<float>(basic_workspace_t<float> &) const;
+template double mutk::GraphPeeler::PeelForward<double>(basic_workspace_t<double> &) const;
+
+mutk::lane_workspace_t mutk::GraphPeeler::CreateLaneWorkspace(std::size_t num_lanes,
+    bool double_sums) const
+{
+    assert(num_lanes > 0);
+    lane_workspace_t work;
+    work.num_lanes = num_lanes;
+    work.double_sums = double_sums;
+    work.messages.resize(scopes_.size());
+    work.laned.assign(scopes_.size(), 0);
+    work.operators.assign(model_components_.size(),
+        std::vector<std::optional<kalleles_operator_t>>(num_lanes));
+    return work;
+}
+
+void mutk::GraphPeeler::SetModelPotentials(lane_workspace_t &work, std::size_t lane,
+    const workspace_t &model) const
+{
+    assert(work.messages.size() == scopes_.size());
+    assert(model.messages.size() == scopes_.size());
+    assert(lane < work.num_lanes);
+    const std::size_t lanes = work.num_lanes;
+
+    work.operators.resize(model_components_.size());
+    for(std::size_t i = 0; i < model_components_.size(); ++i) {
+        const auto & value = model.messages[i];
+        auto & msg = work.messages[i];
+        auto & tags = work.operators[i];
+        if(!work.laned[i] || msg.size() != value.size()*lanes) {
+            // Unused lanes are neutral
+            msg = message_t::from_shape({value.size(), lanes});
+            msg.fill(1.0f);
+            work.laned[i] = 1;
+            tags.assign(lanes, std::nullopt);
+        }
+        tags.resize(lanes);
+        tags[lane] = (i < model.operators.size()) ? model.operators[i] : std::nullopt;
+        float_t *out = msg.data() + lane;
+        for(auto x : value) {
+            *out = x;
+            out += lanes;
+        }
+    }
+}
+
+void mutk::GraphPeeler::SetDataPotentials(lane_workspace_t &work, message_size_t n,
+    const std::vector<mutk::message_t> &data) const
+{
+    assert(work.messages.size() == scopes_.size());
+    assert(data.size() == data_vertices_.size());
+    const std::size_t offset = model_components_.size();
+
+    work.num_alleles = n;
+    for(std::size_t i = 0; i < data.size(); ++i) {
+        assert(data[i].size() == message_axis_size(n, ploidies_[data_vertices_[i]]));
+        work.messages[offset+i] = data[i];
+        work.laned[offset+i] = 0;
+    }
+}
+
+void mutk::GraphPeeler::SetDataPotentials(lane_workspace_t &work, std::size_t lane,
+    message_size_t n, const std::vector<mutk::message_t> &data) const
+{
+    assert(work.messages.size() == scopes_.size());
+    assert(data.size() == data_vertices_.size());
+    assert(lane < work.num_lanes);
+    const std::size_t lanes = work.num_lanes;
+    const std::size_t offset = model_components_.size();
+
+    if(work.num_alleles != n || (!data.empty() && !work.laned[offset])) {
+        // Unused lanes are neutral
+        work.num_alleles = n;
+        for(std::size_t i = 0; i < data.size(); ++i) {
+            auto sz = message_axis_size(n, ploidies_[data_vertices_[i]]);
+            work.messages[offset+i] = message_t::from_shape({sz, lanes});
+            work.messages[offset+i].fill(1.0f);
+            work.laned[offset+i] = 1;
+        }
+    }
+    for(std::size_t i = 0; i < data.size(); ++i) {
+        auto & msg = work.messages[offset+i];
+        assert(data[i].size()*lanes == msg.size());
+        float_t *out = msg.data() + lane;
+        for(auto x : data[i]) {
+            *out = x;
+            out += lanes;
+        }
+    }
+}
+
+void mutk::GraphPeeler::PeelForward(const workspace_t &model, lane_workspace_t &work,
+    double *result) const
+{
+    assert(model.messages.size() == scopes_.size());
+    assert(work.messages.size() == scopes_.size());
+
+    const std::size_t num_model = model_components_.size();
+    std::vector<const float_t *> sources;
+    std::vector<std::uint8_t> laned;
+    for(std::size_t slot = 0; slot < num_model + data_vertices_.size(); ++slot) {
+        const bool is_model = slot < num_model;
+        sources.push_back(is_model ? model.messages[slot].data() : work.messages[slot].data());
+        laned.push_back(is_model ? 0 : work.laned[slot]);
+    }
+    // Every lane shares the operators of `model`
+    std::vector<std::vector<kalleles_operator_t>> operators(num_model);
+    for(std::size_t i = 0; i < num_model && i < model.operators.size(); ++i) {
+        if(model.operators[i]) {
+            operators[i].push_back(*model.operators[i]);
+        }
+    }
+    PeelLanes(sources, laned, operators, work, result);
+}
+
+void mutk::GraphPeeler::PeelForward(lane_workspace_t &work, double *result) const {
+    assert(work.messages.size() == scopes_.size());
+    assert(work.laned.size() == scopes_.size());
+
+    const std::size_t num_inputs = model_components_.size() + data_vertices_.size();
+    std::vector<const float_t *> sources;
+    for(std::size_t slot = 0; slot < num_inputs; ++slot) {
+        sources.push_back(work.messages[slot].data());
+    }
+    std::vector<std::uint8_t> laned(work.laned.begin(), work.laned.begin() + num_inputs);
+
+    // A component is applied as an operator only if every lane is tagged
+    std::vector<std::vector<kalleles_operator_t>> operators(model_components_.size());
+    for(std::size_t i = 0; i < operators.size() && i < work.operators.size(); ++i) {
+        const auto &tags = work.operators[i];
+        if(tags.size() != work.num_lanes || !work.laned[i]
+            || !std::all_of(tags.begin(), tags.end(), [](const auto &t) { return t.has_value(); })) {
+            continue;
+        }
+        for(const auto &t : tags) {
+            operators[i].push_back(*t);
+        }
+    }
+    PeelLanes(sources, laned, operators, work, result);
+}
+
+void mutk::GraphPeeler::PeelLanes(const std::vector<const float_t *> &sources,
+    const std::vector<std::uint8_t> &source_laned,
+    const std::vector<std::vector<kalleles_operator_t>> &operators,
+    lane_workspace_t &work, double *result) const
+{
+    assert(result != nullptr);
+
+    const auto & kernels = mutk::kernels::active();
+    auto contract = work.double_sums ? kernels.contract_mixed : kernels.contract;
+
+    const std::size_t lanes = work.num_lanes;
+    const std::size_t num_sources = sources.size();
+    const message_size_t n = work.num_alleles;
+
+    std::fill(result, result+lanes, 0.0);
+
+    std::vector<std::size_t> dims;
+    std::vector<const float_t *> inputs;
+    std::vector<std::uint8_t> laned;
+    std::vector<std::size_t> strides;
+    std::vector<std::size_t> scratch;
+    std::vector<float_t> vec;
+    for(auto && step : plan_) {
+        const auto & scope = step.scope;
+        const std::size_t rank = scope.size();
+        dims.clear();
+        for(auto v : scope) {
+            dims.push_back(message_axis_size(n, ploidies_[+v]));
+        }
+        inputs.clear();
+        laned.clear();
+        strides.assign(step.inputs.size()*rank, 0);
+        for(std::size_t k = 0; k < step.inputs.size(); ++k) {
+            const int slot = step.inputs[k];
+            const bool is_source = static_cast<std::size_t>(slot) < num_sources;
+            inputs.push_back(is_source ? sources[slot] : work.messages[slot].data());
+            laned.push_back(is_source ? source_laned[slot] : 1);
+            set_strides(scope, scopes_[slot], dims, &strides[k*rank]);
+        }
+        scratch.resize(rank + inputs.size());
+
+        message_shape_t shape(dims.begin(), dims.end()-1);
+        shape.push_back(lanes);
+        auto & output = work.messages[step.output];
+        output = message_t::from_shape(shape);
+
+        const std::size_t inner = dims.back();
+        const std::size_t outer = output.size()/lanes;
+        // A laned matrix needs one operator per lane
+        const kalleles_operator_t *op = nullptr;
+        std::size_t op_stride = 0;
+        if(step.matrix >= 0) {
+            const auto slot = static_cast<std::size_t>(step.inputs[step.matrix]);
+            const auto *ops = (slot < operators.size()) ? &operators[slot] : nullptr;
+            if(ops != nullptr && !laned[step.matrix] && ops->size() == 1) {
+                op = ops->data();
+            } else if(ops != nullptr && laned[step.matrix] && ops->size() == lanes) {
+                op = ops->data();
+                op_stride = 1;
+            }
+        }
+        const bool use_blas = step.matrix >= 0 && !laned[step.matrix] && !work.double_sums
+            && outer*inner >= work.blas_threshold;
+        if(op != nullptr || use_blas) {
+            // Shared matrix times a matrix with one column per lane
+            vec.assign(inner*lanes, 1.0f);
+            for(std::size_t k = 0; k < inputs.size(); ++k) {
+                if(static_cast<int>(k) == step.matrix) {
+                    continue;
+                }
+                for(std::size_t j = 0; j < inner; ++j) {
+                    for(std::size_t l = 0; l < lanes; ++l) {
+                        vec[j*lanes+l] *= inputs[k][laned[k] ? j*lanes+l : j];
+                    }
+                }
+            }
+            if(op != nullptr) {
+                const int slot = step.inputs[step.matrix];
+                apply_kalleles(op, op_stride, ploidies_[+scope.back()],
+                    model_components_[slot].variables[0] == scope.back(),
+                    inner, vec.data(), lanes, output.data());
+            } else {
+                cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, outer, lanes, inner,
+                    1.0f, inputs[step.matrix], inner, vec.data(), lanes,
+                    0.0f, output.data(), lanes);
+            }
+        } else {
+            contract(inputs.size(), inputs.data(), laned.data(), strides.data(),
+                dims.data(), rank, lanes, scratch.data(), output.data());
+        }
+
+        // rescale each lane to avoid underflow
+        kernels.rescale(output.data(), output.size()/lanes, lanes, result);
+    }
+    for(int slot : results_) {
+        for(std::size_t l = 0; l < lanes; ++l) {
+            result[l] += std::log(static_cast<double>(work.messages[slot].data()[l]));
+        }
+    }
+}
+
+
 // Triangulate a graph where the vertices are in topological order
 //
 // Almond and Kong (1991) Optimality Issues in Constructing a Markov Tree from Graphical Models.
@@ -195,6 +879,741 @@ TEST_CASE("triangulate_graph() identifies cliques") {
         CHECK(cliques[6] == clique_t({0}));
     }
 }
+
+TEST_CASE("GraphPeeler.PeelForward matches brute force") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::sample_id_t;
+    using mutk::message_shape_t;
+
+    // mom, dad, and child with data on the child and the mom
+    RelationshipGraph graph(3);
+    add_edge(0, 2, graph);
+    add_edge(1, 2, graph);
+    for(auto v : mutk::make_vertex_range(graph)) {
+        put(boost::vertex_ploidy, graph, v, Ploidy::Diploid);
+    }
+    put(boost::vertex_data, graph, 0, std::vector<sample_id_t>{sample_id_t{0}});
+    put(boost::vertex_data, graph, 2, std::vector<sample_id_t>{sample_id_t{1}});
+
+    auto peeler = GraphPeeler::Create(graph);
+    REQUIRE(peeler.model_components().size() == 3);
+    REQUIRE(peeler.data_vertices() == std::vector<GraphPeeler::vertex_t>({0, 2}));
+    CHECK(peeler.model_components()[2].variables.size() == 3);
+    for(auto && step : peeler.plan()) {
+        for(int slot : step.inputs) {
+            CHECK(peeler.scope(slot).back() == step.scope.back());
+        }
+    }
+
+    const std::size_t n = 2;
+    const std::size_t g = mutk::num_diploids(n);
+
+    auto prior = [&](std::size_t i) { return 0.1f + 0.2f*i; };
+    auto trans = [&](std::size_t c, std::size_t m, std::size_t f) {
+        return 0.05f + 0.1f*c + 0.03f*m + 0.07f*f;
+    };
+    std::vector<message_t> data(2, message_t::from_shape({g}));
+    for(std::size_t i = 0; i < g; ++i) {
+        data[0](i) = 0.3f + 0.2f*i;
+        data[1](i) = 1.0f - 0.25f*i;
+    }
+
+    auto model = [&](const GraphPeeler::model_component_t &pot,
+        std::size_t) {
+        message_shape_t shape(pot.variables.size(), g);
+        auto msg = message_t::from_shape(shape);
+        if(pot.variables.size() == 1) {
+            for(std::size_t i = 0; i < g; ++i) {
+                msg(i) = prior(i);
+            }
+        } else {
+            for(std::size_t c = 0; c < g; ++c) {
+                for(std::size_t m = 0; m < g; ++m) {
+                    for(std::size_t f = 0; f < g; ++f) {
+                        msg(c, m, f) = trans(c, m, f);
+                    }
+                }
+            }
+        }
+        return msg;
+    };
+
+    double expected = 0.0;
+    for(std::size_t c = 0; c < g; ++c) {
+        for(std::size_t m = 0; m < g; ++m) {
+            for(std::size_t f = 0; f < g; ++f) {
+                expected += static_cast<double>(prior(m))*prior(f)*trans(c, m, f)
+                    *data[0](m)*data[1](c);
+            }
+        }
+    }
+
+    SUBCASE("float") {
+        auto work = peeler.CreateWorkspace();
+        peeler.SetModelPotentials(work, n, model);
+        peeler.SetDataPotentials(work, n, data);
+        CHECK(peeler.PeelForward(work) == doctest::Approx(std::log(expected)));
+    }
+    SUBCASE("float with double sums") {
+        auto work = peeler.CreateWorkspace(true);
+        peeler.SetModelPotentials(work, n, model);
+        peeler.SetDataPotentials(work, n, data);
+        CHECK(peeler.PeelForward(work) == doctest::Approx(std::log(expected)));
+    }
+    SUBCASE("double") {
+        auto work = peeler.CreateWorkspace<double>();
+        peeler.SetModelPotentials(work, n, model);
+        peeler.SetDataPotentials(work, n, data);
+        CHECK(peeler.PeelForward(work) == doctest::Approx(std::log(expected)).epsilon(1e-12));
+    }
+}
+
+TEST_CASE("GraphPeeler.PeelForward on an extended pedigree") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::sample_id_t;
+
+    // three generations with a haploid founder
+    RelationshipGraph graph(9);
+    const std::vector<std::pair<int,int>> edges = {
+        {0,3}, {1,3}, {0,4}, {1,4}, {2,6}, {3,6}, {4,7}, {5,7}, {6,8}, {7,8}
+    };
+    for(auto [a, b] : edges) {
+        add_edge(a, b, graph);
+    }
+    for(auto v : mutk::make_vertex_range(graph)) {
+        put(boost::vertex_ploidy, graph, v, (v == 5) ? Ploidy::Haploid : Ploidy::Diploid);
+        if(v % 2 == 0 || v == 5) {
+            put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+        }
+    }
+    auto peeler = GraphPeeler::Create(graph);
+
+    const std::size_t n = 2;
+    auto size = [&](std::size_t v) {
+        return mutk::message_axis_size(n, peeler.ploidy(mutk::variable_t(v)));
+    };
+    // an arbitrary, asymmetric value for every entry of every factor
+    auto value = [](std::size_t v, const std::vector<std::size_t> &x) {
+        float ret = 0.1f + 0.01f*v;
+        for(std::size_t j = 0; j < x.size(); ++j) {
+            ret += 0.07f*(j+1)*x[j];
+        }
+        return ret;
+    };
+
+    auto work = peeler.CreateWorkspace<double>();
+    peeler.SetModelPotentials(work, n, [&](const GraphPeeler::model_component_t &pot,
+        std::size_t) {
+        mutk::message_shape_t shape;
+        for(auto w : pot.variables) {
+            shape.push_back(size(+w));
+        }
+        auto msg = message_t::from_shape(shape);
+        std::vector<std::size_t> x(shape.size(), 0);
+        for(auto && m : msg) {
+            m = value(+pot.variables[0], x);
+            for(std::size_t j = x.size(); j-- > 0;) {
+                if(++x[j] < shape[j]) {
+                    break;
+                }
+                x[j] = 0;
+            }
+        }
+        return msg;
+    });
+    std::vector<message_t> data;
+    for(auto v : peeler.data_vertices()) {
+        auto msg = message_t::from_shape({size(v)});
+        for(std::size_t i = 0; i < size(v); ++i) {
+            msg(i) = 0.5f + 0.1f*((i+v) % 3);
+        }
+        data.push_back(msg);
+    }
+    peeler.SetDataPotentials(work, n, data);
+
+    // sum over every joint genotype
+    double expected = 0.0;
+    std::vector<std::size_t> g(9, 0);
+    for(;;) {
+        double p = 1.0;
+        for(auto && pot : peeler.model_components()) {
+            std::vector<std::size_t> x;
+            for(auto w : pot.variables) {
+                x.push_back(g[+w]);
+            }
+            p *= value(+pot.variables[0], x);
+        }
+        for(std::size_t i = 0; i < data.size(); ++i) {
+            p *= data[i](g[peeler.data_vertices()[i]]);
+        }
+        expected += p;
+        std::size_t v = 0;
+        for(; v < 9; ++v) {
+            if(++g[v] < size(v)) {
+                break;
+            }
+            g[v] = 0;
+        }
+        if(v == 9) {
+            break;
+        }
+    }
+
+    CHECK(peeler.PeelForward(work) == doctest::Approx(std::log(expected)).epsilon(1e-9));
+
+    // Matrix products go through BLAS
+    CHECK(std::any_of(peeler.plan().begin(), peeler.plan().end(),
+        [](auto && step) { return step.matrix >= 0; }));
+    work.blas_threshold = 0;
+    work.log_scales.clear();
+    CHECK(peeler.PeelForward(work) == doctest::Approx(std::log(expected)).epsilon(1e-9));
+}
+
+TEST_CASE("GraphPeeler splits gametes") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::sample_id_t;
+    using kind_t = GraphPeeler::model_component_t::kind_t;
+
+    // Two full sibs and a half sib with a haploid father
+    RelationshipGraph graph(6);
+    add_edge(0, 2, {1.0f}, graph);
+    add_edge(1, 2, {1.0f}, graph);
+    add_edge(0, 3, {1.0f}, graph);
+    add_edge(1, 3, {1.0f}, graph);
+    add_edge(0, 5, {1.0f}, graph);
+    add_edge(4, 5, {1.0f}, graph);
+    for(std::size_t v = 0; v < 6; ++v) {
+        put(boost::vertex_ploidy, graph, v, (v == 4) ? Ploidy::Haploid : Ploidy::Diploid);
+    }
+    for(std::size_t v : {0, 2, 3, 5}) {
+        put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+    }
+
+    auto dense = GraphPeeler::Create(graph);
+    auto split = GraphPeeler::Create(graph, true);
+    REQUIRE(split.num_variables() == 6 + 5);
+    CHECK(split.data_vertices() == dense.data_vertices());
+    CHECK(split.model_components()[0].kind == kind_t::Founder);
+    CHECK(split.model_components()[2].kind == kind_t::Zygote);
+    CHECK(split.model_components()[5].kind == kind_t::Zygote);
+    CHECK(split.model_components()[5].ploidies ==
+        std::vector<Ploidy>{Ploidy::Diploid, Ploidy::Haploid, Ploidy::Haploid});
+    CHECK(split.model_components()[5].variables[2] == mutk::variable_t(4));
+    for(std::size_t v = 6; v < split.num_variables(); ++v) {
+        CHECK(split.model_components()[v].kind == kind_t::Gamete);
+        CHECK(split.model_components()[v].edge_lengths[1] == 1.0f);
+    }
+
+    const std::size_t n = 4;
+    auto size = [&](const GraphPeeler &peeler, const std::vector<mutk::variable_t> &scope) {
+        std::size_t ret = 1;
+        for(auto v : scope) {
+            ret *= mutk::message_axis_size(n, peeler.ploidy(v));
+        }
+        return ret;
+    };
+    auto largest = [&](const GraphPeeler &peeler) {
+        std::size_t ret = 0;
+        for(auto && step : peeler.plan()) {
+            ret = std::max(ret, size(peeler, step.scope));
+        }
+        return ret;
+    };
+    CHECK(largest(split) < largest(dense));
+
+    // P(h|p) for a gamete h of parent p
+    auto gamete = [](std::size_t h, std::size_t p) {
+        return 0.1f + 0.02f*h + 0.05f*p*(h+1);
+    };
+    auto prior = [](std::size_t i) { return 0.1f + 0.2f*i; };
+    auto gamete_model = [&](const GraphPeeler::model_component_t &pot, std::size_t) {
+        mutk::message_shape_t shape;
+        for(auto p : pot.ploidies) {
+            shape.push_back(mutk::message_axis_size(n, p));
+        }
+        auto msg = message_t::from_shape(shape);
+        for(std::size_t i = 0; i < msg.size(); ++i) {
+            msg.data()[i] = 0.0f;
+        }
+        switch(pot.kind) {
+        case kind_t::Founder:
+            for(std::size_t i = 0; i < shape[0]; ++i) {
+                msg(i) = prior(i);
+            }
+            break;
+        case kind_t::Gamete:
+            for(std::size_t h = 0; h < shape[0]; ++h) {
+                for(std::size_t p = 0; p < shape[1]; ++p) {
+                    msg(h, p) = gamete(h, p);
+                }
+            }
+            break;
+        case kind_t::Zygote:
+            for(std::size_t a = 0; a < n; ++a) {
+                for(std::size_t b = 0; b < n; ++b) {
+                    msg(genotype_index(a, b), a, b) = 1.0f;
+                }
+            }
+            break;
+        default:
+            FAIL("unexpected model component");
+        }
+        return msg;
+    };
+    auto dense_model = [&](const GraphPeeler::model_component_t &pot, std::size_t m) {
+        if(pot.variables.size() == 1) {
+            return gamete_model(pot, m);
+        }
+        mutk::message_shape_t shape;
+        for(auto p : pot.ploidies) {
+            shape.push_back(mutk::message_axis_size(n, p));
+        }
+        auto msg = message_t::from_shape(shape);
+        for(std::size_t i = 0; i < msg.size(); ++i) {
+            msg.data()[i] = 0.0f;
+        }
+        // The haploid father transmits his allele unchanged
+        const bool haploid = (pot.ploidies[2] == Ploidy::Haploid);
+        for(std::size_t m = 0; m < shape[1]; ++m) {
+            for(std::size_t f = 0; f < shape[2]; ++f) {
+                for(std::size_t a = 0; a < n; ++a) {
+                    for(std::size_t b = 0; b < n; ++b) {
+                        float w = haploid ? (b == f) : gamete(b, f);
+                        msg(genotype_index(a, b), m, f) += gamete(a, m)*w;
+                    }
+                }
+            }
+        }
+        return msg;
+    };
+
+    std::vector<message_t> data;
+    for(auto v : dense.data_vertices()) {
+        auto msg = message_t::from_shape({mutk::num_diploids(n)});
+        for(std::size_t i = 0; i < msg.size(); ++i) {
+            msg(i) = 1.0f/(1+i+v);
+        }
+        data.push_back(msg);
+    }
+
+    auto expected = dense.CreateWorkspace<double>();
+    dense.SetModelPotentials(expected, n, dense_model);
+    dense.SetDataPotentials(expected, n, data);
+
+    auto work = split.CreateWorkspace<double>();
+    split.SetModelPotentials(work, n, gamete_model);
+    split.SetDataPotentials(work, n, data);
+
+    CHECK(split.PeelForward(work) == doctest::Approx(dense.PeelForward(expected)));
+}
+
+namespace {
+// P(child|parent) of a k-alleles operator, to compare against dense factors
+double kalleles_value(const mutk::kalleles_operator_t &op, mutk::Ploidy ploidy,
+    std::size_t n, std::size_t child, std::size_t parent)
+{
+    auto m = [&](std::size_t i, std::size_t j) { return op.a*(i == j) + op.b; };
+    if(ploidy == mutk::Ploidy::Haploid) {
+        return m(parent, child);
+    }
+    // a/b -> x/y
+    for(std::size_t b = 0; b < n; ++b) {
+        for(std::size_t a = 0; a <= b; ++a) {
+            if(genotype_index(a, b) != parent) {
+                continue;
+            }
+            for(std::size_t y = 0; y < n; ++y) {
+                for(std::size_t x = 0; x <= y; ++x) {
+                    if(genotype_index(x, y) == child) {
+                        return m(a, x)*m(b, y) + ((x != y) ? m(a, y)*m(b, x) : 0.0);
+                    }
+                }
+            }
+        }
+    }
+    return 0.0;
+}
+} // namespace
+
+TEST_CASE("GraphPeeler applies k-alleles operators") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::sample_id_t;
+    using mutk::kalleles_operator_t;
+
+    const kalleles_operator_t op{0.8, 0.05};
+    const std::size_t n = 4;
+
+    SUBCASE("apply_kalleles matches the dense transition") {
+        for(auto ploidy : {Ploidy::Haploid, Ploidy::Diploid}) {
+            const std::size_t w = mutk::message_axis_size(n, ploidy);
+            const std::size_t lanes = 2;
+            std::vector<double> x(w*lanes), y(w*lanes);
+            for(std::size_t i = 0; i < x.size(); ++i) {
+                x[i] = 0.1 + 0.03*i;
+            }
+            for(bool sum_child : {true, false}) {
+                CAPTURE(sum_child);
+                apply_kalleles(&op, 0, ploidy, sum_child, w, x.data(), lanes, y.data());
+                for(std::size_t o = 0; o < w; ++o) {
+                    for(std::size_t l = 0; l < lanes; ++l) {
+                        double expected = 0.0;
+                        for(std::size_t v = 0; v < w; ++v) {
+                            expected += x[v*lanes+l]*(sum_child ?
+                                kalleles_value(op, ploidy, n, v, o) :
+                                kalleles_value(op, ploidy, n, o, v));
+                        }
+                        CHECK(y[o*lanes+l] == doctest::Approx(expected));
+                    }
+                }
+            }
+        }
+    }
+
+    SUBCASE("GraphPeeler dispatches tagged transitions") {
+        // a diploid germline with a somatic clone and a haploid chain
+        RelationshipGraph graph(4);
+        add_edge(0, 1, graph);
+        add_edge(2, 3, graph);
+        put(boost::vertex_ploidy, graph, 0, Ploidy::Diploid);
+        put(boost::vertex_ploidy, graph, 1, Ploidy::Diploid);
+        put(boost::vertex_ploidy, graph, 2, Ploidy::Haploid);
+        put(boost::vertex_ploidy, graph, 3, Ploidy::Haploid);
+        for(std::size_t v : {0, 1, 3}) {
+            put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+        }
+        auto peeler = GraphPeeler::Create(graph);
+
+        // Transitions are tagged with their operator
+        auto model = [&](const GraphPeeler::model_component_t &pot, std::size_t) {
+            mutk::model_potential_t ret;
+            mutk::message_shape_t shape;
+            for(auto p : pot.ploidies) {
+                shape.push_back(mutk::message_axis_size(n, p));
+            }
+            auto &msg = ret.value;
+            msg = message_t::from_shape(shape);
+            if(pot.variables.size() == 1) {
+                for(std::size_t i = 0; i < msg.size(); ++i) {
+                    msg(i) = 0.1f + 0.1f*i;
+                }
+            } else {
+                for(std::size_t c = 0; c < shape[0]; ++c) {
+                    for(std::size_t p = 0; p < shape[1]; ++p) {
+                        msg(c, p) = kalleles_value(op, pot.ploidies[0], n, c, p);
+                    }
+                }
+                ret.kalleles = op;
+            }
+            return ret;
+        };
+        std::vector<message_t> data;
+        for(auto v : peeler.data_vertices()) {
+            auto msg = message_t::from_shape({mutk::message_axis_size(n, peeler.ploidy(mutk::variable_t(v)))});
+            for(std::size_t i = 0; i < msg.size(); ++i) {
+                msg(i) = 1.0f/(1+i+v);
+            }
+            data.push_back(msg);
+        }
+
+        auto dense = peeler.CreateWorkspace<double>();
+        peeler.SetModelPotentials(dense, n, model);
+        peeler.SetDataPotentials(dense, n, data);
+        REQUIRE(dense.operators.size() == 4);
+        CHECK_FALSE(dense.operators[0]);
+        CHECK(dense.operators[1]);
+        CHECK_FALSE(dense.operators[2]);
+        CHECK(dense.operators[3]);
+        CHECK(dense.operators[1]->a == doctest::Approx(op.a));
+        CHECK(dense.operators[1]->b == doctest::Approx(op.b));
+        double structured = peeler.PeelForward(dense);
+
+        // Without operators, the same factors are contracted densely
+        std::fill(dense.operators.begin(), dense.operators.end(), std::nullopt);
+        dense.log_scales.clear();
+        CHECK(structured == doctest::Approx(peeler.PeelForward(dense)));
+
+        // Untagged factors are contracted densely, even if they follow a
+        // k-alleles model
+        auto other = peeler.CreateWorkspace<double>();
+        peeler.SetModelPotentials(other, n, [&](auto && pot, std::size_t m) {
+            return model(pot, m).value;
+        });
+        REQUIRE(other.operators.size() == 4);
+        CHECK_FALSE(other.operators[1]);
+        CHECK_FALSE(other.operators[3]);
+        peeler.SetDataPotentials(other, n, data);
+        CHECK(structured == doctest::Approx(peeler.PeelForward(other)));
+
+        // Refilling a component without a tag drops its operator
+        peeler.SetModelPotentials(dense, n, model);
+        peeler.UpdateModelPotentials(dense, n, [&](auto && pot, std::size_t m) {
+            return model(pot, m).value;
+        }, [](auto && pot) { return pot.ploidies[0] == Ploidy::Haploid; });
+        CHECK(dense.operators[1]);
+        CHECK_FALSE(dense.operators[3]);
+
+        // Only transitions between variables of the same ploidy can be tagged
+        CHECK_THROWS_AS(peeler.SetModelPotentials(other, n, [&](auto && pot, std::size_t m) {
+            auto ret = model(pot, m);
+            ret.kalleles = op;
+            return ret;
+        }), std::invalid_argument);
+    }
+}
+
+TEST_CASE("GraphPeeler.PeelForward with lanes") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::message_shape_t;
+    using mutk::sample_id_t;
+
+    RelationshipGraph graph(3);
+    add_edge(0, 2, graph);
+    add_edge(1, 2, graph);
+    for(auto v : mutk::make_vertex_range(graph)) {
+        put(boost::vertex_ploidy, graph, v, Ploidy::Diploid);
+        put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+    }
+    auto peeler = GraphPeeler::Create(graph);
+
+    const std::size_t n = 3;
+    const std::size_t g = mutk::num_diploids(n);
+
+    auto model = peeler.CreateWorkspace();
+    peeler.SetModelPotentials(model, n, [&](const GraphPeeler::model_component_t &pot,
+        std::size_t) {
+        message_shape_t shape(pot.variables.size(), g);
+        auto msg = message_t::from_shape(shape);
+        for(std::size_t i = 0; i < msg.size(); ++i) {
+            msg.data()[i] = 0.01f + 0.1f*((i*7) % 11);
+        }
+        return msg;
+    });
+
+    // Lanes 0-4 hold families; lane 5 has no data and lane 6 is impossible
+    const std::size_t num_lanes = 7;
+    auto lanes = peeler.CreateLaneWorkspace(num_lanes);
+    std::vector<double> expected(num_lanes);
+    for(std::size_t l = 0; l < num_lanes; ++l) {
+        std::vector<message_t> data(3, message_t::from_shape({g}));
+        for(std::size_t j = 0; j < 3; ++j) {
+            for(std::size_t i = 0; i < g; ++i) {
+                data[j](i) = (l == 5) ? 1.0f : (l == 6 && j == 2) ? 0.0f
+                    : 0.1f + 0.15f*((i+j+l) % 5);
+            }
+        }
+        peeler.SetDataPotentials(lanes, l, n, data);
+        auto work = model;
+        peeler.SetDataPotentials(work, n, data);
+        expected[l] = peeler.PeelForward(work);
+    }
+
+    std::vector<double> result(num_lanes);
+    peeler.PeelForward(model, lanes, result.data());
+    for(std::size_t l = 0; l < num_lanes-1; ++l) {
+        CAPTURE(l);
+        CHECK(result[l] == doctest::Approx(expected[l]));
+    }
+    CHECK(std::isinf(result[6]));
+    CHECK(std::isinf(expected[6]));
+
+    // Matrix products over lanes go through BLAS
+    lanes.blas_threshold = 0;
+    peeler.PeelForward(model, lanes, result.data());
+    for(std::size_t l = 0; l < num_lanes-1; ++l) {
+        CAPTURE(l);
+        CHECK(result[l] == doctest::Approx(expected[l]));
+    }
+    CHECK(std::isinf(result[6]));
+}
+
+TEST_CASE("GraphPeeler.PeelForward reuses unchanged messages") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::message_shape_t;
+    using mutk::sample_id_t;
+
+    RelationshipGraph graph(5);
+    add_edge(0, 2, graph);
+    add_edge(1, 2, graph);
+    add_edge(2, 3, graph);
+    add_edge(1, 4, graph);
+    for(auto v : mutk::make_vertex_range(graph)) {
+        put(boost::vertex_ploidy, graph, v, Ploidy::Diploid);
+        put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+    }
+    auto peeler = GraphPeeler::Create(graph);
+
+    const std::size_t n = 3;
+    const std::size_t g = mutk::num_diploids(n);
+
+    // `theta` scales the priors and `mu` the transitions
+    auto model = [&](float theta, float mu) {
+        return [=](const GraphPeeler::model_component_t &pot, std::size_t) {
+            message_shape_t shape(pot.variables.size(), g);
+            auto msg = message_t::from_shape(shape);
+            const float scale = GraphPeeler::IsPrior(pot) ? theta : mu;
+            for(std::size_t i = 0; i < msg.size(); ++i) {
+                msg.data()[i] = 0.01f + 0.1f*((i*7) % 11)*scale;
+            }
+            return msg;
+        };
+    };
+    auto data = [&](float x) {
+        std::vector<message_t> ret(peeler.data_vertices().size(), message_t::from_shape({g}));
+        for(std::size_t j = 0; j < ret.size(); ++j) {
+            for(std::size_t i = 0; i < g; ++i) {
+                ret[j](i) = 0.1f + x*((i+2*j) % 5);
+            }
+        }
+        return ret;
+    };
+    auto fresh = [&](float theta, float mu, float x) {
+        auto work = peeler.CreateWorkspace<double>();
+        peeler.SetModelPotentials(work, n, model(theta, mu));
+        peeler.SetDataPotentials(work, n, data(x));
+        return peeler.PeelForward(work);
+    };
+
+    auto work = peeler.CreateWorkspace<double>();
+    peeler.SetModelPotentials(work, n, model(1.0f, 1.0f));
+    peeler.SetDataPotentials(work, n, data(0.15f));
+    const double first = peeler.PeelForward(work);
+    CHECK(first == doctest::Approx(fresh(1.0f, 1.0f, 0.15f)));
+    CHECK(std::none_of(work.dirty.begin(), work.dirty.end(), [](auto x) { return x != 0; }));
+
+    // Nothing changed, so every step is reused
+    auto saved = work.messages;
+    const auto num_inputs = peeler.model_components().size() + peeler.data_vertices().size();
+    for(std::size_t slot = 0; slot < num_inputs; ++slot) {
+        std::fill(work.messages[slot].begin(), work.messages[slot].end(), 0.0);
+    }
+    CHECK(peeler.PeelForward(work) == first);
+    work.messages = saved;
+
+    peeler.UpdateModelPotentials(work, n, model(2.0f, 1.0f), GraphPeeler::IsPrior);
+    CHECK(peeler.PeelForward(work) == doctest::Approx(fresh(2.0f, 1.0f, 0.15f)));
+
+    peeler.UpdateModelPotentials(work, n, model(2.0f, 0.5f),
+        [](auto && pot) { return !GraphPeeler::IsPrior(pot); });
+    CHECK(peeler.PeelForward(work) == doctest::Approx(fresh(2.0f, 0.5f, 0.15f)));
+
+    peeler.SetDataPotentials(work, n, data(0.2f));
+    CHECK(peeler.PeelForward(work) == doctest::Approx(fresh(2.0f, 0.5f, 0.2f)));
+
+    // An impossible site stops early and the next peel starts over
+    peeler.SetDataPotentials(work, n, data(0.0f));
+    std::fill(work.messages[peeler.model_components().size()].begin(),
+        work.messages[peeler.model_components().size()].end(), 0.0);
+    CHECK(std::isinf(peeler.PeelForward(work)));
+    peeler.SetDataPotentials(work, n, data(0.2f));
+    CHECK(peeler.PeelForward(work) == doctest::Approx(fresh(2.0f, 0.5f, 0.2f)));
+}
+
+TEST_CASE("GraphPeeler.PeelForward over a parameter grid") {
+    using mutk::RelationshipGraph;
+    using mutk::GraphPeeler;
+    using mutk::Ploidy;
+    using mutk::message_t;
+    using mutk::message_shape_t;
+    using mutk::sample_id_t;
+
+    RelationshipGraph graph(4);
+    add_edge(0, 2, graph);
+    add_edge(1, 2, graph);
+    add_edge(2, 3, graph);
+    for(auto v : mutk::make_vertex_range(graph)) {
+        put(boost::vertex_ploidy, graph, v, Ploidy::Diploid);
+        put(boost::vertex_data, graph, v, std::vector<sample_id_t>{sample_id_t(v)});
+    }
+    auto peeler = GraphPeeler::Create(graph);
+
+    const std::size_t n = 3;
+    const std::size_t g = mutk::num_diploids(n);
+
+    std::vector<message_t> data(4, message_t::from_shape({g}));
+    for(std::size_t j = 0; j < 4; ++j) {
+        for(std::size_t i = 0; i < g; ++i) {
+            data[j](i) = 0.1f + 0.15f*((i+2*j) % 5);
+        }
+    }
+
+    // One lane per mutation rate. The clone is a k-alleles transition.
+    const std::vector<double> grid = {1e-4, 1e-3, 1e-2, 0.1, 0.5};
+    auto lanes = peeler.CreateLaneWorkspace(grid.size());
+    peeler.SetDataPotentials(lanes, n, data);
+    std::vector<double> expected;
+    for(std::size_t l = 0; l < grid.size(); ++l) {
+        const mutk::kalleles_operator_t op{std::exp(-grid[l]), (1.0-std::exp(-grid[l]))/n};
+        auto model = peeler.CreateWorkspace();
+        peeler.SetModelPotentials(model, n, [&](const GraphPeeler::model_component_t &pot,
+            std::size_t) {
+            message_shape_t shape(pot.variables.size(), g);
+            auto msg = message_t::from_shape(shape);
+            for(std::size_t i = 0; i < msg.size(); ++i) {
+                msg.data()[i] = 0.01f + 0.1f*((i*7) % 11)*(1.0f + grid[l]);
+            }
+            std::optional<mutk::kalleles_operator_t> kalleles;
+            if(pot.variables.size() == 2) {
+                for(std::size_t c = 0; c < g; ++c) {
+                    for(std::size_t p = 0; p < g; ++p) {
+                        msg(c, p) = kalleles_value(op, Ploidy::Diploid, n, c, p);
+                    }
+                }
+                kalleles = op;
+            }
+            return mutk::model_potential_t{msg, kalleles};
+        });
+        peeler.SetModelPotentials(lanes, l, model);
+        auto work = model;
+        peeler.SetDataPotentials(work, n, data);
+        expected.push_back(peeler.PeelForward(work));
+    }
+
+    std::vector<double> result(grid.size());
+    peeler.PeelForward(lanes, result.data());
+    for(std::size_t l = 0; l < grid.size(); ++l) {
+        CAPTURE(l);
+        CHECK(result[l] == doctest::Approx(expected[l]));
+    }
+    CHECK(result[0] != doctest::Approx(result[4]));
+
+    // Every lane of the clone is tagged, so it is applied as an operator
+    // and its dense values are not read
+    const auto &components = peeler.model_components();
+    const std::size_t clone = std::find_if(components.begin(), components.end(),
+        [](auto &&c) { return c.variables.size() == 2; }) - components.begin();
+    REQUIRE(clone < components.size());
+    REQUIRE(lanes.operators[clone].size() == grid.size());
+    CHECK(lanes.operators[clone][2]->a == doctest::Approx(std::exp(-grid[2])));
+    lanes.messages[clone].fill(0.0f);
+    peeler.PeelForward(lanes, result.data());
+    for(std::size_t l = 0; l < grid.size(); ++l) {
+        CAPTURE(l);
+        CHECK(result[l] == doctest::Approx(expected[l]));
+    }
+
+    // If one lane is untagged, the clone is contracted densely
+    lanes.operators[clone][2].reset();
+    peeler.PeelForward(lanes, result.data());
+    CHECK(std::isinf(result[0]));
+}
 // LCOV_EXCL_STOP
 
 std::vector<component_t>
@@ -0,0 +1,278 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+// NOTE: This file is included once by each kernels-<variant>.cpp, which are
+// compiled with different instruction sets. MUTK_KERNEL_TABLE must name
+// the table to define.
+//
+// Everything here has internal linkage, including the templates, and
+// library templates are avoided so that the linker can never merge code
+// built for a newer instruction set into another variant.
+
+#include "kernels.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <htslib/vcf.h>
+
+#ifndef MUTK_KERNEL_TABLE
+#   error "MUTK_KERNEL_TABLE must be defined"
+#endif
+
+namespace {
+
+// Advance the odometer `index` over `dims` and update the offsets of the inputs
+inline void advance(std::size_t *index, std::size_t *offsets, std::size_t num_inputs,
+    const std::size_t *strides, const std::size_t *dims, std::size_t rank)
+{
+    for(std::size_t a = rank; a-- > 0;) {
+        index[a] += 1;
+        for(std::size_t k = 0; k < num_inputs; ++k) {
+            offsets[k] += strides[k*rank+a];
+        }
+        if(index[a] < dims[a]) {
+            break;
+        }
+        for(std::size_t k = 0; k < num_inputs; ++k) {
+            offsets[k] -= strides[k*rank+a]*dims[a];
+        }
+        index[a] = 0;
+    }
+}
+
+// Messages are stored as S and products and sums are computed as A
+template<class S, class A>
+void contract(std::size_t num_inputs, const S *const *inputs,
+    const std::uint8_t *laned, const std::size_t *strides,
+    const std::size_t *dims, std::size_t rank, std::size_t lanes,
+    std::size_t *scratch, S *output)
+{
+    constexpr std::size_t MAX_LANES = 64;
+
+    const std::size_t inner = dims[rank-1];
+    std::size_t total = 1;
+    for(std::size_t a = 0; a < rank; ++a) {
+        total *= dims[a];
+    }
+
+    std::size_t *index = scratch;
+    std::size_t *offsets = scratch + rank;
+    for(std::size_t j = 0; j < rank + num_inputs; ++j) {
+        scratch[j] = 0;
+    }
+
+    // The summed axis is the innermost, so every output value is the sum of
+    // `inner` consecutive products.
+    if(lanes == 1) {
+        for(std::size_t o = 0; o < total/inner; ++o) {
+            A sum = 0;
+            for(std::size_t j = 0; j < inner; ++j) {
+                A p = 1;
+                for(std::size_t k = 0; k < num_inputs; ++k) {
+                    p *= inputs[k][offsets[k]];
+                }
+                sum += p;
+                advance(index, offsets, num_inputs, strides, dims, rank);
+            }
+            output[o] = static_cast<S>(sum);
+        }
+        return;
+    }
+
+    // Lanes are processed in fixed-width chunks that fit in registers
+    for(std::size_t base = 0; base < lanes; base += MAX_LANES) {
+        const std::size_t width = (lanes - base < MAX_LANES) ? lanes - base : MAX_LANES;
+        A p[MAX_LANES];
+        A sum[MAX_LANES];
+        for(std::size_t o = 0; o < total/inner; ++o) {
+            for(std::size_t l = 0; l < width; ++l) {
+                sum[l] = 0;
+            }
+            for(std::size_t j = 0; j < inner; ++j) {
+                for(std::size_t l = 0; l < width; ++l) {
+                    p[l] = 1;
+                }
+                for(std::size_t k = 0; k < num_inputs; ++k) {
+                    if(laned[k]) {
+                        const S *in = inputs[k] + offsets[k]*lanes + base;
+                        for(std::size_t l = 0; l < width; ++l) {
+                            p[l] *= in[l];
+                        }
+                    } else {
+                        const A x = inputs[k][offsets[k]];
+                        for(std::size_t l = 0; l < width; ++l) {
+                            p[l] *= x;
+                        }
+                    }
+                }
+                for(std::size_t l = 0; l < width; ++l) {
+                    sum[l] += p[l];
+                }
+                advance(index, offsets, num_inputs, strides, dims, rank);
+            }
+            S *out = output + o*lanes + base;
+            for(std::size_t l = 0; l < width; ++l) {
+                out[l] = static_cast<S>(sum[l]);
+            }
+        }
+        for(std::size_t j = 0; j < rank + num_inputs; ++j) {
+            scratch[j] = 0;
+        }
+    }
+}
+
+// Natural log of x > 0 using only arithmetic and bit operations, so that
+// loops over lanes vectorize instead of calling ::log once per lane.
+// Results are within a few ulp of ::log.
+inline double log_positive(double x) {
+    // Move subnormals into the normal range. Selects pick constants and
+    // the arithmetic is unconditional, so the compiler can if-convert.
+    const bool tiny = x < 0x1p-1022;
+    x *= tiny ? 0x1p54 : 1.0;
+
+    // Split x into m*2^e with m in [sqrt(1/2), sqrt(2))
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    std::uint64_t ebits = (bits >> 52) | 0x4330000000000000u;
+    double e;
+    std::memcpy(&e, &ebits, sizeof(e));
+    e -= 0x1p52 + 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFu) | 0x3FF0000000000000u;
+    double m;
+    std::memcpy(&m, &bits, sizeof(m));
+    const bool big = m > 1.4142135623730951;
+    m *= big ? 0.5 : 1.0;
+    e += big ? 1.0 : 0.0;
+    e -= tiny ? 54.0 : 0.0;
+
+    // log(m) = 2*atanh(s) = 2*(s + s^3/3 + s^5/5 + ...) with |s| < 0.172
+    const double s = (m - 1)/(m + 1);
+    const double z = s*s;
+    double p = 1.0/23;
+    p = p*z + 1.0/21;
+    p = p*z + 1.0/19;
+    p = p*z + 1.0/17;
+    p = p*z + 1.0/15;
+    p = p*z + 1.0/13;
+    p = p*z + 1.0/11;
+    p = p*z + 1.0/9;
+    p = p*z + 1.0/7;
+    p = p*z + 1.0/5;
+    p = p*z + 1.0/3;
+    p = p*z + 1.0;
+
+    // log(2) split so that e*LN2_HI is exact
+    constexpr double LN2_HI = 0x1.62e42fefa3800p-1;
+    constexpr double LN2_LO = 0x1.ef35793c76730p-45;
+    const double ret = e*LN2_HI + (2*s*p + e*LN2_LO);
+    return (x == HUGE_VAL) ? HUGE_VAL : ret;
+}
+
+template<class S>
+void rescale(S *data, std::size_t size, std::size_t lanes, double *log_scale) {
+    constexpr std::size_t MAX_LANES = 64;
+
+    for(std::size_t base = 0; base < lanes; base += MAX_LANES) {
+        const std::size_t width = (lanes - base < MAX_LANES) ? lanes - base : MAX_LANES;
+        S hi[MAX_LANES];
+        for(std::size_t l = 0; l < width; ++l) {
+            hi[l] = 0;
+        }
+        for(std::size_t i = 0; i < size; ++i) {
+            const S *in = data + i*lanes + base;
+            for(std::size_t l = 0; l < width; ++l) {
+                hi[l] = (in[l] > hi[l]) ? in[l] : hi[l];
+            }
+        }
+        for(std::size_t l = 0; l < width; ++l) {
+            const bool ok = (hi[l] > 0);
+            const S x = ok ? hi[l] : S{1};
+            const double sum = log_scale[base+l] + log_positive(x);
+            log_scale[base+l] = ok ? sum : -HUGE_VAL;
+            hi[l] = 1/x;
+        }
+        for(std::size_t i = 0; i < size; ++i) {
+            S *out = data + i*lanes + base;
+            for(std::size_t l = 0; l < width; ++l) {
+                out[l] *= hi[l];
+            }
+        }
+    }
+}
+
+void decode_pl(const std::int32_t *pl, int num_samples, int stride,
+    const int *columns, int hap_width, int dip_width,
+    const float *table, int table_size,
+    float *values, std::int8_t *encodings)
+{
+    const int copy_width = (stride < dip_width) ? stride : dip_width;
+    const std::uint32_t last = static_cast<std::uint32_t>(table_size-1);
+
+    for(int i = 0; i < num_samples; ++i) {
+        const std::int32_t *in = pl + (columns ? columns[i] : i)*stride;
+        float *out = values + i*dip_width;
+
+        // Measure the width of the row and find its smallest PL. htslib pads
+        // short rows with vector_end. Both sentinels are negative, so they
+        // become very large unsigned values that never win the min.
+        int w = 0;
+        std::uint32_t lo = 0xFFFFFFFFu;
+        for(int k = 0; k < stride; ++k) {
+            const std::uint32_t x = static_cast<std::uint32_t>(in[k]);
+            w += (in[k] != bcf_int32_vector_end);
+            lo = (x < lo) ? x : lo;
+        }
+        const bool missing = (in[0] == bcf_int32_missing);
+
+        int enc = 2*(w == dip_width) + (w == hap_width && w != dip_width);
+        enc += 3*(enc == 0);
+        enc *= !missing;
+        encodings[i] = static_cast<std::int8_t>(enc);
+
+        // Normalize by the smallest PL and convert using the table.
+        // If PLs are missing for this sample, set everything to 1.
+        for(int k = 0; k < copy_width; ++k) {
+            std::uint32_t x = static_cast<std::uint32_t>(in[k]) - lo;
+            float value = table[(x < last) ? x : last];
+            out[k] = missing ? 1.0f : value;
+        }
+        for(int k = copy_width; k < dip_width; ++k) {
+            out[k] = missing ? 1.0f : 0.0f;
+        }
+    }
+}
+
+} // namespace
+
+const mutk::kernels::kernel_table_t mutk::kernels::detail::MUTK_KERNEL_TABLE = {
+    MUTK_KERNEL_NAME,
+    &contract<float, float>,
+    &contract<float, double>,
+    &contract<double, double>,
+    &rescale<float>,
+    &rescale<double>,
+    &decode_pl
+};
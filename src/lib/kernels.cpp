@@ -0,0 +1,214 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+#include "unit_testing.hpp"
+
+#include "kernels.hpp"
+
+#include <mutk/message.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cmath>
+#include <type_traits>
+
+#include <htslib/vcf.h>
+
+using mutk::kernels::kernel_table_t;
+
+// kernels.hpp spells mutk::float_t as float
+static_assert(std::is_same_v<mutk::float_t, float>);
+
+namespace {
+
+// Variants from slowest to fastest
+std::vector<const kernel_table_t *> supported_variants() {
+    std::vector<const kernel_table_t *> ret = {&mutk::kernels::detail::generic};
+#if MUTK_KERNELS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) {
+        ret.push_back(&mutk::kernels::detail::sse42);
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        ret.push_back(&mutk::kernels::detail::avx2);
+    }
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vl")) {
+        ret.push_back(&mutk::kernels::detail::avx512);
+    }
+#endif
+    return ret;
+}
+
+const kernel_table_t * find_variant(const std::string &name) {
+    for(auto *p : supported_variants()) {
+        if(name == p->name) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+const kernel_table_t * default_variant() {
+    if(const char *env = std::getenv("MUTK_KERNELS"); env != nullptr && *env != '\0') {
+        if(auto *p = find_variant(env); p != nullptr) {
+            return p;
+        }
+    }
+    return supported_variants().back();
+}
+
+std::atomic<const kernel_table_t *> & active_variant() {
+    static std::atomic<const kernel_table_t *> value{default_variant()};
+    return value;
+}
+
+} // namespace
+
+const kernel_table_t & mutk::kernels::active() {
+    return *active_variant().load(std::memory_order_relaxed);
+}
+
+bool mutk::kernels::select(const std::string &name) {
+    auto *p = find_variant(name);
+    if(p == nullptr) {
+        return false;
+    }
+    active_variant().store(p, std::memory_order_relaxed);
+    return true;
+}
+
+std::vector<std::string> mutk::kernels::available() {
+    std::vector<std::string> ret;
+    for(auto *p : supported_variants()) {
+        ret.emplace_back(p->name);
+    }
+    return ret;
+}
+
+// LCOV_EXCL_START
+TEST_CASE("kernels agree across variants") {
+    using mutk::float_t;
+
+    const std::string original = mutk::kernels::active().name;
+    CHECK_FALSE(mutk::kernels::select("no-such-variant"));
+    CHECK(mutk::kernels::active().name == original);
+
+    // Factor A(x,y) times B(y) summed over y, for 3 lanes; A is shared
+    const std::size_t dims[] = {3, 4};
+    std::vector<float_t> a(12), b(12);
+    for(std::size_t i = 0; i < a.size(); ++i) {
+        a[i] = 0.1f*(i+1);
+        b[i] = 1.0f/(i+1);
+    }
+    const float_t *inputs[] = {a.data(), b.data()};
+    const std::uint8_t laned[] = {0, 1};
+    const std::size_t strides[] = {4, 1, 0, 1};
+
+    std::vector<float_t> expected(9, 0.0f);
+    for(std::size_t x = 0; x < 3; ++x) {
+        for(std::size_t l = 0; l < 3; ++l) {
+            for(std::size_t y = 0; y < 4; ++y) {
+                expected[x*3+l] += a[x*4+y]*b[y*3+l];
+            }
+        }
+    }
+
+    for(auto && name : mutk::kernels::available()) {
+        CAPTURE(name);
+        REQUIRE(mutk::kernels::select(name));
+        auto & k = mutk::kernels::active();
+        CHECK(k.name == name);
+
+        std::size_t scratch[4];
+        std::vector<float_t> out(9);
+        k.contract(2, inputs, laned, strides, dims, 2, 3, scratch, out.data());
+        for(std::size_t i = 0; i < out.size(); ++i) {
+            CHECK(out[i] == doctest::Approx(expected[i]));
+        }
+        std::vector<float_t> mixed(9);
+        k.contract_mixed(2, inputs, laned, strides, dims, 2, 3, scratch, mixed.data());
+        for(std::size_t i = 0; i < mixed.size(); ++i) {
+            CHECK(mixed[i] == doctest::Approx(expected[i]));
+        }
+
+        std::vector<double> ad(a.begin(), a.end()), bd(b.begin(), b.end());
+        const double *dinputs[] = {ad.data(), bd.data()};
+        std::vector<double> dout(9);
+        k.contract_double(2, dinputs, laned, strides, dims, 2, 3, scratch, dout.data());
+        for(std::size_t i = 0; i < dout.size(); ++i) {
+            CHECK(dout[i] == doctest::Approx(expected[i]));
+        }
+
+        std::vector<double> scale(3, 0.0);
+        k.rescale(out.data(), 3, 3, scale.data());
+        for(std::size_t l = 0; l < 3; ++l) {
+            float_t hi = std::max({expected[l], expected[3+l], expected[6+l]});
+            CHECK(scale[l] == doctest::Approx(std::log(hi)));
+            CHECK(out[6+l] == doctest::Approx(expected[6+l]/hi));
+        }
+
+        std::vector<double> zero(2, 0.0);
+        double zero_scale = 0.0;
+        k.rescale_double(zero.data(), 2, 1, &zero_scale);
+        CHECK(std::isinf(zero_scale));
+
+        // One value per lane, from subnormal to huge
+        std::vector<double> wide = {5e-320, 1e-300, 0.7071067811865476, 1.0,
+            1.4142135623730951, 3.7, 1e300, 0.1};
+        std::vector<double> wide_scale(wide.size(), 1.0);
+        auto wide_data = wide;
+        k.rescale_double(wide_data.data(), 1, wide.size(), wide_scale.data());
+        for(std::size_t l = 0; l < wide.size(); ++l) {
+            CAPTURE(wide[l]);
+            CHECK(wide_scale[l] == doctest::Approx(1.0 + std::log(wide[l])).epsilon(1e-15));
+        }
+
+        // Full-width, haploid-width, and missing rows; the second sample
+        // is read through `columns`
+        const std::int32_t pl[] = {
+            30, 10, 20,
+            0, 5, 255,
+            5, 0, bcf_int32_vector_end,
+            bcf_int32_missing, bcf_int32_vector_end, bcf_int32_vector_end
+        };
+        const int columns[] = {0, 2, 3, 1};
+        std::vector<float_t> table(256);
+        for(std::size_t i = 0; i < table.size(); ++i) {
+            table[i] = (i+1 < table.size()) ? std::pow(10.0f, -0.1f*i) : 0.0f;
+        }
+        std::vector<float_t> values(4*3, -1.0f);
+        std::vector<std::int8_t> encodings(4, -1);
+        k.decode_pl(pl, 4, 3, columns, 2, 3, table.data(), table.size(),
+            values.data(), encodings.data());
+        CHECK(encodings == std::vector<std::int8_t>{2, 1, 0, 2});
+        CHECK(values == std::vector<float_t>{
+            table[20], table[0], table[10],
+            table[5], table[0], 0.0f,
+            1.0f, 1.0f, 1.0f,
+            table[0], table[5], 0.0f});
+    }
+    mutk::kernels::select(original);
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,108 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+// NOTE: This header is in the lib directory because it is not part of the
+// public API at this time.
+
+#ifndef MUTK_KERNELS_HPP
+#define MUTK_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#   define MUTK_KERNELS_X86 1
+#else
+#   define MUTK_KERNELS_X86 0
+#endif
+
+namespace mutk::kernels {
+
+// The hot loops of peeling and PL decoding. Each instruction set gets its
+// own table, built from the same source with different compiler flags.
+struct kernel_table_t {
+    const char *name;
+
+    // Multiply `num_inputs` factors over the product space `dims` of `rank`
+    // axes and sum over the last axis into `output`.
+    // `strides[k*rank+a]` is the stride of input k along axis a, or 0 if the
+    // input does not depend on axis a. If `lanes` > 1, the output and every
+    // input with `laned[k]` set have a trailing lane axis. Inputs without
+    // lanes are shared by all lanes. `scratch` must hold `rank + num_inputs`
+    // values.
+    //
+    // `contract` computes in float, `contract_mixed` stores float but
+    // multiplies and sums in double, and `contract_double` uses double.
+    template<class S>
+    using contract_fn = void (*)(std::size_t num_inputs, const S *const *inputs,
+        const std::uint8_t *laned, const std::size_t *strides,
+        const std::size_t *dims, std::size_t rank, std::size_t lanes,
+        std::size_t *scratch, S *output);
+
+    contract_fn<float> contract;
+    contract_fn<float> contract_mixed;
+    contract_fn<double> contract_double;
+
+    // Divide every lane of `data`, `size` values per lane, by its maximum and
+    // add the log of the maximum to `log_scale`. Lanes with a maximum of 0
+    // are left unchanged and their `log_scale` becomes -inf.
+    void (*rescale)(float *data, std::size_t size, std::size_t lanes,
+        double *log_scale);
+    void (*rescale_double)(double *data, std::size_t size, std::size_t lanes,
+        double *log_scale);
+
+    // Decode rows of PLs into likelihoods using `table`; see PlDecoder::Decode.
+    // Likelihoods are mutk::float_t, which kernels.cpp checks is float; this
+    // header avoids message.hpp so the variants do not compile xtensor.
+    void (*decode_pl)(const std::int32_t *pl, int num_samples, int stride,
+        const int *columns, int hap_width, int dip_width,
+        const float *table, int table_size,
+        float *values, std::int8_t *encodings);
+};
+
+// The kernels in use. The best variant supported by the CPU is chosen on
+// first use, unless the environment variable MUTK_KERNELS names another one.
+const kernel_table_t & active();
+
+// Force a variant, e.g. for testing. Returns false if `name` is not
+// available on this CPU.
+bool select(const std::string &name);
+
+// Variants that can run on this CPU, from slowest to fastest
+std::vector<std::string> available();
+
+namespace detail {
+extern const kernel_table_t generic;
+#if MUTK_KERNELS_X86
+extern const kernel_table_t sse42;
+extern const kernel_table_t avx2;
+extern const kernel_table_t avx512;
+#endif
+} // namespace detail
+
+} // namespace mutk::kernels
+
+#endif // MUTK_KERNELS_HPP
@@ -0,0 +1,783 @@
+/*
+# Copyright (c) 2023 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+#include "unit_testing.hpp"
+#include "vcf_testing.hpp"
+
+#include <mutk/modelfit.hpp>
+#include <mutk/graph_builder.hpp>
+#include <mutk/peeler_cache.hpp>
+#include <mutk/pipeline.hpp>
+#include <mutk/pl_decoder.hpp>
+#include <mutk/potential.hpp>
+#include <mutk/reduction.hpp>
+#include <mutk/site_store.hpp>
+#include <mutk/vcf.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <boost/algorithm/string/predicate.hpp>
+
+using mutk::message_t;
+using mutk::message_size_t;
+using mutk::Ploidy;
+
+mutk::RelationshipGraph mutk::build_pedigree_graph(const Pedigree &pedigree,
+    const std::vector<std::string> &samples, float mu) {
+    auto has_tag = [](const Pedigree::Member &member, std::initializer_list<const char*> tags) {
+        return std::any_of(member.tags.begin(), member.tags.end(), [&](const std::string &a) {
+            return std::any_of(tags.begin(), tags.end(), [&](const char *tag) {
+                return boost::algorithm::iequals(a, tag);
+            });
+        });
+    };
+
+    GraphBuilder builder;
+    for(std::size_t i = 0; i < pedigree.NumberOfMembers(); ++i) {
+        const auto &member = pedigree.GetMember(i);
+        std::string sex = has_tag(member, {"haploid", "gamete", "p=1", "ploidy=1"}) ? "haploid" :
+            (member.sex == Pedigree::Sex::Male) ? "male" :
+            (member.sex == Pedigree::Sex::Female) ? "female" : "autosomal";
+        const bool founder = has_tag(member, {"founder"});
+        if(!founder && member.dad && member.mom) {
+            builder.AddTrio(member.name, sex, member.samples,
+                *member.dad, member.dad_length.value_or(1.0),
+                *member.mom, member.mom_length.value_or(1.0));
+        } else if(!founder && member.dad) {
+            builder.AddPair(member.name, sex, member.samples,
+                *member.dad, member.dad_length.value_or(1.0));
+        } else if(!founder && member.mom) {
+            builder.AddPair(member.name, sex, member.samples,
+                *member.mom, member.mom_length.value_or(1.0));
+        } else {
+            builder.AddSingle(member.name, sex, member.samples);
+        }
+    }
+    builder.SetSamples(samples);
+    return builder.BuildGraph(InheritanceModel{}, mu);
+}
+
+// ret(i,x) = P(x|i), the probability that a parent with genotype i passes
+// on allele x along a branch of length t
+static message_t transmission_matrix(const mutk::MutationModel &model, message_size_t n,
+    Ploidy ploidy, float t) {
+    const auto &mat = model.TransitionMatrix(n, t);
+    if(ploidy == Ploidy::Haploid) {
+        return mat;
+    }
+    auto ret = message_t::from_shape({mutk::num_diploids(n), n});
+    for(message_size_t i = 0; i < ret.shape(0); ++i) {
+        auto [a,b] = mutk::diploid_alleles(i);
+        for(message_size_t x = 0; x < n; ++x) {
+            ret(i,x) = 0.5f*(mat(a,x) + mat(b,x));
+        }
+    }
+    return ret;
+}
+
+mutk::model_potential_t mutk::create_model_potential(const MutationModel &model,
+    const GraphPeeler::model_component_t &component, message_size_t n) {
+    const auto &ploidies = component.ploidies;
+    const auto &lengths = component.edge_lengths;
+    switch(component.variables.size()) {
+    case 1:
+        return {(ploidies[0] == Ploidy::Haploid) ? model.CreatePriorHaploid(n) :
+            model.CreatePriorDiploid(n), std::nullopt};
+    case 2: {
+        // CloningPotential puts the parent on its first axis, and the
+        // component puts the child first. Gametes are haploid clones.
+        CloningPotential clone(model, lengths[1], std::vector<message_label_t>{
+            make_message_label(variable_t{0}, ploidies[1]),
+            make_message_label(variable_t{1}, ploidies[0])});
+        auto pot = clone.CreateModelPotential(n);
+        auto value = message_t::from_shape({pot.value.shape(1), pot.value.shape(0)});
+        for(message_size_t i = 0; i < pot.value.shape(0); ++i) {
+            for(message_size_t j = 0; j < pot.value.shape(1); ++j) {
+                value(j,i) = pot.value(i,j);
+            }
+        }
+        return {std::move(value), pot.kalleles};
+    }
+    case 3: {
+        // Each parent passes on one allele. Gametes have a length of 0 and
+        // pass on their allele unchanged.
+        if(ploidies[0] != Ploidy::Diploid) {
+            throw std::invalid_argument("a child with two parents must be diploid.");
+        }
+        auto a = transmission_matrix(model, n, ploidies[1], lengths[1]);
+        auto b = transmission_matrix(model, n, ploidies[2], lengths[2]);
+        auto value = message_t::from_shape({num_diploids(n), a.shape(0), b.shape(0)});
+        for(message_size_t c = 0; c < value.shape(0); ++c) {
+            auto [x,y] = diploid_alleles(c);
+            for(message_size_t i = 0; i < a.shape(0); ++i) {
+                for(message_size_t j = 0; j < b.shape(0); ++j) {
+                    float_t p = a(i,x)*b(j,y);
+                    if(x != y) {
+                        p += a(i,y)*b(j,x);
+                    }
+                    value(c,i,j) = p;
+                }
+            }
+        }
+        return {std::move(value), std::nullopt};
+    }
+    default:
+        break;
+    }
+    throw std::invalid_argument("a model component can not have more than two parents.");
+}
+
+namespace {
+
+// A family of the pedigree. Its samples are decoded from the columns of the
+// input through a gather map.
+struct family_t {
+    std::string label;
+    mutk::PeelerCache::entry_t entry;
+    std::vector<std::string> samples;
+    std::vector<int> columns;
+    // rows[i] are the samples of data vertex i of the peeler
+    std::vector<std::vector<int>> rows;
+};
+
+// Peels the sites of one family. Every worker owns one per family.
+class family_peeler_t {
+public:
+    family_peeler_t(const family_t &family, const mutk::MutationModel &model) :
+        family_{&family}, model_{&model}, work_{family.entry.peeler->CreateWorkspace()},
+        data_(family.rows.size()) {}
+
+    // Returns nothing if the site has too many alleles or the PLs can not
+    // be used
+    std::optional<double> operator()(int n_allele, const std::int32_t *pl, int n_pl,
+        int num_columns);
+
+private:
+    const family_t *family_;
+    const mutk::MutationModel *model_;
+    mutk::workspace_t work_;
+    mutk::PlDecoder decoder_;
+    std::vector<message_t> data_;
+    message_t buffer_;
+    message_size_t n_{0}; // the model potentials of work_ are for n_ alleles
+};
+
+std::optional<double> family_peeler_t::operator()(int n_allele, const std::int32_t *pl,
+    int n_pl, int num_columns) {
+    if(n_allele < 1 || n_allele > mutk::MODELFIT_MAX_ALLELES || n_pl <= 0) {
+        // PL tag is missing, or the site has more alleles than we support
+        return std::nullopt;
+    }
+    assert(n_pl % num_columns == 0);
+    const auto &peeler = *family_->entry.peeler;
+    const message_size_t n = n_allele;
+
+    // Convert PLs to normalized probabilities in a single pass. A vertex
+    // with several samples multiplies their likelihoods.
+    decoder_.Decode(pl, static_cast<int>(family_->samples.size()), n_pl / num_columns,
+        n_allele, family_->columns.data());
+    for(std::size_t i = 0; i < data_.size(); ++i) {
+        auto ploidy = peeler.ploidy(mutk::variable_t(peeler.data_vertices()[i]));
+        const auto &rows = family_->rows[i];
+        if(!decoder_.Extract(rows[0], ploidy, &data_[i])) {
+            // PL tag is not wide enough, we will skip the site
+            return std::nullopt;
+        }
+        for(std::size_t r = 1; r < rows.size(); ++r) {
+            if(!decoder_.Extract(rows[r], ploidy, &buffer_)) {
+                return std::nullopt;
+            }
+            std::transform(data_[i].begin(), data_[i].end(), buffer_.begin(),
+                data_[i].begin(), std::multiplies<>{});
+        }
+    }
+
+    // Model potentials only depend on the number of alleles
+    if(n != n_) {
+        peeler.SetModelPotentials(work_, n, [&](const auto &component, message_size_t m) {
+            return mutk::create_model_potential(*model_, component, m);
+        });
+        n_ = n;
+    }
+    peeler.SetDataPotentials(work_, n, data_);
+    return peeler.PeelForward(work_);
+}
+
+std::vector<const char*> c_strings(const std::vector<std::string> &strings) {
+    std::vector<const char*> ret;
+    for(auto &&str : strings) {
+        ret.push_back(str.c_str());
+    }
+    return ret;
+}
+
+} // anon namespace
+
+mutk::ModelFit::ModelFit(options_t options) : options_{std::move(options)} {
+    if(options_.threads <= 0) {
+        options_.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+double mutk::ModelFit::Run() {
+    const auto &args = options_;
+
+    // Every input and output shares one pool of compression threads. It is
+    // declared first so that it outlives them.
+    vcf::ThreadPool thread_pool{args.threads};
+
+    // A site store holds the PLs of the samples it was packed with
+    std::unique_ptr<SiteStore> store;
+    std::unique_ptr<vcf::Reader> reader;
+    std::vector<std::string> known_samples;
+    if(SiteStore::IsSiteStore(args.input)) {
+        store = std::make_unique<SiteStore>(args.input);
+        known_samples = store->sample_names();
+    } else {
+        reader = std::make_unique<vcf::Reader>(args.input);
+        auto samples = reader->samples();
+        known_samples.assign(samples.first, samples.first+samples.second);
+    }
+
+    auto pedigree = Pedigree::parse_file(args.ped);
+    std::vector<Pedigree> pedigrees;
+    if(args.split_families) {
+        pedigrees = pedigree.SplitFamilies();
+    } else {
+        pedigrees.push_back(std::move(pedigree));
+    }
+    if(store && pedigrees.size() != 1) {
+        throw std::invalid_argument("site stores hold a single family; use a VCF/BCF input with --split-families.");
+    }
+
+    MutationModel model(MODELFIT_MAX_ALLELES, args.theta,
+        args.ref_bias_hom, args.ref_bias_het, args.ref_bias_hap);
+
+    // Families with the same structure share a peeler. Workers hold
+    // references to families, so they must not move after this.
+    PeelerCache cache;
+    std::vector<family_t> families;
+    families.reserve(pedigrees.size());
+    for(auto &&ped : pedigrees) {
+        auto &family = families.emplace_back();
+        family.label = ped.GetMember(0).name;
+        family.entry = cache.Get(build_pedigree_graph(ped, known_samples, args.mu));
+        std::unordered_map<int, int> rows;
+        for(auto &&samples : family.entry.data_samples) {
+            auto &vertex_rows = family.rows.emplace_back();
+            for(auto s : samples) {
+                auto [it, added] = rows.try_emplace(+s, static_cast<int>(family.samples.size()));
+                if(added) {
+                    family.samples.push_back(known_samples[+s]);
+                }
+                vertex_rows.push_back(it->second);
+            }
+        }
+    }
+
+    if(store) {
+        // Peel the memory-mapped sites in parallel and write a sites-only table
+        auto &family = families[0];
+        auto store_samples = c_strings(known_samples);
+        vcf::SampleIndex store_index{store_samples.data(), static_cast<int>(store_samples.size())};
+        family.columns = store_index.GatherMap(family.samples);
+        const int num_columns = store->num_samples();
+
+        std::vector<std::optional<double>> results(store->num_sites());
+        auto make_worker = [&]() {
+            return std::make_pair(family_peeler_t{family, model}, std::vector<std::int32_t>{});
+        };
+        // Multi-allelic sites cost far more than biallelic ones, so chunks
+        // are sized by their estimated cost
+        auto cost = [&](std::size_t i) { return site_cost(store->site(i).n_allele); };
+        parallel_for(store->num_sites(), DEFAULT_CHUNK_COST, cost, args.threads,
+            make_worker, [&](auto &worker, std::size_t i) {
+            auto &[peel, pl] = worker;
+            int n_pl = store->GetPl(i, &pl);
+            results[i] = peel(store->site(i).n_allele, pl.data(), n_pl, num_columns);
+        });
+
+        std::ofstream file;
+        if(!args.output.empty()) {
+            file.open(args.output);
+            if(!file) {
+                throw std::runtime_error("unable to open output file: '" + args.output.string() + "'.");
+            }
+        }
+        std::ostream &out = args.output.empty() ? std::cout : file;
+        for(std::uint64_t i = 0; i < store->num_sites(); ++i) {
+            if(results[i]) {
+                auto site = store->site(i);
+                out << store->contig_names()[site.rid] << "\t" << site.pos+1
+                    << "\t" << static_cast<float>(*results[i]) << "\n";
+            }
+        }
+        return parallel_sum(results.size(), BlockSum::DEFAULT_BLOCK_SIZE, args.threads,
+            [&](std::size_t i) { return results[i] ? *results[i] : 0.0; });
+    }
+
+    // Decode only the samples used by a family
+    std::vector<std::string> used_samples;
+    {
+        std::unordered_set<std::string> seen;
+        for(auto &&family : families) {
+            for(auto &&name : family.samples) {
+                if(seen.insert(name).second) {
+                    used_samples.push_back(name);
+                }
+            }
+        }
+    }
+    auto used_names = c_strings(used_samples);
+    if(reader->SetSamples(used_names) != 0) {
+        throw std::runtime_error("unable to select the pedigree samples from the input.");
+    }
+    const int num_columns = reader->samples().second;
+    vcf::SampleIndex sample_index{reader->header()};
+    for(auto &&family : families) {
+        family.columns = sample_index.GatherMap(family.samples);
+    }
+
+    // Decompress with htslib's thread pool and peel sites in parallel
+    reader->SetThreadPool(thread_pool);
+
+    // Only FORMAT/PL is used, so leave INFO and the allele strings packed
+    reader->SetUnpack(vcf::unpack::FORMAT);
+
+    // One value per family
+    using site_result_t = std::vector<std::optional<double>>;
+
+    // PLs are extracted once per record and shared by every family
+    auto make_worker = [&]() {
+        std::vector<family_peeler_t> peelers;
+        for(auto &&family : families) {
+            peelers.emplace_back(family, model);
+        }
+        return [peelers = std::move(peelers), num_columns,
+            pl_buf = vcf::make_buffer<std::int32_t>(15*std::max(num_columns, 1))]
+            (const bcf_hdr_t *header, bcf1_t *record) mutable -> site_result_t {
+            site_result_t ret(peelers.size());
+            if(record->n_allele > MODELFIT_MAX_ALLELES) {
+                return ret;
+            }
+            int n_pl = vcf::get_format_int32(header, record, "PL", &pl_buf);
+            for(std::size_t f = 0; f < peelers.size(); ++f) {
+                ret[f] = peelers[f](record->n_allele, pl_buf.data.get(), n_pl, num_columns);
+            }
+            return ret;
+        };
+    };
+
+    // A checkpoint from an interrupted run holds the number of records it
+    // finished and the size of each output after them
+    std::optional<checkpoint_t> checkpoint;
+    if(!args.checkpoint.empty()) {
+        if(args.region_size > 0) {
+            throw std::invalid_argument("--checkpoint can not be used with --region-size.");
+        }
+        if(args.output.empty()) {
+            throw std::invalid_argument("--checkpoint requires --output.");
+        }
+        if(args.checkpoint_interval == 0) {
+            throw std::invalid_argument("--checkpoint-interval must be positive.");
+        }
+        checkpoint = load_checkpoint(args.checkpoint);
+        if(checkpoint && checkpoint->offsets.size() != families.size()) {
+            throw std::invalid_argument("checkpoint does not match the families of this run.");
+        }
+    }
+    if(!checkpoint) {
+        checkpoint.emplace();
+    }
+    const bool resume = !checkpoint->offsets.empty();
+
+    // Without --split-families, every record is annotated and written with
+    // its samples. Otherwise, each family gets a sites-only output named
+    // after its first member.
+    std::vector<std::unique_ptr<vcf::Writer>> writers;
+    auto sites_header = vcf::make_sites_header(reader->header());
+    for(auto &&family : families) {
+        std::filesystem::path path = args.output.empty() ? "-" : args.output;
+        const bcf_hdr_t *header = reader->header();
+        if(args.split_families) {
+            if(args.output.empty()) {
+                throw std::invalid_argument("--split-families requires --output.");
+            }
+            path = args.output.parent_path() / (family.label + "." + args.output.filename().string());
+            header = sites_header.get();
+        }
+        std::int64_t offset = resume ? checkpoint->offsets[writers.size()] : -1;
+        auto &writer = writers.emplace_back(
+            std::make_unique<vcf::Writer>(path, header, args.index, offset));
+        writer->SetThreadPool(thread_pool);
+        if(!resume) {
+            writer->AddHeaderLine(vcf::header_line::LL);
+        } else if(bcf_hdr_id2int(writer->header(), BCF_DT_ID, "LL") < 0) {
+            // a resumed output keeps the header of the interrupted run
+            throw std::invalid_argument("output to resume has no LL header line: '" + path.string() + "'.");
+        }
+    }
+
+    // Summed in fixed blocks, so the total does not depend on the number of
+    // threads or on whether the run was resumed
+    BlockSum total_ll;
+    if(resume) {
+        total_ll.SetState(checkpoint->sums.at("log_likelihood"));
+    }
+
+    std::unique_ptr<bcf1_t, vcf::detail::bcf_free_t> site{bcf_init()};
+    auto output = [&](const bcf_hdr_t *header, bcf1_t *record, const site_result_t &values) {
+        bcf1_t *out = record;
+        if(args.split_families) {
+            vcf::copy_site(header, record, site.get());
+            out = site.get();
+        }
+        for(std::size_t f = 0; f < writers.size(); ++f) {
+            auto &writer = *writers[f];
+            if(values[f]) {
+                float ll = static_cast<float>(*values[f]);
+                total_ll.Add(*values[f]);
+                vcf::update_info_float(writer.header(), out, "LL", &ll, 1);
+            } else {
+                total_ll.Add(0.0);
+                vcf::update_info_float(writer.header(), out, "LL", nullptr, 0);
+            }
+            writer.Write(out);
+        }
+
+        // Record the progress once every output holds this record
+        checkpoint->records += 1;
+        if(!args.checkpoint.empty() && checkpoint->records % args.checkpoint_interval == 0) {
+            checkpoint->contig = bcf_seqname_safe(header, record);
+            checkpoint->pos = record->pos;
+            checkpoint->offsets.clear();
+            for(auto &&writer : writers) {
+                checkpoint->offsets.push_back(writer->Flush());
+            }
+            checkpoint->sums["log_likelihood"] = total_ll.State();
+            save_checkpoint(args.checkpoint, *checkpoint);
+            if(args.on_checkpoint) {
+                args.on_checkpoint(*checkpoint);
+            }
+        }
+    };
+
+    if(args.region_size > 0) {
+        // Each worker reads its own regions from the index. Region readers
+        // decode `used_samples` just like `reader`, so their records have the
+        // columns of reader->header(), which the gather maps and the writers
+        // were built from.
+        RegionPipeline<site_result_t>::options_t options;
+        options.num_workers = args.threads;
+        options.records_per_region = args.region_size;
+        options.unpack = reader->unpack();
+        RegionPipeline<site_result_t> pipeline(options);
+        pipeline(args.input, used_names, make_worker, output);
+    } else {
+        SitePipeline<site_result_t>::options_t options;
+        options.num_workers = args.threads;
+        options.skip_records = resume ? checkpoint->records : 0;
+        SitePipeline<site_result_t> pipeline(options);
+        pipeline(*reader, make_worker, output);
+    }
+    for(auto &&writer : writers) {
+        writer->Close();
+    }
+    if(!args.checkpoint.empty()) {
+        // The run is complete, so a rerun starts over
+        std::filesystem::remove(args.checkpoint);
+    }
+    return total_ll.value();
+}
+
+// LCOV_EXCL_START
+TEST_CASE("create_model_potential() puts the child first") {
+    using mutk::GraphPeeler;
+    using mutk::variable_t;
+    using mutk::create_model_potential;
+
+    mutk::MutationModel model(3.0, 0.01, 0, 0, 0);
+    const message_size_t n = 3;
+    const float t = 0.1f;
+    const auto &mat = model.TransitionMatrix(n, t);
+
+    auto component = [](std::vector<Ploidy> ploidies, std::vector<float> lengths) {
+        GraphPeeler::model_component_t ret;
+        ret.kind = (ploidies.size() == 1) ? GraphPeeler::model_component_t::kind_t::Founder :
+            GraphPeeler::model_component_t::kind_t::Transition;
+        for(std::size_t i = 0; i < ploidies.size(); ++i) {
+            ret.variables.push_back(variable_t(static_cast<int>(i)));
+        }
+        ret.ploidies = ploidies;
+        ret.edge_lengths = lengths;
+        return ret;
+    };
+
+    auto prior = create_model_potential(model, component({Ploidy::Diploid}, {0.0f}), n);
+    auto expected_prior = model.CreatePriorDiploid(n);
+    REQUIRE(prior.value.size() == expected_prior.size());
+    for(message_size_t i = 0; i < prior.value.size(); ++i) {
+        CHECK(prior.value(i) == expected_prior(i));
+    }
+    CHECK_FALSE(prior.kalleles);
+
+    // A haploid parent of a diploid child passes on two copies of its allele
+    auto up = create_model_potential(model, component({Ploidy::Diploid, Ploidy::Haploid}, {0.0f, t}), n);
+    REQUIRE(up.value.shape(0) == mutk::num_diploids(n));
+    REQUIRE(up.value.shape(1) == n);
+    for(message_size_t c = 0; c < up.value.shape(0); ++c) {
+        auto [x,y] = mutk::diploid_alleles(c);
+        for(message_size_t i = 0; i < n; ++i) {
+            CHECK(up.value(c,i) == doctest::Approx((x == y) ? mat(i,x) : 0.0f));
+        }
+    }
+    CHECK_FALSE(up.kalleles);
+
+    // Clones of the same ploidy are tagged
+    auto clone = create_model_potential(model, component({Ploidy::Haploid, Ploidy::Haploid}, {0.0f, t}), n);
+    REQUIRE(clone.kalleles);
+    CHECK(clone.kalleles->a == model.TransitionOperator(t).a);
+    CHECK(clone.kalleles->b == model.TransitionOperator(t).b);
+    for(message_size_t x = 0; x < n; ++x) {
+        for(message_size_t i = 0; i < n; ++i) {
+            CHECK(clone.value(x,i) == doctest::Approx(mat(i,x)));
+        }
+    }
+
+    // Trio factors sum to 1 over the child
+    for(auto ploidy : {Ploidy::Diploid, Ploidy::Haploid}) {
+        auto trio = create_model_potential(model,
+            component({Ploidy::Diploid, Ploidy::Diploid, ploidy}, {0.0f, t, 2*t}), n);
+        REQUIRE(trio.value.dimension() == 3);
+        CHECK_FALSE(trio.kalleles);
+        for(message_size_t i = 0; i < trio.value.shape(1); ++i) {
+            for(message_size_t j = 0; j < trio.value.shape(2); ++j) {
+                double sum = 0.0;
+                for(message_size_t c = 0; c < trio.value.shape(0); ++c) {
+                    sum += trio.value(c,i,j);
+                }
+                CHECK(sum == doctest::Approx(1.0));
+            }
+        }
+    }
+
+    // Gametes join without mutation
+    auto zygote = create_model_potential(model,
+        component({Ploidy::Diploid, Ploidy::Haploid, Ploidy::Haploid}, {0.0f, 0.0f, 0.0f}), n);
+    for(message_size_t c = 0; c < zygote.value.shape(0); ++c) {
+        auto [x,y] = mutk::diploid_alleles(c);
+        for(message_size_t i = 0; i < n; ++i) {
+            for(message_size_t j = 0; j < n; ++j) {
+                bool match = (x == static_cast<int>(i) && y == static_cast<int>(j)) ||
+                    (x == static_cast<int>(j) && y == static_cast<int>(i));
+                CHECK(zygote.value(c,i,j) == doctest::Approx(match ? 1.0 : 0.0));
+            }
+        }
+    }
+
+    CHECK_THROWS_AS(create_model_potential(model,
+        component({Ploidy::Haploid, Ploidy::Diploid, Ploidy::Diploid}, {0.0f, t, t}), n),
+        std::invalid_argument);
+}
+
+TEST_CASE("ModelFit.Run peels each family") {
+    namespace fs = std::filesystem;
+
+    auto dir = fs::temp_directory_path();
+    auto vcf_path = dir / "mutk-modelfit-test.vcf";
+    auto ped_path = dir / "mutk-modelfit-test.ped";
+    auto out_path = dir / "mutk-modelfit-test.bcf";
+    const int num_records = 100;
+    write_test_vcf(vcf_path, num_records);
+    {
+        // two families: a trio and a haploid singleton
+        std::ofstream ped(ped_path);
+        ped << "##PEDNG v1.0\n"
+            << "F . . 1 .\n"
+            << "M . . 2 A\n"
+            << "K F M 1 B\n"
+            << "H@haploid . . 2 C\n";
+    }
+
+    // The LL of every record, or nothing if it has none
+    auto read_ll = [](const fs::path &path, int num_samples) {
+        mutk::vcf::Reader reader(path);
+        CHECK(reader.samples().second == num_samples);
+        reader.SetUnpack(mutk::vcf::unpack::ALL);
+        auto buffer = mutk::vcf::make_buffer<float>(1);
+        std::vector<std::optional<float>> ret;
+        reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+            int n = mutk::vcf::get_info_float(header, record, "LL", &buffer);
+            ret.push_back((n == 1) ? std::optional<float>{buffer.data[0]} : std::nullopt);
+        });
+        return ret;
+    };
+
+    mutk::ModelFit::options_t options;
+    options.mu = 1e-3;
+    options.theta = 0.01;
+    options.ped = ped_path;
+    options.input = vcf_path;
+    options.output = out_path;
+
+    // Records with 3 alleles have haploid PLs, which only H can use
+    double total = mutk::ModelFit(options).Run();
+    CHECK(std::isfinite(total));
+    auto whole = read_ll(out_path, 3);
+    REQUIRE(whole.size() == num_records);
+    for(int i = 0; i < num_records; ++i) {
+        CAPTURE(i);
+        CHECK(whole[i].has_value() == (i % 5 == 1));
+    }
+
+    // Each family gets a sites-only output named after its first member
+    options.split_families = true;
+    options.threads = 3;
+    double split_total = mutk::ModelFit(options).Run();
+    auto trio = read_ll(dir / ("F." + out_path.filename().string()), 0);
+    auto haploid = read_ll(dir / ("H." + out_path.filename().string()), 0);
+    REQUIRE(trio.size() == num_records);
+    REQUIRE(haploid.size() == num_records);
+    double expected_total = 0.0;
+    for(int i = 0; i < num_records; ++i) {
+        CAPTURE(i);
+        CHECK(trio[i].has_value() == (i % 5 == 1));
+        CHECK(haploid[i].has_value() == (i % 5 == 1 || i % 5 == 2));
+        if(whole[i]) {
+            CHECK(*whole[i] == doctest::Approx(*trio[i] + *haploid[i]).epsilon(1e-5));
+        }
+        expected_total += trio[i].value_or(0.0f) + haploid[i].value_or(0.0f);
+    }
+    CHECK(split_total == doctest::Approx(expected_total).epsilon(1e-5));
+
+    // The total does not depend on the number of threads
+    options.threads = 1;
+    CHECK(mutk::ModelFit(options).Run() == split_total);
+
+    for(auto &&path : {vcf_path, ped_path, out_path,
+        dir / ("F." + out_path.filename().string()), dir / ("H." + out_path.filename().string())}) {
+        fs::remove(path);
+    }
+}
+
+TEST_CASE("ModelFit.Run resumes from a checkpoint") {
+    namespace fs = std::filesystem;
+
+    auto dir = fs::temp_directory_path();
+    auto vcf_path = dir / "mutk-modelfit-resume-test.vcf";
+    auto ped_path = dir / "mutk-modelfit-resume-test.ped";
+    auto out_path = dir / "mutk-modelfit-resume-test.bcf";
+    auto ckpt_path = dir / "mutk-modelfit-resume-test.ckpt";
+    const int num_records = 100;
+    write_test_vcf(vcf_path, num_records);
+    {
+        std::ofstream ped(ped_path);
+        ped << "##PEDNG v1.0\n"
+            << "F . . 1 .\n"
+            << "M . . 2 A\n"
+            << "K F M 1 B\n"
+            << "H@haploid . . 2 C\n";
+    }
+
+    // The position and LL of every record of every output of a run
+    using site_ll_t = std::pair<hts_pos_t, std::optional<float>>;
+    auto read_outputs = [&](bool split) {
+        std::vector<fs::path> paths = {out_path};
+        if(split) {
+            paths = {dir / ("F." + out_path.filename().string()),
+                dir / ("H." + out_path.filename().string())};
+        }
+        std::vector<std::vector<site_ll_t>> ret;
+        for(auto &&path : paths) {
+            CHECK(fs::exists(path.string() + ".csi"));
+            mutk::vcf::Reader reader(path);
+            reader.SetUnpack(mutk::vcf::unpack::INFO);
+            auto buffer = mutk::vcf::make_buffer<float>(1);
+            auto &sites = ret.emplace_back();
+            reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+                int n = mutk::vcf::get_info_float(header, record, "LL", &buffer);
+                sites.emplace_back(record->pos,
+                    (n == 1) ? std::optional<float>{buffer.data[0]} : std::nullopt);
+            });
+        }
+        return ret;
+    };
+
+    struct interrupted_t {};
+
+    for(bool split : {false, true}) {
+        CAPTURE(split);
+        mutk::ModelFit::options_t options;
+        options.mu = 1e-3;
+        options.theta = 0.01;
+        options.ped = ped_path;
+        options.input = vcf_path;
+        options.output = out_path;
+        options.index = true;
+        options.split_families = split;
+        options.threads = 2;
+
+        double expected_total = mutk::ModelFit(options).Run();
+        auto expected = read_outputs(split);
+
+        // Interrupt the run after its third checkpoint
+        options.checkpoint = ckpt_path;
+        options.checkpoint_interval = 10;
+        options.on_checkpoint = [](const mutk::checkpoint_t &checkpoint) {
+            if(checkpoint.records == 30) {
+                throw interrupted_t{};
+            }
+        };
+        CHECK_THROWS_AS(mutk::ModelFit(options).Run(), interrupted_t);
+        REQUIRE(fs::exists(ckpt_path));
+
+        // The rerun starts after the last checkpoint
+        std::vector<std::uint64_t> saved;
+        options.on_checkpoint = [&](const mutk::checkpoint_t &checkpoint) {
+            saved.push_back(checkpoint.records);
+        };
+        double total = mutk::ModelFit(options).Run();
+        REQUIRE_FALSE(saved.empty());
+        CHECK(saved.front() == 40);
+        CHECK(saved.back() == 100);
+        CHECK_FALSE(fs::exists(ckpt_path));
+
+        CHECK(total == expected_total);
+        CHECK(read_outputs(split) == expected);
+    }
+
+    for(auto &&path : {vcf_path, ped_path, out_path,
+        dir / ("F." + out_path.filename().string()), dir / ("H." + out_path.filename().string())}) {
+        fs::remove(path);
+        fs::remove(path.string() + ".csi");
+    }
+}
+// LCOV_EXCL_STOP
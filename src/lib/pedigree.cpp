@@ -25,6 +25,8 @@
 
 #include <mutk/pedigree.hpp>
 
+#include <algorithm>
+
 namespace mutk {
 
 Pedigree Pedigree::parse_table(const std::vector<std::vector<std::string>> &table) {
@@ -137,6 +139,62 @@ Pedigree Pedigree::parse_table(const std::vector<std::vector<std::string>> &tabl
     return ret;
 }
 
+std::vector<Pedigree> Pedigree::SplitFamilies() const {
+    // union-find over members linked by parents
+    std::vector<std::size_t> root(table_.size());
+    for(std::size_t i = 0; i < root.size(); ++i) {
+        root[i] = i;
+    }
+    auto find = [&](std::size_t x) {
+        while(root[x] != x) {
+            root[x] = root[root[x]];
+            x = root[x];
+        }
+        return x;
+    };
+    auto join = [&](std::size_t a, const std::optional<std::string> &parent) {
+        if(!parent) {
+            return;
+        }
+        auto it = names_.find(*parent);
+        if(it == names_.end()) {
+            return;
+        }
+        std::size_t x = find(a), y = find(it->second);
+        // the smallest position becomes the root, so families keep the
+        // order of their first member
+        root[std::max(x, y)] = std::min(x, y);
+    };
+    for(std::size_t i = 0; i < table_.size(); ++i) {
+        join(i, table_[i].dad);
+        join(i, table_[i].mom);
+    }
+
+    std::vector<Pedigree> ret;
+    std::unordered_map<std::size_t, std::size_t> family_of_root;
+    for(std::size_t i = 0; i < table_.size(); ++i) {
+        auto [it, inserted] = family_of_root.emplace(find(i), ret.size());
+        if(inserted) {
+            ret.emplace_back();
+        }
+        ret[it->second].AddMember(table_[i]);
+    }
+    return ret;
+}
+
+std::vector<std::string> Pedigree::SampleNames() const {
+    std::vector<std::string> ret;
+    std::unordered_set<std::string> seen;
+    for(auto &&member : table_) {
+        for(auto &&sample : member.samples) {
+            if(seen.insert(sample).second) {
+                ret.push_back(sample);
+            }
+        }
+    }
+    return ret;
+}
+
 // LCOV_EXCL_START
 TEST_CASE("Pedigree-parse_sex") {
     CHECK(Pedigree::parse_sex(".") == Pedigree::Sex::Invalid);
@@ -258,4 +316,52 @@ TEST_CASE("Pedigree-parse_text") {
 }
 // LCOV_EXCL_STOP
 
+// LCOV_EXCL_START
+TEST_CASE("Pedigree-SplitFamilies") {
+    const char ped[] =
+        "##PEDNG v1.0\n"
+        "A . . 1 =\n"
+        "X . . 1 =\n"
+        "B . . 2 =\n"
+        "Y . . 2 =\n"
+        "Z X Y 1 =\n"
+        "C A B 1 =\n"
+        "S . . 2 =\n"
+        "D C Q 2 =\n"
+    ;
+    auto pedigree = Pedigree::parse_text(ped);
+    auto families = pedigree.SplitFamilies();
+
+    auto names = [](Pedigree &p) {
+        std::vector<std::string> ret;
+        for(auto &&m : p.table()) {
+            ret.push_back(m.name);
+        }
+        return ret;
+    };
+
+    REQUIRE(families.size() == 3);
+    CHECK(names(families[0]) == std::vector<std::string>{"A", "B", "C", "D"});
+    CHECK(names(families[1]) == std::vector<std::string>{"X", "Y", "Z"});
+    CHECK(names(families[2]) == std::vector<std::string>{"S"});
+    // links to unknown members are kept
+    CHECK(families[0].GetMember(3).mom == "Q");
+
+    CHECK(Pedigree{}.SplitFamilies().empty());
+}
+
+TEST_CASE("Pedigree-SampleNames") {
+    const char ped[] =
+        "##PEDNG v1.0\n"
+        "A . . 1 .\n"
+        "B . . 2 B1 B2\n"
+        "C A B 1 =\n"
+        "D A B 2 B2 D\n"
+    ;
+    auto pedigree = Pedigree::parse_text(ped);
+    CHECK(pedigree.SampleNames() == std::vector<std::string>{"B1", "B2", "C", "D"});
+    CHECK(Pedigree{}.SampleNames().empty());
+}
+// LCOV_EXCL_STOP
+
 } // namespace mutk
@@ -0,0 +1,225 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+#include "unit_testing.hpp"
+
+#include <mutk/peeler_cache.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#include <boost/functional/hash.hpp>
+
+using mutk::RelationshipGraph;
+using mutk::PeelerCache;
+using mutk::make_vertex_range;
+
+namespace {
+
+std::uint32_t length_bits(float f) {
+    std::uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+bool has_data(RelationshipGraph::vertex_descriptor v, const RelationshipGraph &graph) {
+    return !get(boost::vertex_data, graph, v).empty();
+}
+
+// Check that `map` (family vertex -> shared vertex) is an isomorphism
+bool is_isomorphism(const RelationshipGraph &a, const RelationshipGraph &b,
+    const std::vector<RelationshipGraph::vertex_descriptor> &map)
+{
+    if(num_vertices(a) != num_vertices(b) || num_edges(a) != num_edges(b)) {
+        return false;
+    }
+    for(auto v : make_vertex_range(a)) {
+        auto w = map[v];
+        if(get(boost::vertex_ploidy, a, v) != get(boost::vertex_ploidy, b, w)
+            || has_data(v, a) != has_data(w, b)
+            || in_degree(v, a) != in_degree(w, b)) {
+            return false;
+        }
+        for(auto e : boost::make_iterator_range(in_edges(v, a))) {
+            auto f = edge(map[source(e, a)], w, b);
+            if(!f.second || get(boost::edge_length, a, e) != get(boost::edge_length, b, f.first)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+// Weisfeiler-Lehman color refinement over the directed graph
+std::size_t mutk::canonical_graph_hash(const RelationshipGraph &graph,
+    std::vector<RelationshipGraph::vertex_descriptor> *order)
+{
+    const std::size_t n = num_vertices(graph);
+
+    std::vector<std::size_t> colors(n);
+    for(auto v : make_vertex_range(graph)) {
+        std::size_t h = 0;
+        boost::hash_combine(h, static_cast<int>(get(boost::vertex_ploidy, graph, v)));
+        boost::hash_combine(h, has_data(v, graph));
+        boost::hash_combine(h, in_degree(v, graph));
+        boost::hash_combine(h, out_degree(v, graph));
+        colors[v] = h;
+    }
+
+    auto count_colors = [](std::vector<std::size_t> c) {
+        std::sort(c.begin(), c.end());
+        return std::unique(c.begin(), c.end()) - c.begin();
+    };
+
+    auto num_colors = count_colors(colors);
+    std::vector<std::size_t> next(n);
+    std::vector<std::pair<std::size_t, std::uint32_t>> parents, children;
+    for(std::size_t round = 0; round < n; ++round) {
+        for(auto v : make_vertex_range(graph)) {
+            parents.clear();
+            for(auto e : boost::make_iterator_range(in_edges(v, graph))) {
+                parents.emplace_back(colors[source(e, graph)],
+                    length_bits(get(boost::edge_length, graph, e)));
+            }
+            children.clear();
+            for(auto e : boost::make_iterator_range(out_edges(v, graph))) {
+                children.emplace_back(colors[target(e, graph)],
+                    length_bits(get(boost::edge_length, graph, e)));
+            }
+            std::sort(parents.begin(), parents.end());
+            std::sort(children.begin(), children.end());
+            std::size_t h = colors[v];
+            boost::hash_combine(h, parents);
+            boost::hash_combine(h, children);
+            next[v] = h;
+        }
+        colors.swap(next);
+        auto m = count_colors(colors);
+        if(m == num_colors) {
+            break;
+        }
+        num_colors = m;
+    }
+
+    if(order != nullptr) {
+        order->resize(n);
+        std::iota(order->begin(), order->end(), 0);
+        std::stable_sort(order->begin(), order->end(), [&](auto a, auto b) {
+            return colors[a] < colors[b];
+        });
+    }
+
+    std::sort(colors.begin(), colors.end());
+    std::size_t h = 0;
+    boost::hash_combine(h, colors);
+    boost::hash_combine(h, num_edges(graph));
+    return h;
+}
+
+PeelerCache::entry_t PeelerCache::Get(const RelationshipGraph &graph) {
+    std::vector<vertex_t> order;
+    const std::size_t key = canonical_graph_hash(graph, &order);
+
+    entry_t entry;
+    entry.vertex_map.resize(num_vertices(graph));
+
+    auto & bucket = buckets_[key];
+    const shared_t *match = nullptr;
+    for(auto && shared : bucket) {
+        for(std::size_t i = 0; i < order.size(); ++i) {
+            entry.vertex_map[order[i]] = shared.canonical_order[i];
+        }
+        if(is_isomorphism(graph, shared.peeler->graph(), entry.vertex_map)) {
+            match = &shared;
+            break;
+        }
+    }
+    if(match == nullptr) {
+        auto peeler = std::make_shared<GraphPeeler>(GraphPeeler::Create(graph, split_gametes_));
+        match = &bucket.emplace_back(shared_t{std::move(peeler), order});
+        std::iota(entry.vertex_map.begin(), entry.vertex_map.end(), 0);
+        num_peelers_ += 1;
+    }
+    entry.peeler = match->peeler;
+
+    // Attach the samples of this family to the shared data vertices
+    const auto & data_vertices = entry.peeler->data_vertices();
+    std::vector<vertex_t> inverse(entry.vertex_map.size());
+    for(std::size_t v = 0; v < entry.vertex_map.size(); ++v) {
+        inverse[entry.vertex_map[v]] = v;
+    }
+    for(auto w : data_vertices) {
+        entry.data_samples.push_back(get(boost::vertex_data, graph, inverse[w]));
+    }
+
+    return entry;
+}
+
+// LCOV_EXCL_START
+TEST_CASE("PeelerCache shares isomorphic families") {
+    using mutk::Ploidy;
+    using mutk::sample_id_t;
+
+    auto make_trio = [](int mom, int dad, int child, float length) {
+        RelationshipGraph graph(3);
+        add_edge(mom, child, length, graph);
+        add_edge(dad, child, length, graph);
+        for(auto v : make_vertex_range(graph)) {
+            put(boost::vertex_ploidy, graph, v, Ploidy::Diploid);
+        }
+        put(boost::vertex_data, graph, mom, std::vector<sample_id_t>{sample_id_t{10+mom}});
+        put(boost::vertex_data, graph, child, std::vector<sample_id_t>{sample_id_t{10+child}});
+        return graph;
+    };
+
+    auto a = make_trio(0, 1, 2, 1.0f);
+    auto b = make_trio(2, 0, 1, 1.0f);
+    auto c = make_trio(0, 1, 2, 2.0f);
+
+    CHECK(mutk::canonical_graph_hash(a) == mutk::canonical_graph_hash(b));
+    CHECK(mutk::canonical_graph_hash(a) != mutk::canonical_graph_hash(c));
+
+    PeelerCache cache;
+    auto ea = cache.Get(a);
+    auto eb = cache.Get(b);
+    auto ec = cache.Get(c);
+
+    CHECK(cache.size() == 2);
+    CHECK(ea.peeler == eb.peeler);
+    CHECK(ea.peeler != ec.peeler);
+
+    // b's mom (2) and child (1) map onto a's mom (0) and child (2)
+    CHECK(eb.vertex_map[2] == 0);
+    CHECK(eb.vertex_map[1] == 2);
+    CHECK(eb.vertex_map[0] == 1);
+
+    REQUIRE(ea.peeler->data_vertices().size() == 2);
+    CHECK(ea.data_samples == std::vector<std::vector<sample_id_t>>{
+        {sample_id_t{10}}, {sample_id_t{12}}});
+    CHECK(eb.data_samples == std::vector<std::vector<sample_id_t>>{
+        {sample_id_t{12}}, {sample_id_t{11}}});
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,601 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include "unit_testing.hpp"
+#include "vcf_testing.hpp"
+
+#include <mutk/pipeline.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// LCOV_EXCL_START
+TEST_CASE("split_by_cost") {
+    using mutk::detail::split_by_cost;
+    using bounds_t = std::vector<std::size_t>;
+    auto unit = [](std::size_t) { return 1.0; };
+
+    CHECK(split_by_cost(0, 4.0, unit) == bounds_t{0});
+    CHECK(split_by_cost(3, 4.0, unit) == bounds_t{0, 3});
+    CHECK(split_by_cost(8, 4.0, unit) == bounds_t{0, 4, 8});
+    // The last chunk may cost less than chunk_cost
+    CHECK(split_by_cost(10, 4.0, unit) == bounds_t{0, 4, 8, 10});
+    // Every item is its own chunk when chunk_cost is 0
+    CHECK(split_by_cost(3, 0.0, unit) == bounds_t{0, 1, 2, 3});
+
+    // An expensive item ends its chunk
+    std::vector<double> costs = {1, 1, 10, 1, 1, 1, 1, 1};
+    auto cost = [&](std::size_t i) { return costs[i]; };
+    CHECK(split_by_cost(costs.size(), 4.0, cost) == bounds_t{0, 3, 7, 8});
+
+    // Multi-allelic sites get smaller chunks than biallelic ones
+    auto sites = split_by_cost(64, mutk::DEFAULT_CHUNK_COST,
+        [](std::size_t i) { return mutk::site_cost(i < 32 ? 2 : 5); });
+    CHECK(sites == bounds_t{0, 32, 34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62, 64});
+}
+
+TEST_CASE("StealingQueue") {
+    using mutk::detail::StealingQueue;
+
+    SUBCASE("a worker takes from the front of its queue and steals from the back") {
+        StealingQueue<int> queue{3};
+        CHECK(queue.num_workers() == 3);
+        for(int i = 0; i < 4; ++i) {
+            queue.Push(0, i);
+        }
+        queue.Push(2, 10);
+        queue.Close();
+        CHECK(queue.Pop(0) == 0);
+        // Worker 1 has nothing of its own and steals from worker 2 first
+        CHECK(queue.Pop(1) == 10);
+        CHECK(queue.Pop(1) == 3);
+        CHECK(queue.Pop(2) == 2);
+        CHECK(queue.Pop(0) == 1);
+        CHECK_FALSE(queue.Pop(0).has_value());
+        CHECK_FALSE(queue.Pop(1).has_value());
+    }
+    SUBCASE("Pop waits for a task or for Close") {
+        StealingQueue<int> queue{2};
+        std::optional<int> first, second;
+        std::thread consumer([&]() {
+            first = queue.Pop(1);
+            second = queue.Pop(1);
+        });
+        queue.Push(0, 7);
+        queue.Close();
+        consumer.join();
+        CHECK(first == 7);
+        CHECK_FALSE(second.has_value());
+    }
+    SUBCASE("every task is taken once by concurrent workers") {
+        const int num_workers = 4;
+        const int num_producers = 3;
+        const int num_tasks = 20000;
+        StealingQueue<int> queue{num_workers};
+        std::vector<std::vector<int>> taken(num_workers);
+        std::vector<std::thread> threads;
+        for(int w = 0; w < num_workers; ++w) {
+            threads.emplace_back([&, w]() {
+                while(auto task = queue.Pop(w)) {
+                    taken[w].push_back(*task);
+                }
+            });
+        }
+        // Tasks are pushed while workers are taking them, so that Take races
+        // with Push
+        std::vector<std::thread> producers;
+        for(int p = 0; p < num_producers; ++p) {
+            producers.emplace_back([&, p]() {
+                for(int i = p; i < num_tasks; i += num_producers) {
+                    queue.Push(i % num_workers, i);
+                }
+            });
+        }
+        for(auto &&t : producers) {
+            t.join();
+        }
+        queue.Close();
+        for(auto &&t : threads) {
+            t.join();
+        }
+        std::vector<int> all;
+        for(auto &&v : taken) {
+            all.insert(all.end(), v.begin(), v.end());
+        }
+        std::sort(all.begin(), all.end());
+        std::vector<int> expected(num_tasks);
+        for(int i = 0; i < num_tasks; ++i) {
+            expected[i] = i;
+        }
+        CHECK(all == expected);
+    }
+}
+
+TEST_CASE("CostExecutor") {
+    using executor_t = mutk::CostExecutor<int>;
+
+    SUBCASE("every item of every task is run once") {
+        // Tasks are submitted while the workers run them. Items of task 1
+        // are expensive, like a batch of multi-allelic sites.
+        const int num_tasks = 20;
+        const std::size_t n = 100;
+        auto cost = [](int task) {
+            return [task](std::size_t) { return (task == 1) ? 25.0 : 1.0; };
+        };
+        for(int num_workers : {1, 3, 8}) {
+            CAPTURE(num_workers);
+            std::vector<std::atomic<int>> visits(num_tasks*n);
+            std::atomic<int> num_made{0};
+            std::atomic<int> num_exits{0};
+            executor_t executor{{num_workers, 16.0}};
+            CHECK(executor.options().num_workers == num_workers);
+            executor.Start([&]() { return num_made++; },
+                [&](int worker, int task, std::size_t first, std::size_t last) {
+                CHECK(worker < num_workers);
+                CHECK(first < last);
+                CHECK(last <= n);
+                for(std::size_t i = first; i < last; ++i) {
+                    visits[task*n + i] += 1;
+                }
+            }, [&](std::exception_ptr e) {
+                CHECK_FALSE(e);
+                num_exits += 1;
+            });
+            CHECK(num_made == num_workers);
+            for(int task = 0; task < num_tasks; ++task) {
+                std::size_t num_chunks = executor.Submit(task, n, cost(task));
+                CHECK(num_chunks == ((task == 1) ? 100 : 7));
+            }
+            executor.Close();
+            CHECK_FALSE(executor.Join());
+            CHECK(num_exits == 1);
+            CHECK(std::all_of(visits.begin(), visits.end(), [](auto &v) { return v == 1; }));
+        }
+    }
+    SUBCASE("Join returns the first exception") {
+        std::exception_ptr on_exit;
+        executor_t executor{{3, 1.0}};
+        executor.Submit(0, 1000, [](std::size_t) { return 1.0; });
+        executor.Start([]() { return 0; },
+            [&](int, int, std::size_t first, std::size_t) {
+            if(first == 10) {
+                throw std::runtime_error("body failed");
+            }
+        }, [&](std::exception_ptr e) { on_exit = e; });
+        // Stopping does not wait for Close
+        auto error = executor.Join();
+        REQUIRE(error);
+        CHECK(error == on_exit);
+        CHECK_THROWS_AS(std::rethrow_exception(error), std::runtime_error);
+    }
+    SUBCASE("a destroyed executor stops its workers") {
+        executor_t executor{{2, 1.0}};
+        executor.Start([]() { return 0; }, [](int, int, std::size_t, std::size_t) {});
+        executor.Submit(0, 10, [](std::size_t) { return 1.0; });
+    }
+}
+
+TEST_CASE("ReorderBuffer") {
+    using mutk::detail::ReorderBuffer;
+
+    SUBCASE("Pop returns items in sequence order") {
+        ReorderBuffer<char> buffer{3};
+        CHECK(buffer.Push(2, 'c'));
+        CHECK(buffer.Push(0, 'a'));
+        CHECK(buffer.Push(1, 'b'));
+        CHECK(buffer.Pop() == 'a');
+        CHECK(buffer.Pop() == 'b');
+        CHECK(buffer.Push(4, 'e'));
+        CHECK(buffer.Push(3, 'd'));
+        CHECK(buffer.Pop() == 'c');
+        CHECK(buffer.Pop() == 'd');
+        CHECK(buffer.Pop() == 'e');
+    }
+    SUBCASE("more items than slots arrive out of order") {
+        const std::size_t capacity = 3;
+        const std::size_t num_items = 64;
+        ReorderBuffer<std::size_t> buffer{capacity};
+        // Every producer pushes pairs of items in reverse, and most pushes are
+        // too far ahead of the next item and have to wait for a slot
+        const std::size_t num_producers = 4;
+        std::vector<std::thread> producers;
+        for(std::size_t p = 0; p < num_producers; ++p) {
+            producers.emplace_back([&, p]() {
+                for(std::size_t base = 2*p; base < num_items; base += 2*num_producers) {
+                    buffer.Push(base+1, base+1);
+                    buffer.Push(base, base);
+                }
+            });
+        }
+        std::vector<std::size_t> popped;
+        for(std::size_t i = 0; i < num_items; ++i) {
+            auto item = buffer.Pop();
+            REQUIRE(item.has_value());
+            popped.push_back(*item);
+        }
+        for(auto &&t : producers) {
+            t.join();
+        }
+        std::vector<std::size_t> expected(num_items);
+        for(std::size_t i = 0; i < num_items; ++i) {
+            expected[i] = i;
+        }
+        CHECK(popped == expected);
+    }
+    SUBCASE("Close wakes a blocked Push") {
+        ReorderBuffer<int> buffer{2};
+        CHECK(buffer.Push(0, 0));
+        std::atomic<bool> pushed{true};
+        // Item 2 needs the slot of item 0, which has not been popped
+        std::thread producer([&]() { pushed = buffer.Push(2, 2); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        buffer.Close();
+        producer.join();
+        CHECK_FALSE(pushed);
+        CHECK_FALSE(buffer.Push(1, 1));
+        // Items that are already in order are still returned
+        CHECK(buffer.Pop() == 0);
+        CHECK_FALSE(buffer.Pop().has_value());
+    }
+    SUBCASE("Close wakes a blocked Pop") {
+        ReorderBuffer<int> buffer{2};
+        CHECK(buffer.Push(1, 1));
+        std::optional<int> item{-1};
+        std::thread consumer([&]() { item = buffer.Pop(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        buffer.Close();
+        consumer.join();
+        CHECK_FALSE(item.has_value());
+    }
+}
+
+TEST_CASE("SitePipeline") {
+    auto path = std::filesystem::temp_directory_path() / "mutk-site-pipeline-test.vcf";
+    const int num_records = 1000;
+    write_test_vcf(path, num_records);
+
+    struct result_t {
+        hts_pos_t pos;
+        int n_allele;
+        int pl;
+    };
+
+    for(int num_workers : {1, 2, 4}) {
+        CAPTURE(num_workers);
+        typename mutk::SitePipeline<result_t>::options_t options;
+        options.num_workers = num_workers;
+        options.batch_size = 7;
+        options.max_batches = 3;
+        mutk::SitePipeline<result_t> pipeline(options);
+
+        mutk::vcf::Reader reader(path);
+        reader.SetUnpack(mutk::vcf::unpack::FORMAT);
+        // Each worker owns its own buffer
+        auto make_worker = []() {
+            return [buffer = mutk::vcf::make_buffer<int>(6)](const bcf_hdr_t *header,
+                bcf1_t *record) mutable {
+                int n = mutk::vcf::get_format_int32(header, record, "PL", &buffer);
+                return result_t{record->pos, static_cast<int>(record->n_allele),
+                    (n > 0) ? buffer.data[0] : -1};
+            };
+        };
+        std::vector<result_t> results;
+        std::vector<hts_pos_t> positions;
+        pipeline(reader, make_worker, [&](const bcf_hdr_t *, bcf1_t *record, result_t &result) {
+            positions.push_back(record->pos);
+            results.push_back(result);
+        });
+
+        std::vector<hts_pos_t> result_positions;
+        std::vector<int> alleles, pls, expected_alleles, expected_pls;
+        std::vector<hts_pos_t> expected_positions;
+        for(int i = 0; i < num_records; ++i) {
+            expected_positions.push_back(10*(i+1)-1);
+            expected_alleles.push_back(1 + i % 5);
+            expected_pls.push_back(i);
+        }
+        for(auto &&result : results) {
+            result_positions.push_back(result.pos);
+            alleles.push_back(result.n_allele);
+            pls.push_back(result.pl);
+        }
+        CHECK(positions == expected_positions);
+        CHECK(result_positions == expected_positions);
+        CHECK(alleles == expected_alleles);
+        CHECK(pls == expected_pls);
+    }
+
+    // An exception thrown by a worker is rethrown on the calling thread
+    mutk::SitePipeline<int>::options_t options;
+    options.num_workers = 3;
+    options.batch_size = 4;
+    mutk::SitePipeline<int> pipeline(options);
+    mutk::vcf::Reader reader(path);
+    auto make_worker = []() {
+        return [](const bcf_hdr_t *, bcf1_t *record) -> int {
+            if(record->pos == 10*500-1) {
+                throw std::runtime_error("worker failed");
+            }
+            return 0;
+        };
+    };
+    CHECK_THROWS_AS(pipeline(reader, make_worker, [](const bcf_hdr_t *, bcf1_t *, int &) {}),
+        std::runtime_error);
+
+    // Nothing is output after a worker fails, even records that were
+    // finished before it
+    {
+        mutk::SitePipeline<int>::options_t options;
+        options.num_workers = 2;
+        options.batch_size = 4;
+        mutk::SitePipeline<int> pipeline(options);
+        mutk::vcf::Reader reader(path);
+        std::atomic<int> num_output{0};
+        std::atomic<bool> thrown{false};
+        auto make_worker = [&]() {
+            return [&](const bcf_hdr_t *, bcf1_t *record) -> int {
+                // The second batch fails while the first one is output
+                if(record->pos == 10*5-1) {
+                    while(num_output == 0) {
+                        std::this_thread::yield();
+                    }
+                    thrown = true;
+                    throw std::runtime_error("worker failed");
+                }
+                return 0;
+            };
+        };
+        CHECK_THROWS_AS(pipeline(reader, make_worker, [&](const bcf_hdr_t *, bcf1_t *, int &) {
+            num_output += 1;
+            while(!thrown) {
+                std::this_thread::yield();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }), std::runtime_error);
+        CHECK(num_output == 1);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("SitePipeline output does not depend on the number of workers") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto input = dir / "mutk-site-pipeline-order-test.vcf";
+    write_test_vcf(input, 500);
+
+    auto run = [&](int num_workers) {
+        auto output = dir / ("mutk-site-pipeline-order-test-" + std::to_string(num_workers) + ".vcf");
+        mutk::SitePipeline<float>::options_t options;
+        options.num_workers = num_workers;
+        options.batch_size = 5;
+        options.max_batches = 2*num_workers;
+        // Small chunks, so every batch is split between workers
+        options.chunk_cost = mutk::site_cost(2);
+        mutk::SitePipeline<float> pipeline(options);
+
+        mutk::vcf::Reader reader(input);
+        reader.SetUnpack(mutk::vcf::unpack::FORMAT);
+        mutk::vcf::Writer writer(output, reader.header());
+        writer.AddHeaderLine(mutk::vcf::header_line::LL);
+        auto make_worker = []() {
+            return [buffer = mutk::vcf::make_buffer<int>(9)](const bcf_hdr_t *header,
+                bcf1_t *record) mutable {
+                int n = mutk::vcf::get_format_int32(header, record, "PL", &buffer);
+                float value = 0.0f;
+                for(int i = 0; i < n; ++i) {
+                    value += buffer.data[i]/(1.0f + i);
+                }
+                return value;
+            };
+        };
+        pipeline(reader, make_worker, [&](const bcf_hdr_t *, bcf1_t *record, float &value) {
+            mutk::vcf::update_info_float(writer.header(), record, "LL", &value, 1);
+            writer.Write(record);
+        });
+        writer.Close();
+
+        std::ifstream in(output, std::ios::binary);
+        std::string bytes{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+        in.close();
+        std::filesystem::remove(output);
+        return bytes;
+    };
+
+    const std::string expected = run(1);
+    CHECK(expected.find("LL=") != std::string::npos);
+    for(int num_workers : {2, 3, 8}) {
+        CAPTURE(num_workers);
+        CHECK(run(num_workers) == expected);
+    }
+
+    std::filesystem::remove(input);
+}
+
+TEST_CASE("RegionPipeline") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-region-pipeline-test.vcf";
+    auto bcf_path = dir / "mutk-region-pipeline-test.bcf";
+    const int num_records = 300;
+    write_test_vcf(vcf_path, num_records);
+    write_indexed_bcf(vcf_path, bcf_path);
+
+    std::vector<hts_pos_t> expected_positions;
+    std::vector<int> expected_pls;
+    for(int i = 0; i < num_records; ++i) {
+        expected_positions.push_back(10*(i+1)-1);
+        expected_pls.push_back(1);
+    }
+
+    // Only sample C is decoded, so the first PL of every record is 1
+    std::vector<const char*> samples = {"C"};
+    for(int num_workers : {1, 3}) {
+        CAPTURE(num_workers);
+        mutk::RegionPipeline<int>::options_t options;
+        options.num_workers = num_workers;
+        options.records_per_region = 11;
+        options.max_pending = num_workers;
+        // Regions are streamed in several batches
+        options.batch_size = 3;
+        options.max_batches = 2;
+        options.unpack = mutk::vcf::unpack::FORMAT;
+        mutk::RegionPipeline<int> pipeline(options);
+
+        auto make_worker = []() {
+            return [buffer = mutk::vcf::make_buffer<int>(3)](const bcf_hdr_t *header,
+                bcf1_t *record) mutable {
+                int n = mutk::vcf::get_format_int32(header, record, "PL", &buffer);
+                return (n == 3) ? buffer.data[0] : -1;
+            };
+        };
+        std::vector<hts_pos_t> positions;
+        std::vector<int> pls;
+        pipeline(bcf_path, samples, make_worker,
+            [&](const bcf_hdr_t *header, bcf1_t *record, int &result) {
+            CHECK(bcf_hdr_nsamples(header) == 1);
+            positions.push_back(record->pos);
+            pls.push_back(result);
+        });
+        CHECK(positions == expected_positions);
+        CHECK(pls == expected_pls);
+    }
+
+    // Records are held in batches, not whole regions, until they are output
+    {
+        mutk::RegionPipeline<int>::options_t options;
+        options.num_workers = 3;
+        options.records_per_region = num_records;
+        options.max_pending = 3;
+        options.batch_size = 4;
+        options.max_batches = 2;
+        mutk::RegionPipeline<int> pipeline(options);
+        const int max_held = options.max_pending*options.max_batches*options.batch_size;
+
+        std::atomic<int> num_worked{0}, num_output{0}, most_held{0};
+        auto make_worker = [&]() {
+            return [&](const bcf_hdr_t *, bcf1_t *) {
+                int held = ++num_worked - num_output;
+                int most = most_held;
+                while(held > most && !most_held.compare_exchange_weak(most, held)) {
+                }
+                return 0;
+            };
+        };
+        pipeline(bcf_path, {}, make_worker, [&](const bcf_hdr_t *, bcf1_t *, int &) {
+            // A slow output lets the workers get as far ahead as they can
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            num_output += 1;
+        });
+        CHECK(num_output == num_records);
+        CHECK(most_held <= max_held);
+    }
+
+    mutk::RegionPipeline<int>::options_t options;
+    options.num_workers = 2;
+    options.records_per_region = 11;
+    mutk::RegionPipeline<int> pipeline(options);
+    auto make_worker = []() {
+        return [](const bcf_hdr_t *, bcf1_t *record) -> int {
+            if(record->pos == 10*150-1) {
+                throw std::runtime_error("worker failed");
+            }
+            return 0;
+        };
+    };
+    CHECK_THROWS_AS(pipeline(bcf_path, {}, make_worker,
+        [](const bcf_hdr_t *, bcf1_t *, int &) {}), std::runtime_error);
+
+    std::filesystem::remove(vcf_path);
+    std::filesystem::remove(bcf_path);
+    std::filesystem::remove(bcf_path.string() + ".csi");
+}
+
+TEST_CASE("parallel_for") {
+    // A few expensive indexes at the start, like a cluster of multi-allelic
+    // sites
+    const std::size_t n = 1000;
+    auto cost = [](std::size_t i) { return (i < 50) ? 25.0 : 1.0; };
+    for(int num_workers : {1, 2, 5}) {
+        CAPTURE(num_workers);
+        std::vector<int> visits(n, 0);
+        std::atomic<int> num_made{0};
+        mutk::parallel_for(n, 16.0, cost, num_workers,
+            [&]() { return num_made++; },
+            [&](int worker, std::size_t i) {
+            CHECK(worker < num_workers);
+            visits[i] += 1;
+        });
+        CHECK(num_made == num_workers);
+        CHECK(std::count(visits.begin(), visits.end(), 1) == static_cast<long>(n));
+    }
+
+    std::vector<int> visits(10, 0);
+    mutk::parallel_for(visits.size(), 3, 4, []() { return 0; },
+        [&](int, std::size_t i) { visits[i] += 1; });
+    CHECK(visits == std::vector<int>(10, 1));
+
+    // The first exception is rethrown on the calling thread
+    CHECK_THROWS_AS(mutk::parallel_for(n, 1, 3, []() { return 0; },
+        [](int, std::size_t i) {
+        if(i == 500) {
+            throw std::runtime_error("body failed");
+        }
+    }), std::runtime_error);
+    // Nothing to do
+    mutk::parallel_for(0, 1, 3, []() { return 0; }, [](int, std::size_t) {
+        FAIL("body called for an empty range");
+    });
+}
+
+TEST_CASE("parallel_sum") {
+    // Values of very different magnitudes, so that the order of additions
+    // changes the rounding
+    const std::size_t n = 10007;
+    auto f = [](std::size_t i) {
+        return (i % 3 == 0) ? 1e10/(i+1) : ((i % 3 == 1) ? -1e-6*i : 0.1);
+    };
+    const std::size_t block_size = 64;
+
+    mutk::BlockSum serial(block_size);
+    for(std::size_t i = 0; i < n; ++i) {
+        serial.Add(f(i));
+    }
+    // The block at the end is partial, so it is passed to AddBlock as is
+    const double expected = serial.value();
+
+    for(int num_workers : {1, 2, 3, 8}) {
+        CAPTURE(num_workers);
+        CHECK(mutk::parallel_sum(n, block_size, num_workers, f) == expected);
+    }
+    CHECK(mutk::parallel_sum(0, block_size, 4, f) == 0.0);
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,238 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+#include "unit_testing.hpp"
+
+#include <mutk/pl_decoder.hpp>
+#include <mutk/utility.hpp>
+
+#include "kernels.hpp"
+
+#include <algorithm>
+
+#include <htslib/vcf.h>
+
+using mutk::PlDecoder;
+using mutk::PlEncoding;
+using mutk::Ploidy;
+
+const std::array<mutk::float_t, PlDecoder::TABLE_SIZE> & PlDecoder::table() {
+    static const auto values = []() {
+        std::array<float_t, TABLE_SIZE> ret;
+        for(int i = 0; i < TABLE_SIZE-1; ++i) {
+            ret[i] = utility::unphredf(i);
+        }
+        // Out-of-range values, including htslib's sentinels, end up here.
+        ret[TABLE_SIZE-1] = 0.0f;
+        return ret;
+    }();
+    return values;
+}
+
+void PlDecoder::Decode(const std::int32_t *pl, int num_samples, int stride, int num_alleles,
+    const int *columns) {
+    assert(num_alleles > 0);
+    assert(stride > 0 || num_samples == 0);
+
+    num_samples_ = num_samples;
+    num_alleles_ = num_alleles;
+    width_ = num_diploids(num_alleles);
+
+    values_.resize(num_samples*width_);
+    encodings_.resize(num_samples);
+
+    // PlEncoding is an int8_t, so its storage can be written directly
+    static_assert(sizeof(PlEncoding) == sizeof(std::int8_t));
+    mutk::kernels::active().decode_pl(pl, num_samples, stride, columns,
+        num_haploids(num_alleles), width_, table().data(), TABLE_SIZE,
+        values_.data(), reinterpret_cast<std::int8_t *>(encodings_.data()));
+}
+
+bool PlDecoder::Extract(int sample, Ploidy ploidy, message_t *msg) const {
+    assert(msg != nullptr);
+    assert(ploidy == Ploidy::Haploid || ploidy == Ploidy::Diploid);
+
+    const PlEncoding enc = encodings_[sample];
+    if(enc == PlEncoding::Invalid ||
+        (ploidy == Ploidy::Diploid && enc == PlEncoding::Haploid)) {
+        // PL tag is not wide enough
+        return false;
+    }
+
+    const float_t *in = row(sample);
+    const message_size_t sz = message_axis_size(num_alleles_, ploidy);
+    *msg = message_t::from_shape({sz});
+
+    if(enc == PlEncoding::Missing) {
+        msg->fill(1.0f);
+    } else if(ploidy == Ploidy::Haploid && enc == PlEncoding::Diploid) {
+        // haploid PLs are encoded as homozygous diploids
+        message_size_t m = 0;
+        for(message_size_t k = 0; k < sz; ++k) {
+            (*msg)(k) = in[m];
+            m += k+2;
+        }
+    } else {
+        std::copy(in, in+sz, msg->begin());
+    }
+    return true;
+}
+
+// LCOV_EXCL_START
+TEST_CASE("PlDecoder.Decode") {
+    using mutk::utility::unphredf;
+
+    const std::int32_t END = bcf_int32_vector_end;
+    const std::int32_t MISSING = bcf_int32_missing;
+
+    // 2 alleles; rows have a stride of 3
+    std::vector<std::int32_t> pl = {
+        0, 10, 20,            // diploid
+        5, 0, END,            // haploid
+        MISSING, END, END,    // missing
+        30, 10, 40,           // diploid, not normalized
+        7, END, END,          // too short
+        1000, 0, 1000         // very large PLs
+    };
+
+    PlDecoder decoder;
+    decoder.Decode(pl.data(), 6, 3, 2);
+
+    REQUIRE(decoder.num_samples() == 6);
+    REQUIRE(decoder.width() == 3);
+
+    CHECK(decoder.encoding(0) == PlEncoding::Diploid);
+    CHECK(decoder.encoding(1) == PlEncoding::Haploid);
+    CHECK(decoder.encoding(2) == PlEncoding::Missing);
+    CHECK(decoder.encoding(3) == PlEncoding::Diploid);
+    CHECK(decoder.encoding(4) == PlEncoding::Invalid);
+    CHECK(decoder.encoding(5) == PlEncoding::Diploid);
+
+    CHECK(decoder.row(0)[0] == doctest::Approx(1.0f));
+    CHECK(decoder.row(0)[1] == doctest::Approx(unphredf(10)));
+    CHECK(decoder.row(0)[2] == doctest::Approx(unphredf(20)));
+
+    CHECK(decoder.row(1)[0] == doctest::Approx(unphredf(5)));
+    CHECK(decoder.row(1)[1] == doctest::Approx(1.0f));
+    CHECK(decoder.row(1)[2] == 0.0f);
+
+    CHECK(decoder.row(2)[0] == 1.0f);
+    CHECK(decoder.row(2)[1] == 1.0f);
+    CHECK(decoder.row(2)[2] == 1.0f);
+
+    CHECK(decoder.row(3)[0] == doctest::Approx(unphredf(20)));
+    CHECK(decoder.row(3)[1] == doctest::Approx(1.0f));
+    CHECK(decoder.row(3)[2] == doctest::Approx(unphredf(30)));
+
+    CHECK(decoder.row(5)[0] == 0.0f);
+    CHECK(decoder.row(5)[1] == doctest::Approx(1.0f));
+    CHECK(decoder.row(5)[2] == 0.0f);
+}
+
+TEST_CASE("PlDecoder.Extract") {
+    using mutk::utility::unphredf;
+    using mutk::message_t;
+
+    const std::int32_t END = bcf_int32_vector_end;
+    const std::int32_t MISSING = bcf_int32_missing;
+
+    // 3 alleles; rows have a stride of 6
+    std::vector<std::int32_t> pl = {
+        0, 10, 20, 30, 40, 50,              // diploid
+        15, 0, 25, END, END, END,           // haploid
+        MISSING, END, END, END, END, END,   // missing
+        0, 10, END, END, END, END           // too short
+    };
+
+    PlDecoder decoder;
+    decoder.Decode(pl.data(), 4, 6, 3);
+
+    message_t msg;
+
+    SUBCASE("Diploid nodes") {
+        REQUIRE(decoder.Extract(0, Ploidy::Diploid, &msg));
+        REQUIRE(msg.size() == 6);
+        for(int k = 0; k < 6; ++k) {
+            CAPTURE(k);
+            CHECK(msg(k) == doctest::Approx(unphredf(10*k)));
+        }
+        CHECK_FALSE(decoder.Extract(1, Ploidy::Diploid, &msg));
+        REQUIRE(decoder.Extract(2, Ploidy::Diploid, &msg));
+        REQUIRE(msg.size() == 6);
+        for(int k = 0; k < 6; ++k) {
+            CAPTURE(k);
+            CHECK(msg(k) == 1.0f);
+        }
+        CHECK_FALSE(decoder.Extract(3, Ploidy::Diploid, &msg));
+    }
+    SUBCASE("Haploid nodes") {
+        // homozygotes are 0/0, 1/1, and 2/2
+        REQUIRE(decoder.Extract(0, Ploidy::Haploid, &msg));
+        REQUIRE(msg.size() == 3);
+        CHECK(msg(0) == doctest::Approx(1.0f));
+        CHECK(msg(1) == doctest::Approx(unphredf(20)));
+        CHECK(msg(2) == doctest::Approx(unphredf(50)));
+
+        REQUIRE(decoder.Extract(1, Ploidy::Haploid, &msg));
+        REQUIRE(msg.size() == 3);
+        CHECK(msg(0) == doctest::Approx(unphredf(15)));
+        CHECK(msg(1) == doctest::Approx(1.0f));
+        CHECK(msg(2) == doctest::Approx(unphredf(25)));
+
+        REQUIRE(decoder.Extract(2, Ploidy::Haploid, &msg));
+        REQUIRE(msg.size() == 3);
+        CHECK(msg(0) == 1.0f);
+
+        CHECK_FALSE(decoder.Extract(3, Ploidy::Haploid, &msg));
+    }
+}
+
+TEST_CASE("PlDecoder.Decode with columns") {
+    using mutk::utility::unphredf;
+
+    const std::int32_t MISSING = bcf_int32_missing;
+    const std::int32_t END = bcf_int32_vector_end;
+
+    std::vector<std::int32_t> pl = {
+        0, 10, 20,
+        MISSING, END, END,
+        30, 0, 40
+    };
+    std::vector<int> columns = {2, 0};
+
+    PlDecoder decoder;
+    decoder.Decode(pl.data(), 2, 3, 2, columns.data());
+
+    REQUIRE(decoder.num_samples() == 2);
+    CHECK(decoder.encoding(0) == PlEncoding::Diploid);
+    CHECK(decoder.encoding(1) == PlEncoding::Diploid);
+
+    CHECK(decoder.row(0)[0] == doctest::Approx(unphredf(30)));
+    CHECK(decoder.row(0)[1] == doctest::Approx(1.0f));
+    CHECK(decoder.row(0)[2] == doctest::Approx(unphredf(40)));
+
+    CHECK(decoder.row(1)[0] == doctest::Approx(1.0f));
+    CHECK(decoder.row(1)[1] == doctest::Approx(unphredf(10)));
+    CHECK(decoder.row(1)[2] == doctest::Approx(unphredf(20)));
+}
+// LCOV_EXCL_STOP
@@ -35,21 +35,21 @@ struct mutk::CloningPotential::Impl {
     Impl(const mutk::CloningPotential &p) : pot{p} {}
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::any_t) const {
-        return pot.model_.CreateTransitionMatrix(n, pot.u_);
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::any_t) const {
+        return pot.model_.TransitionMatrix(n, pot.u_);
     }
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::mean_t a) const {
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::mean_t a) const {
         auto aa = static_cast<std::underlying_type_t<mutk::Potential::mean_t>>(a);
-        return (aa > 0) ? pot.model_.CreateMeanMatrix(n, pot.u_) :
-                          pot.model_.CreateTransitionMatrix(n, pot.u_);
+        return (aa > 0) ? pot.model_.MeanMatrix(n, pot.u_) :
+                          pot.model_.TransitionMatrix(n, pot.u_);
     }
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::some_t a) const {
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::some_t a) const {
         auto aa = static_cast<std::underlying_type_t<mutk::Potential::some_t>>(a);
-        return pot.model_.CreateCountMatrix(n, pot.u_, aa);
+        return pot.model_.CountMatrix(n, pot.u_, aa);
     }
 
     template<class Arg>
@@ -69,8 +69,8 @@ struct mutk::CloningPotential::Impl {
 template<class Arg>
 inline
 message_t mutk::CloningPotential::Impl::operator()(size_t n, Arg a) {
-    auto ploidy0 = message_axis_ploidy(pot.labels_.sequence()[0]);
-    auto ploidy1 = message_axis_ploidy(pot.labels_.sequence()[1]);
+    auto ploidy0 = message_axis_ploidy(*pot.labels_.nth(0));
+    auto ploidy1 = message_axis_ploidy(*pot.labels_.nth(1));
 
     if(ploidy0 == Ploidy::Diploid) {
         if(ploidy1 == Ploidy::Diploid) {
@@ -97,6 +97,14 @@ message_t mutk::CloningPotential::Create(size_t n, some_t a) {
     return CloningPotential::Impl(*this)(n,a);
 }
 
+// A clone passes on every allele along the same branch
+std::optional<mutk::kalleles_operator_t> mutk::CloningPotential::TransitionOperator() const {
+    if(message_axis_ploidy(*labels_.nth(0)) != message_axis_ploidy(*labels_.nth(1))) {
+        return std::nullopt;
+    }
+    return model_.TransitionOperator(u_);
+}
+
 template<>
 template<class Arg>
 message_t mutk::CloningPotential::Impl::Create<11>::call(const Impl &impl, size_t n, Arg arg) {
@@ -107,7 +115,7 @@ template<>
 template<class Arg>
 message_t mutk::CloningPotential::Impl::Create<21>::call(const Impl &impl, size_t n, Arg arg) {
     auto ret = message_t::from_shape(impl.pot.Shape(n));
-    auto mat = impl.CreateModelMatrix(n, arg);
+    const auto &mat = impl.CreateModelMatrix(n, arg);
     for(message_t::size_type i = 0; i < ret.shape(0); ++i) {
         for(message_t::size_type j = 0; j < ret.shape(1); ++j) {
             // a/b -> x
@@ -123,7 +131,7 @@ template<>
 template<class Arg>
 message_t mutk::CloningPotential::Impl::Create<12>::call(const Impl &impl, size_t n, Arg arg) {
     auto ret = message_t::from_shape(impl.pot.Shape(n));
-    auto mat = impl.CreateModelMatrix(n, arg);
+    const auto &mat = impl.CreateModelMatrix(n, arg);
     for(message_t::size_type i = 0; i < ret.shape(0); ++i) {
         for(message_t::size_type j = 0; j < ret.shape(1); ++j) {
             // a -> x/x
@@ -147,8 +155,8 @@ message_t mutk::CloningPotential::Impl::Create<22>::call(const Impl &impl, size_
     ret.fill(0.0f);
     int_t val = static_cast<int_t>(arg);
     for(int_t k=0; k<=val; ++k) {
-        auto mat1 = impl.CreateModelMatrix(n, Arg(k));
-        auto mat2 = impl.CreateModelMatrix(n, Arg(val-k));
+        const auto &mat1 = impl.CreateModelMatrix(n, Arg(k));
+        const auto &mat2 = impl.CreateModelMatrix(n, Arg(val-k));
         for(message_size_t i = 0; i < ret.shape(0); ++i) {
             for(message_size_t j = 0; j < ret.shape(1); ++j) {
                 // a/b -> x/y
@@ -420,3 +428,56 @@ TEST_CASE("CloningPotential.Create for Haploid-Haploid") {
     run_mutation_tests(test);
 }
 // LCOV_EXCL_STOP
+
+// LCOV_EXCL_START
+TEST_CASE("CloningPotential.TransitionOperator") {
+    using mutk::variable_t;
+    using mutk::make_message_label;
+
+    const std::size_t n = 3;
+    const float u = 1e-3;
+    mutk::MutationModel model(4.0, 0.001, 0, 0, 0);
+    auto expected = model.TransitionOperator(u);
+    auto m = [&](std::size_t i, std::size_t j) { return expected.a*(i == j) + expected.b; };
+
+    SUBCASE("Haploid-Haploid") {
+        mutk::CloningPotential pot(model, u, std::vector<mutk::message_label_t>{
+            make_message_label(variable_t{0}, Ploidy::Haploid),
+            make_message_label(variable_t{1}, Ploidy::Haploid)});
+        auto ret = pot.CreateModelPotential(n);
+        REQUIRE(ret.kalleles);
+        CHECK(ret.kalleles->a == expected.a);
+        CHECK(ret.kalleles->b == expected.b);
+        for(std::size_t i = 0; i < n; ++i) {
+            for(std::size_t j = 0; j < n; ++j) {
+                CHECK(ret.value(i,j) == doctest::Approx(m(i,j)));
+            }
+        }
+    }
+    SUBCASE("Diploid-Diploid") {
+        mutk::CloningPotential pot(model, u, std::vector<mutk::message_label_t>{
+            make_message_label(variable_t{0}, Ploidy::Diploid),
+            make_message_label(variable_t{1}, Ploidy::Diploid)});
+        auto ret = pot.CreateModelPotential(n);
+        REQUIRE(ret.kalleles);
+        CHECK(ret.kalleles->a == expected.a);
+        CHECK(ret.kalleles->b == expected.b);
+        const std::size_t g = mutk::num_diploids(n);
+        for(std::size_t i = 0; i < g; ++i) {
+            auto [a, b] = mutk::diploid_alleles(i);
+            for(std::size_t j = 0; j < g; ++j) {
+                auto [x, y] = mutk::diploid_alleles(j);
+                double value = m(a,x)*m(b,y) + ((x != y) ? m(a,y)*m(b,x) : 0.0);
+                CHECK(ret.value(i,j) == doctest::Approx(value));
+            }
+        }
+    }
+    SUBCASE("Diploid-Haploid") {
+        mutk::CloningPotential pot(model, u, std::vector<mutk::message_label_t>{
+            make_message_label(variable_t{0}, Ploidy::Diploid),
+            make_message_label(variable_t{1}, Ploidy::Haploid)});
+        CHECK_FALSE(pot.TransitionOperator());
+        CHECK_FALSE(pot.CreateModelPotential(n).kalleles);
+    }
+}
+// LCOV_EXCL_STOP
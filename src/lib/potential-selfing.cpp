@@ -35,21 +35,21 @@ struct mutk::SelfingPotential::Impl {
     Impl(const mutk::SelfingPotential &p) : pot{p} {}
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::any_t, float t) const {
-        return pot.model_.CreateTransitionMatrix(n, t);
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::any_t, float t) const {
+        return pot.model_.TransitionMatrix(n, t);
     }
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::mean_t a, float t) const {
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::mean_t a, float t) const {
         auto aa = static_cast<std::underlying_type_t<mutk::Potential::mean_t>>(a);
-        return (aa > 0) ? pot.model_.CreateMeanMatrix(n, t) :
-                          pot.model_.CreateTransitionMatrix(n, t);
+        return (aa > 0) ? pot.model_.MeanMatrix(n, t) :
+                          pot.model_.TransitionMatrix(n, t);
     }
 
     inline
-    auto CreateModelMatrix(size_t n, mutk::Potential::some_t a, float t) const {
+    const auto & CreateModelMatrix(size_t n, mutk::Potential::some_t a, float t) const {
         auto aa = static_cast<std::underlying_type_t<mutk::Potential::some_t>>(a);
-        return pot.model_.CreateCountMatrix(n, t, aa);
+        return pot.model_.CountMatrix(n, t, aa);
     }
 
     template<class Arg>
@@ -59,7 +59,7 @@ struct mutk::SelfingPotential::Impl {
             message_axis_size(n, Ploidy::Diploid),
             message_axis_size(n, Ploidy::Haploid)
         });
-        auto mat = CreateModelMatrix(n, arg, t);
+        const auto &mat = CreateModelMatrix(n, arg, t);
         for(message_t::size_type i = 0; i < ret.shape(0); ++i) {
             for(message_t::size_type j = 0; j < ret.shape(1); ++j) {
                 // a/b -> x
@@ -73,13 +73,13 @@ struct mutk::SelfingPotential::Impl {
 
     template<class Arg>
     inline
-    auto CreateModelMatrixU(size_t n, Arg a) const {
+    const auto & CreateModelMatrixU(size_t n, Arg a) const {
         return CreateModelMatrix(n, a, pot.u_);
     }
 
     template<class Arg>
     inline
-    auto CreateModelMatrixV(size_t n, Arg a) const {
+    const auto & CreateModelMatrixV(size_t n, Arg a) const {
         return CreateModelMatrix(n, a, pot.v_);
     }
 
@@ -112,8 +112,8 @@ struct mutk::SelfingPotential::Impl {
 template<class Arg>
 inline
 message_t mutk::SelfingPotential::Impl::operator()(size_t n, Arg a) {
-    auto ploidy0 = message_axis_ploidy(pot.labels_.sequence()[0]);
-    auto ploidy1 = message_axis_ploidy(pot.labels_.sequence()[1]);
+    auto ploidy0 = message_axis_ploidy(*pot.labels_.nth(0));
+    auto ploidy1 = message_axis_ploidy(*pot.labels_.nth(1));
 
     if(ploidy0 == Ploidy::Diploid) {
         if(ploidy1 == Ploidy::Diploid) {
@@ -140,6 +140,18 @@ message_t mutk::SelfingPotential::Create(size_t n, some_t a) {
     return SelfingPotential::Impl(*this)(n,a);
 }
 
+// A haploid child of a haploid parent gets its allele along either branch
+// with equal probability, so the average of the two transitions
+std::optional<mutk::kalleles_operator_t> mutk::SelfingPotential::TransitionOperator() const {
+    if(message_axis_ploidy(*labels_.nth(0)) != Ploidy::Haploid
+        || message_axis_ploidy(*labels_.nth(1)) != Ploidy::Haploid) {
+        return std::nullopt;
+    }
+    auto op_u = model_.TransitionOperator(u_);
+    auto op_v = model_.TransitionOperator(v_);
+    return kalleles_operator_t{0.5*(op_u.a + op_v.a), 0.5*(op_u.b + op_v.b)};
+}
+
 template<>
 template<class Arg>
 message_t mutk::SelfingPotential::Impl::Create<22>::call(const Impl &impl, size_t n, Arg arg) {
@@ -148,8 +160,8 @@ message_t mutk::SelfingPotential::Impl::Create<22>::call(const Impl &impl, size_
     ret.fill(0.0f);
     int_t val = static_cast<int_t>(arg);
     for(int_t k=0; k<=val; ++k) {
-        auto mat1 = impl.CreateModelMatrixU(n, Arg(k));
-        auto mat2 = impl.CreateModelMatrixV(n, Arg(val-k));
+        const auto &mat1 = impl.CreateModelMatrixU(n, Arg(k));
+        const auto &mat2 = impl.CreateModelMatrixV(n, Arg(val-k));
         for(message_size_t i = 0; i < ret.shape(0); ++i) {
             for(message_size_t j = 0; j < ret.shape(1); ++j) {
                 // (a/b -> x) * (a/b -> y)  -> x/y
@@ -176,8 +188,8 @@ message_t mutk::SelfingPotential::Impl::Create<12>::call(const Impl &impl, size_
     ret.fill(0.0f);
     int_t val = static_cast<int_t>(arg);
     for(int_t k=0; k<=val; ++k) {
-        auto mat1 = impl.CreateModelMatrixU(n, Arg(k));
-        auto mat2 = impl.CreateModelMatrixV(n, Arg(val-k));
+        const auto &mat1 = impl.CreateModelMatrixU(n, Arg(k));
+        const auto &mat2 = impl.CreateModelMatrixV(n, Arg(val-k));
         for(message_size_t i = 0; i < ret.shape(0); ++i) {
             for(message_size_t j = 0; j < ret.shape(1); ++j) {
                 // a -> x/y
@@ -198,8 +210,8 @@ template<>
 template<class Arg>
 message_t mutk::SelfingPotential::Impl::Create<21>::call(const Impl &impl, size_t n, Arg arg) {
     auto ret = message_t::from_shape(impl.pot.Shape(n));
-    auto matU = impl.CreateModelMatrixU(n, arg);
-    auto matV = impl.CreateModelMatrixV(n, arg);
+    const auto &matU = impl.CreateModelMatrixU(n, arg);
+    const auto &matV = impl.CreateModelMatrixV(n, arg);
     for(message_t::size_type i = 0; i < ret.shape(0); ++i) {
         for(message_t::size_type j = 0; j < ret.shape(1); ++j) {
             // a/b -> x
@@ -218,8 +230,8 @@ message_t mutk::SelfingPotential::Impl::Create<11>::call(const Impl &impl, size_
     //   (1x1 -> 2 -> 1)
     //   The haploid individual generates two clones with different mutation rates.
     //   The clone fuse. Then the fused individual produces a haploid gamete.
-    auto matU = impl.CreateModelMatrixU(n, arg);
-    auto matV = impl.CreateModelMatrixV(n, arg);
+    const auto &matU = impl.CreateModelMatrixU(n, arg);
+    const auto &matV = impl.CreateModelMatrixV(n, arg);
     return 0.5*(matU+matV);
 }
 
@@ -548,3 +560,39 @@ TEST_CASE("SelfingPotential.Create for Haploid-Haploid") {
     run_mutation_tests(test);
 }
 // LCOV_EXCL_STOP
+
+// LCOV_EXCL_START
+TEST_CASE("SelfingPotential.TransitionOperator") {
+    using mutk::variable_t;
+    using mutk::make_message_label;
+
+    const std::size_t n = 3;
+    const float u = 1e-3, v = 2e-3;
+    mutk::MutationModel model(4.0, 0.001, 0, 0, 0);
+
+    SUBCASE("Haploid-Haploid") {
+        mutk::SelfingPotential pot(model, u, v, std::vector<mutk::message_label_t>{
+            make_message_label(variable_t{0}, Ploidy::Haploid),
+            make_message_label(variable_t{1}, Ploidy::Haploid)});
+        auto ret = pot.CreateModelPotential(n);
+        REQUIRE(ret.kalleles);
+        auto op_u = model.TransitionOperator(u);
+        auto op_v = model.TransitionOperator(v);
+        CHECK(ret.kalleles->a == doctest::Approx(0.5*(op_u.a + op_v.a)));
+        CHECK(ret.kalleles->b == doctest::Approx(0.5*(op_u.b + op_v.b)));
+        for(std::size_t i = 0; i < n; ++i) {
+            for(std::size_t j = 0; j < n; ++j) {
+                double value = ret.kalleles->a*(i == j) + ret.kalleles->b;
+                CHECK(ret.value(i,j) == doctest::Approx(value));
+            }
+        }
+    }
+    SUBCASE("Diploid-Diploid") {
+        mutk::SelfingPotential pot(model, u, v, std::vector<mutk::message_label_t>{
+            make_message_label(variable_t{0}, Ploidy::Diploid),
+            make_message_label(variable_t{1}, Ploidy::Diploid)});
+        CHECK_FALSE(pot.TransitionOperator());
+        CHECK_FALSE(pot.CreateModelPotential(n).kalleles);
+    }
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,140 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include "unit_testing.hpp"
+
+#include <mutk/reduction.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+using mutk::BlockSum;
+using mutk::CompensatedSum;
+
+BlockSum::BlockSum(std::size_t block_size) : block_size_{block_size} {
+    if(block_size_ == 0) {
+        throw std::invalid_argument("block size must be positive.");
+    }
+}
+
+void BlockSum::AddBlock(double partial) {
+    // Equal levels are merged, so levels_ is like the bits of a binary
+    // counter and every sum covers a power of two blocks
+    int level = 0;
+    while(!levels_.empty() && levels_.back().second == level) {
+        partial = levels_.back().first + partial;
+        levels_.pop_back();
+        level += 1;
+    }
+    levels_.emplace_back(partial, level);
+}
+
+double BlockSum::value() const {
+    BlockSum copy = *this;
+    if(copy.count_ > 0) {
+        copy.AddBlock(copy.block_.value());
+    }
+    double total = 0.0;
+    for(auto it = copy.levels_.rbegin(); it != copy.levels_.rend(); ++it) {
+        total = it->first + total;
+    }
+    return total;
+}
+
+std::vector<double> BlockSum::State() const {
+    std::vector<double> ret = {static_cast<double>(count_), block_.sum(), block_.compensation()};
+    for(auto && [value, level] : levels_) {
+        ret.push_back(value);
+        ret.push_back(level);
+    }
+    return ret;
+}
+
+void BlockSum::SetState(const std::vector<double> &state) {
+    if(state.size() < 3 || state.size() % 2 == 0 || state[0] < 0 ||
+        state[0] >= static_cast<double>(block_size_)) {
+        throw std::invalid_argument("invalid state for a block sum.");
+    }
+    count_ = static_cast<std::size_t>(state[0]);
+    block_ = CompensatedSum{state[1], state[2]};
+    levels_.clear();
+    for(std::size_t i = 3; i < state.size(); i += 2) {
+        levels_.emplace_back(state[i], static_cast<int>(state[i+1]));
+    }
+}
+
+// LCOV_EXCL_START
+TEST_CASE("BlockSum") {
+    // Values with a wide range of magnitudes
+    std::vector<double> values;
+    for(int i = 0; i < 10000; ++i) {
+        values.push_back(-1.0/(1+i%97) * ((i%5 == 0) ? 1e6 : 1.0) + 1e-9*i);
+    }
+
+    const std::size_t block_size = 64;
+    BlockSum serial(block_size);
+    for(auto x : values) {
+        serial.Add(x);
+    }
+
+    // Blocks summed out of order, as threads would, and added in order
+    const std::size_t num_blocks = (values.size() + block_size - 1)/block_size;
+    std::vector<double> partials(num_blocks);
+    for(std::size_t b = num_blocks; b-- > 0;) {
+        CompensatedSum sum;
+        for(std::size_t i = b*block_size; i < std::min(values.size(), (b+1)*block_size); ++i) {
+            sum.Add(values[i]);
+        }
+        partials[b] = sum.value();
+    }
+    BlockSum blocked(block_size);
+    for(auto p : partials) {
+        blocked.AddBlock(p);
+    }
+    CHECK(blocked.value() == serial.value());
+
+    // Resuming from a saved state gives the same bits
+    BlockSum first(block_size);
+    for(std::size_t i = 0; i < 5000+17; ++i) {
+        first.Add(values[i]);
+    }
+    BlockSum resumed(block_size);
+    resumed.SetState(first.State());
+    for(std::size_t i = 5000+17; i < values.size(); ++i) {
+        resumed.Add(values[i]);
+    }
+    CHECK(resumed.value() == serial.value());
+    CHECK_THROWS_AS(resumed.SetState({1.0, 0.0}), std::invalid_argument);
+
+    // Compensation recovers what naive summation loses
+    BlockSum small(block_size);
+    small.Add(1e16);
+    for(int i = 0; i < 1000; ++i) {
+        small.Add(1.0);
+    }
+    small.Add(-1e16);
+    CHECK(small.value() == 1000.0);
+    CHECK(BlockSum(block_size).value() == 0.0);
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,502 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include "unit_testing.hpp"
+
+#include <mutk/site_store.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <htslib/vcf.h>
+
+using mutk::SiteStore;
+using mutk::SiteStoreWriter;
+
+namespace {
+constexpr char MAGIC[8] = {'M','U','T','K','S','I','T','E'};
+constexpr std::uint32_t VERSION = 1;
+
+struct file_header_t {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t num_samples;
+    std::uint32_t num_contigs;
+    std::uint32_t block_size;
+};
+
+struct block_header_t {
+    std::uint32_t size;
+    std::uint32_t pl_bytes;
+};
+
+struct trailer_t {
+    std::uint64_t num_sites;
+    std::uint64_t num_blocks;
+    std::uint64_t index_offset;
+    char magic[8];
+};
+
+constexpr std::size_t align8(std::size_t n) {
+    return (n + 7) & ~std::size_t{7};
+}
+
+template<typename T>
+void write_raw(std::ofstream &out, const T *p, std::size_t n) {
+    out.write(reinterpret_cast<const char*>(p), sizeof(T)*n);
+    // pad every column to an 8-byte boundary
+    static const char zeros[8] = {0};
+    std::size_t bytes = sizeof(T)*n;
+    out.write(zeros, align8(bytes) - bytes);
+}
+
+template<typename T>
+void write_pod(std::ofstream &out, const T &value) {
+    write_raw(out, &value, 1);
+}
+
+void write_strings(std::ofstream &out, const std::vector<std::string> &strings) {
+    for(auto &&s : strings) {
+        std::uint32_t n = s.size();
+        write_pod(out, n);
+        write_raw(out, s.data(), s.size());
+    }
+}
+
+[[noreturn]] void throw_corrupt() {
+    throw std::runtime_error("site store is truncated or corrupt.");
+}
+
+// Reads aligned values from a memory-mapped file with bounds checking
+struct cursor_t {
+    const char *data;
+    std::size_t size;
+    std::size_t offset;
+
+    template<typename T>
+    const T * take(std::size_t n) {
+        std::size_t bytes = sizeof(T)*n;
+        if(offset > size || bytes > size - offset) {
+            throw_corrupt();
+        }
+        const T *p = reinterpret_cast<const T*>(data + offset);
+        offset = std::min(size, offset + align8(bytes));
+        return p;
+    }
+
+    std::string take_string() {
+        std::uint32_t n = *take<std::uint32_t>(1);
+        const char *p = take<char>(n);
+        return {p, n};
+    }
+};
+} // namespace
+
+SiteStoreWriter::SiteStoreWriter(const std::filesystem::path &path,
+    const std::vector<std::string> &contig_names,
+    const std::vector<std::string> &sample_names,
+    int block_size) : num_samples_(sample_names.size()), block_size_(block_size) {
+    if(block_size_ <= 0) {
+        throw std::invalid_argument("site store block size must be positive.");
+    }
+    output_.open(path, std::ios::binary | std::ios::trunc);
+    if(!output_) {
+        throw std::runtime_error("unable to open output file: '" + path.string() + "'.");
+    }
+    file_header_t header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.num_samples = num_samples_;
+    header.num_contigs = contig_names.size();
+    header.block_size = block_size_;
+    write_pod(output_, header);
+    write_strings(output_, contig_names);
+    write_strings(output_, sample_names);
+}
+
+SiteStoreWriter::~SiteStoreWriter() {
+    try {
+        Close();
+    } catch(...) {
+        // destructors must not throw; call Close() to see errors
+    }
+}
+
+void SiteStoreWriter::Add(std::int32_t rid, std::int64_t pos, int n_allele,
+    const std::int32_t *pl, int stride) {
+    assert(n_allele >= 0 && n_allele <= UINT8_MAX);
+    assert(stride >= 0 && stride <= UINT8_MAX);
+    assert(pl != nullptr || stride == 0);
+
+    rid_.push_back(rid);
+    pos_.push_back(pos);
+    n_allele_.push_back(n_allele);
+    stride_.push_back(stride);
+    pl_offset_.push_back(pl_.size());
+
+    for(int j = 0; j < num_samples_; ++j) {
+        const std::int32_t *in = pl + j*stride;
+        int w = 0;
+        bool missing = (stride == 0 || in[0] == bcf_int32_missing);
+        if(!missing) {
+            while(w < stride && in[w] != bcf_int32_vector_end) {
+                w += 1;
+            }
+        }
+        missing_.push_back(missing);
+        width_.push_back(w);
+        for(int k = 0; k < stride; ++k) {
+            std::int32_t x = (k < w) ? in[k] : 0;
+            pl_.push_back(std::clamp<std::int32_t>(x, 0, UINT16_MAX));
+        }
+    }
+
+    num_sites_ += 1;
+    if(rid_.size() == static_cast<std::size_t>(block_size_)) {
+        FlushBlock();
+    }
+}
+
+void SiteStoreWriter::FlushBlock() {
+    if(rid_.empty()) {
+        return;
+    }
+    block_offsets_.push_back(output_.tellp());
+
+    bool narrow = std::all_of(pl_.begin(), pl_.end(), [](auto x){ return x <= UINT8_MAX; });
+    block_header_t header{static_cast<std::uint32_t>(rid_.size()), narrow ? 1u : 2u};
+    write_pod(output_, header);
+    write_raw(output_, rid_.data(), rid_.size());
+    write_raw(output_, pos_.data(), pos_.size());
+    write_raw(output_, n_allele_.data(), n_allele_.size());
+    write_raw(output_, stride_.data(), stride_.size());
+    write_raw(output_, pl_offset_.data(), pl_offset_.size());
+
+    std::vector<std::uint64_t> bits((missing_.size()+63)/64, 0);
+    for(std::size_t i = 0; i < missing_.size(); ++i) {
+        bits[i/64] |= std::uint64_t{missing_[i]} << (i%64);
+    }
+    write_raw(output_, bits.data(), bits.size());
+    write_raw(output_, width_.data(), width_.size());
+
+    if(narrow) {
+        std::vector<std::uint8_t> small(pl_.begin(), pl_.end());
+        write_raw(output_, small.data(), small.size());
+    } else {
+        write_raw(output_, pl_.data(), pl_.size());
+    }
+    if(!output_) {
+        throw std::runtime_error("unable to write site store block.");
+    }
+
+    rid_.clear();
+    pos_.clear();
+    n_allele_.clear();
+    stride_.clear();
+    pl_offset_.clear();
+    missing_.clear();
+    width_.clear();
+    pl_.clear();
+}
+
+void SiteStoreWriter::Close() {
+    if(!output_.is_open()) {
+        return;
+    }
+    FlushBlock();
+    trailer_t trailer;
+    trailer.num_sites = num_sites_;
+    trailer.num_blocks = block_offsets_.size();
+    trailer.index_offset = output_.tellp();
+    std::memcpy(trailer.magic, MAGIC, sizeof(MAGIC));
+    write_raw(output_, block_offsets_.data(), block_offsets_.size());
+    write_pod(output_, trailer);
+    output_.close();
+    if(!output_) {
+        throw std::runtime_error("unable to finish writing site store.");
+    }
+}
+
+bool SiteStore::IsSiteStore(const std::filesystem::path &path) {
+    std::ifstream input(path, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    if(!input.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+SiteStore::SiteStore(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("unable to open site store: '" + path.string() + "'.");
+    }
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(file_header_t)+sizeof(trailer_t))) {
+        ::close(fd);
+        throw std::runtime_error("unable to read site store: '" + path.string() + "'.");
+    }
+    size_ = st.st_size;
+    void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) {
+        throw std::runtime_error("unable to map site store: '" + path.string() + "'.");
+    }
+    data_ = static_cast<const char*>(p);
+    ::madvise(p, size_, MADV_SEQUENTIAL);
+
+    try {
+        cursor_t cursor{data_, size_, 0};
+        const auto *header = cursor.take<file_header_t>(1);
+        if(std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION) {
+            throw std::runtime_error("file is not a supported site store: '" + path.string() + "'.");
+        }
+        block_size_ = header->block_size;
+        for(std::uint32_t i = 0; i < header->num_contigs; ++i) {
+            contig_names_.push_back(cursor.take_string());
+        }
+        for(std::uint32_t i = 0; i < header->num_samples; ++i) {
+            sample_names_.push_back(cursor.take_string());
+        }
+
+        cursor_t tail{data_, size_, size_ - sizeof(trailer_t)};
+        const auto *trailer = tail.take<trailer_t>(1);
+        if(std::memcmp(trailer->magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw_corrupt();
+        }
+        num_sites_ = trailer->num_sites;
+
+        cursor_t index{data_, size_, trailer->index_offset};
+        const auto *offsets = index.take<std::uint64_t>(trailer->num_blocks);
+
+        const std::size_t num_samples = sample_names_.size();
+        blocks_.reserve(trailer->num_blocks);
+        for(std::uint64_t b = 0; b < trailer->num_blocks; ++b) {
+            cursor_t c{data_, trailer->index_offset, offsets[b]};
+            const auto *bh = c.take<block_header_t>(1);
+            block_t block;
+            block.size = bh->size;
+            block.pl_bytes = bh->pl_bytes;
+            block.rid = c.take<std::int32_t>(block.size);
+            block.pos = c.take<std::int64_t>(block.size);
+            block.n_allele = c.take<std::uint8_t>(block.size);
+            block.stride = c.take<std::uint8_t>(block.size);
+            block.pl_offset = c.take<std::uint64_t>(block.size);
+            block.missing = c.take<std::uint64_t>((block.size*num_samples+63)/64);
+            block.width = c.take<std::uint8_t>(block.size*num_samples);
+            std::size_t num_pl = 0;
+            for(std::uint32_t i = 0; i < block.size; ++i) {
+                num_pl += block.stride[i]*num_samples;
+            }
+            // GetPl trusts these, so a corrupt value must not reach it
+            for(std::uint32_t i = 0; i < block.size; ++i) {
+                const std::size_t stride = block.stride[i];
+                if(block.rid[i] < 0 || static_cast<std::size_t>(block.rid[i]) >= contig_names_.size()
+                    || block.pl_offset[i] > num_pl || stride*num_samples > num_pl - block.pl_offset[i]) {
+                    throw_corrupt();
+                }
+                for(std::size_t s = 0; s < num_samples; ++s) {
+                    if(block.width[i*num_samples + s] > stride) {
+                        throw_corrupt();
+                    }
+                }
+            }
+            if(block.pl_bytes == 1) {
+                block.pl = c.take<std::uint8_t>(num_pl);
+            } else if(block.pl_bytes == 2) {
+                block.pl = c.take<std::uint16_t>(num_pl);
+            } else {
+                throw_corrupt();
+            }
+            // every block except the last one is full
+            if(block.size == 0 || block.size > static_cast<std::uint32_t>(block_size_)
+                || (b+1 < trailer->num_blocks && block.size != static_cast<std::uint32_t>(block_size_))) {
+                throw_corrupt();
+            }
+            blocks_.push_back(block);
+        }
+        if(num_sites_ != (blocks_.empty() ? 0 :
+            (blocks_.size()-1)*static_cast<std::uint64_t>(block_size_) + blocks_.back().size)) {
+            throw_corrupt();
+        }
+    } catch(...) {
+        ::munmap(const_cast<char*>(data_), size_);
+        throw;
+    }
+}
+
+SiteStore::~SiteStore() {
+    ::munmap(const_cast<char*>(data_), size_);
+}
+
+std::pair<const SiteStore::block_t*, std::uint32_t> SiteStore::locate(std::uint64_t i) const {
+    assert(i < num_sites_);
+    return {&blocks_[i / block_size_], static_cast<std::uint32_t>(i % block_size_)};
+}
+
+SiteStore::site_t SiteStore::site(std::uint64_t i) const {
+    auto [block, j] = locate(i);
+    return {block->rid[j], block->pos[j], block->n_allele[j], block->stride[j]};
+}
+
+bool SiteStore::is_missing(std::uint64_t i, int sample) const {
+    auto [block, j] = locate(i);
+    std::size_t bit = j*sample_names_.size() + sample;
+    return (block->missing[bit/64] >> (bit%64)) & 1;
+}
+
+int SiteStore::GetPl(std::uint64_t i, std::vector<std::int32_t> *pl) const {
+    assert(pl != nullptr);
+    auto [block, j] = locate(i);
+    const int num_samples = sample_names_.size();
+    const int stride = block->stride[j];
+    const std::uint64_t start = block->pl_offset[j];
+
+    pl->resize(stride*num_samples);
+    for(int s = 0; s < num_samples; ++s) {
+        std::int32_t *out = pl->data() + s*stride;
+        int w = block->width[j*num_samples + s];
+        for(int k = 0; k < stride; ++k) {
+            std::uint64_t x = start + s*stride + k;
+            out[k] = (block->pl_bytes == 1) ? static_cast<const std::uint8_t*>(block->pl)[x]
+                                            : static_cast<const std::uint16_t*>(block->pl)[x];
+        }
+        std::fill(out + w, out + stride, bcf_int32_vector_end);
+        if(stride > 0 && is_missing(i, s)) {
+            out[0] = bcf_int32_missing;
+        }
+    }
+    return stride*num_samples;
+}
+
+// LCOV_EXCL_START
+TEST_CASE("SiteStore") {
+    using vec_t = std::vector<std::int32_t>;
+    const std::int32_t M = bcf_int32_missing;
+    const std::int32_t E = bcf_int32_vector_end;
+
+    auto path = std::filesystem::temp_directory_path() / "mutk-site-store-test.bin";
+
+    std::vector<vec_t> pls = {
+        {0, 10, 20,   M, E, E},
+        {5, 0, 100,   0, 30, E},
+        {0, 300, 70000,   0, 1, 2},
+        {},
+        {0, 40, 40, 40, 40, 40,   M, E, E, E, E, E}
+    };
+    std::vector<int> strides = {3, 3, 3, 0, 6};
+    std::vector<int> alleles = {2, 2, 2, 1, 3};
+
+    {
+        SiteStoreWriter writer(path, {"chr1", "chr2"}, {"A", "B"}, 2);
+        for(std::size_t i = 0; i < pls.size(); ++i) {
+            writer.Add(i < 3 ? 0 : 1, 100+i, alleles[i], pls[i].data(), strides[i]);
+        }
+        writer.Close();
+        CHECK(writer.num_sites() == 5);
+    }
+
+    REQUIRE(SiteStore::IsSiteStore(path));
+    SiteStore store(path);
+    CHECK(store.num_sites() == 5);
+    CHECK(store.num_blocks() == 3);
+    CHECK(store.num_samples() == 2);
+    CHECK(store.contig_names() == std::vector<std::string>{"chr1", "chr2"});
+    CHECK(store.sample_names() == std::vector<std::string>{"A", "B"});
+
+    vec_t pl;
+    for(std::uint64_t i = 0; i < store.num_sites(); ++i) {
+        CAPTURE(i);
+        auto site = store.site(i);
+        CHECK(site.rid == (i < 3 ? 0 : 1));
+        CHECK(site.pos == 100+i);
+        CHECK(site.n_allele == alleles[i]);
+        CHECK(site.stride == strides[i]);
+        CHECK(store.GetPl(i, &pl) == pls[i].size());
+        vec_t expected = pls[i];
+        // values beyond uint16 are clamped
+        std::replace(expected.begin(), expected.end(), 70000, 65535);
+        CHECK(pl == expected);
+    }
+    CHECK(store.is_missing(0, 1));
+    CHECK_FALSE(store.is_missing(0, 0));
+    CHECK(store.is_missing(3, 0));
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("SiteStore rejects corrupt blocks") {
+    auto path = std::filesystem::temp_directory_path() / "mutk-site-store-corrupt-test.bin";
+
+    // A store with one sample and one site. Its only block starts after
+    // the 24 byte header and two 16 byte names, and its columns start at:
+    //   rid 64, pos 72, n_allele 80, stride 88, pl_offset 96, missing 104,
+    //   width 112, pl 120
+    auto write_store = [&]() {
+        SiteStoreWriter writer(path, {"c"}, {"A"}, 2);
+        std::int32_t pl[3] = {0, 10, 20};
+        writer.Add(0, 100, 2, pl, 3);
+        writer.Close();
+    };
+    auto patch = [&](std::streamoff offset, const void *value, std::size_t size) {
+        write_store();
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(offset);
+        file.write(static_cast<const char*>(value), size);
+    };
+
+    write_store();
+    {
+        SiteStore store(path);
+        std::vector<std::int32_t> pl;
+        CHECK(store.GetPl(0, &pl) == 3);
+        CHECK(pl == std::vector<std::int32_t>{0, 10, 20});
+    }
+
+    const std::int32_t bad_rid = 1;
+    patch(64, &bad_rid, sizeof(bad_rid));
+    CHECK_THROWS_AS(SiteStore{path}, std::runtime_error);
+
+    const std::uint64_t bad_offset = 1;
+    patch(96, &bad_offset, sizeof(bad_offset));
+    CHECK_THROWS_AS(SiteStore{path}, std::runtime_error);
+
+    const std::uint64_t huge_offset = UINT64_MAX;
+    patch(96, &huge_offset, sizeof(huge_offset));
+    CHECK_THROWS_AS(SiteStore{path}, std::runtime_error);
+
+    const std::uint8_t bad_width = 4;
+    patch(112, &bad_width, sizeof(bad_width));
+    CHECK_THROWS_AS(SiteStore{path}, std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+// LCOV_EXCL_STOP
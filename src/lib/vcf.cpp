@@ -0,0 +1,405 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include "unit_testing.hpp"
+#include "vcf_testing.hpp"
+
+#include <mutk/vcf.hpp>
+
+#include <tuple>
+
+using mutk::vcf::SampleIndex;
+
+SampleIndex::SampleIndex(const bcf_hdr_t *header) :
+    SampleIndex(header->samples, bcf_hdr_nsamples(header)) {
+}
+
+SampleIndex::SampleIndex(const char *const *names, int num_names) {
+    columns_.reserve(num_names);
+    for(int i = 0; i < num_names; ++i) {
+        auto [it, inserted] = columns_.emplace(names[i], i);
+        if(!inserted) {
+            throw std::invalid_argument("sample '" + it->first + "' appears more than once.");
+        }
+    }
+}
+
+// LCOV_EXCL_START
+TEST_CASE("SampleIndex") {
+    std::vector<const char*> header = {"A", "B", "C", "D"};
+    SampleIndex index(header.data(), header.size());
+
+    CHECK(index.size() == 4);
+    CHECK(index.Find("A") == 0);
+    CHECK(index.Find("D") == 3);
+    CHECK(index.Find("E") == -1);
+
+    CHECK(index.GatherMap(std::vector<const char*>{"C", "A"}) == std::vector<int>{2, 0});
+    CHECK(index.GatherMap(std::vector<std::string>{"B", "D", "C"}) == std::vector<int>{1, 3, 2});
+    CHECK(index.GatherMap(std::vector<std::string>{}).empty());
+    CHECK_THROWS_AS(index.GatherMap(std::vector<const char*>{"A", "E"}), std::invalid_argument);
+
+    std::vector<const char*> dups = {"A", "B", "A"};
+    CHECK_THROWS_AS(SampleIndex(dups.data(), dups.size()), std::invalid_argument);
+}
+
+TEST_CASE("plan_regions() splits an indexed file") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-plan-regions-test.vcf";
+    auto bcf_path = dir / "mutk-plan-regions-test.bcf";
+    write_test_vcf(vcf_path, 100);
+    write_indexed_bcf(vcf_path, bcf_path);
+
+    // chr0 has no records, so chr1 and chr2 are not the first contigs
+    // of the index
+    auto regions = mutk::vcf::plan_regions(bcf_path, 20);
+    REQUIRE(regions.size() == 6);
+    std::uint64_t total = 0;
+    for(std::size_t i = 0; i < regions.size(); ++i) {
+        CAPTURE(i);
+        const auto &r = regions[i];
+        CHECK(r.contig == ((i < 3) ? "chr1" : "chr2"));
+        CHECK(r.rid == ((i < 3) ? 1 : 2));
+        CHECK(r.num_records > 0);
+        total += r.num_records;
+        if(i == 0 || regions[i-1].rid != r.rid) {
+            CHECK(r.beg == 0);
+        } else {
+            CHECK(r.beg == regions[i-1].end);
+        }
+        if(i+1 == regions.size() || regions[i+1].rid != r.rid) {
+            CHECK(r.end == HTS_POS_MAX);
+        }
+    }
+    CHECK(total <= 100);
+    CHECK(total > 90);
+
+    // Contigs with few records are not split
+    regions = mutk::vcf::plan_regions(bcf_path, 1000);
+    REQUIRE(regions.size() == 2);
+    CHECK(regions[0].str() == "chr1");
+    CHECK(regions[0].num_records == 50);
+    CHECK(regions[1].str() == "chr2");
+
+    CHECK_THROWS_AS(mutk::vcf::plan_regions(vcf_path, 20), std::runtime_error);
+
+    std::filesystem::remove(vcf_path);
+    std::filesystem::remove(bcf_path);
+    std::filesystem::remove(bcf_path.string() + ".csi");
+}
+
+TEST_CASE("RegionReader.Next") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-region-reader-test.vcf";
+    auto bcf_path = dir / "mutk-region-reader-test.bcf";
+    const int num_records = 200;
+    write_test_vcf(vcf_path, num_records);
+    write_indexed_bcf(vcf_path, bcf_path);
+
+    // Regions are cut at positions that records with long reference
+    // alleles span. Every record is still read exactly once, in order.
+    auto regions = mutk::vcf::plan_regions(bcf_path, 7);
+    REQUIRE(regions.size() > 10);
+    std::vector<hts_pos_t> positions;
+    for(auto &&region : regions) {
+        mutk::vcf::RegionReader reader(bcf_path, region);
+        CHECK(bcf_hdr_nsamples(reader.header()) == 3);
+        while(bcf1_t *record = reader.Next()) {
+            CHECK(record->pos >= region.beg);
+            CHECK(record->pos < region.end);
+            positions.push_back(record->pos);
+        }
+    }
+    std::vector<hts_pos_t> expected;
+    for(int i = 0; i < num_records; ++i) {
+        expected.push_back(10*(i+1)-1);
+    }
+    CHECK(positions == expected);
+
+    // Selecting samples gives the same columns as vcf::Reader
+    std::vector<const char*> samples = {"C", "A"};
+    mutk::vcf::Reader full(bcf_path);
+    REQUIRE(full.SetSamples(samples) == 0);
+    mutk::vcf::RegionReader reader(bcf_path, regions[0], samples);
+    REQUIRE(bcf_hdr_nsamples(reader.header()) == 2);
+    CHECK(std::string(reader.header()->samples[0]) == full.header()->samples[0]);
+    CHECK(std::string(reader.header()->samples[1]) == full.header()->samples[1]);
+    CHECK(std::string(reader.header()->samples[0]) == "A");
+
+    auto buffer = mutk::vcf::make_buffer<int>(6);
+    reader.SetUnpack(mutk::vcf::unpack::FORMAT);
+    bcf1_t *record = reader.Next();
+    REQUIRE(record != nullptr);
+    CHECK(static_cast<int>(record->n_sample) == 2);
+    int n = mutk::vcf::get_format_int32(reader.header(), record, "PL", &buffer);
+    REQUIRE(n == 6);
+    CHECK(buffer.data[0] == 0);
+    CHECK(buffer.data[3] == 1);
+
+    CHECK_THROWS_AS(mutk::vcf::RegionReader(bcf_path, regions[0], {"Z"}), std::invalid_argument);
+    CHECK_THROWS_AS(mutk::vcf::RegionReader(vcf_path, regions[0]), std::runtime_error);
+
+    std::filesystem::remove(vcf_path);
+    std::filesystem::remove(bcf_path);
+    std::filesystem::remove(bcf_path.string() + ".csi");
+}
+
+TEST_CASE("Writer.Write") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-writer-test.vcf";
+    auto bcf_path = dir / "mutk-writer-test.bcf";
+    const int num_records = 50;
+    write_test_vcf(vcf_path, num_records);
+
+    // Annotate every record and write it to an indexed BCF
+    {
+        mutk::vcf::ThreadPool pool{2};
+        mutk::vcf::Reader reader(vcf_path);
+        REQUIRE(reader.SetThreadPool(pool) == 0);
+        mutk::vcf::Writer writer(bcf_path, reader.header(), true);
+        REQUIRE(writer.SetThreadPool(pool) == 0);
+        writer.AddHeaderLine(mutk::vcf::header_line::LL);
+        writer.AddHeaderLine(mutk::vcf::header_line::DNP);
+        writer.AddHeaderLine(mutk::vcf::header_line::GP);
+        std::int64_t offset = 0;
+        int i = 0;
+        reader([&](const bcf_hdr_t *, bcf1_t *record) {
+            float ll = -0.25f*i;
+            float dnp = i/64.0f;
+            // the test records have one genotype per sample
+            float gp[3] = {1.0f, 0.5f, 0.25f};
+            REQUIRE(mutk::vcf::update_info_float(writer.header(), record, "LL", &ll, 1) == 0);
+            REQUIRE(mutk::vcf::update_info_float(writer.header(), record, "DNP", &dnp, 1) == 0);
+            REQUIRE(mutk::vcf::update_format_float(writer.header(), record, "GP", gp, 3) == 0);
+            writer.Write(record);
+            if(++i % 10 == 0) {
+                std::int64_t next = writer.Flush();
+                CHECK(next > offset);
+                offset = next;
+            }
+        });
+        CHECK_THROWS_AS(writer.AddHeaderLine(mutk::vcf::header_line::LL), std::logic_error);
+        writer.Close();
+    }
+
+    // Read it back
+    mutk::vcf::Reader reader(bcf_path);
+    CHECK(reader.is_bcf());
+    auto [names, num_names] = reader.samples();
+    REQUIRE(num_names == 3);
+    CHECK(std::string(names[0]) == "A");
+    CHECK(std::string(names[2]) == "C");
+    reader.SetUnpack(mutk::vcf::unpack::ALL);
+    auto ll_buffer = mutk::vcf::make_buffer<float>(1);
+    auto gp_buffer = mutk::vcf::make_buffer<float>(3);
+    auto pl_buffer = mutk::vcf::make_buffer<int>(3);
+    std::vector<hts_pos_t> positions;
+    std::vector<float> lls, dnps;
+    std::vector<int> pls;
+    reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+        positions.push_back(record->pos);
+        REQUIRE(mutk::vcf::get_info_float(header, record, "LL", &ll_buffer) == 1);
+        lls.push_back(ll_buffer.data[0]);
+        REQUIRE(mutk::vcf::get_info_float(header, record, "DNP", &ll_buffer) == 1);
+        dnps.push_back(ll_buffer.data[0]);
+        REQUIRE(mutk::vcf::get_format_float(header, record, "GP", &gp_buffer) == 3);
+        CHECK(gp_buffer.data[0] == 1.0f);
+        CHECK(gp_buffer.data[2] == 0.25f);
+        REQUIRE(mutk::vcf::get_format_int32(header, record, "PL", &pl_buffer) == 9);
+        pls.push_back(pl_buffer.data[0]);
+    });
+    std::vector<hts_pos_t> expected_positions;
+    std::vector<float> expected_lls, expected_dnps;
+    std::vector<int> expected_pls;
+    for(int i = 0; i < num_records; ++i) {
+        expected_positions.push_back(10*(i+1)-1);
+        expected_lls.push_back(-0.25f*i);
+        expected_dnps.push_back(i/64.0f);
+        expected_pls.push_back(i);
+    }
+    CHECK(positions == expected_positions);
+    CHECK(lls == expected_lls);
+    CHECK(dnps == expected_dnps);
+    CHECK(pls == expected_pls);
+
+    // The index was built while writing
+    auto regions = mutk::vcf::plan_regions(bcf_path, 1000);
+    REQUIRE(regions.size() == 2);
+    CHECK(regions[0].num_records + regions[1].num_records == num_records);
+
+    CHECK_THROWS_AS(mutk::vcf::Writer(vcf_path, reader.header(), true), std::invalid_argument);
+
+    std::filesystem::remove(vcf_path);
+    std::filesystem::remove(bcf_path);
+    std::filesystem::remove(bcf_path.string() + ".csi");
+}
+
+TEST_CASE("Writer.Flush") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-writer-resume-test.vcf";
+    auto full_path = dir / "mutk-writer-resume-test-full.bcf";
+    auto part_path = dir / "mutk-writer-resume-test-part.bcf";
+    const int num_records = 60;
+    const int num_saved = 20;
+    write_test_vcf(vcf_path, num_records);
+
+    // Annotate records `first` to `last` of the input
+    auto annotate = [&](mutk::vcf::Writer &writer, int first, int last) {
+        mutk::vcf::Reader reader(vcf_path);
+        int i = 0;
+        reader([&](const bcf_hdr_t *, bcf1_t *record) {
+            if(i >= first && i < last) {
+                float ll = -0.25f*i;
+                REQUIRE(mutk::vcf::update_info_float(writer.header(), record, "LL", &ll, 1) == 0);
+                writer.Write(record);
+            }
+            ++i;
+        });
+    };
+
+    mutk::vcf::Reader input(vcf_path);
+    {
+        mutk::vcf::Writer writer(full_path, input.header(), true);
+        writer.AddHeaderLine(mutk::vcf::header_line::LL);
+        annotate(writer, 0, num_records);
+    }
+
+    // An interrupted run saves the offset after `num_saved` records, and
+    // writes a few more before it stops
+    std::int64_t offset = -1;
+    {
+        mutk::vcf::Writer writer(part_path, input.header(), true);
+        writer.AddHeaderLine(mutk::vcf::header_line::LL);
+        annotate(writer, 0, num_saved);
+        offset = writer.Flush();
+        annotate(writer, num_saved, num_saved+7);
+        CHECK(writer.Flush() > offset);
+    }
+    CHECK_THROWS_AS(mutk::vcf::Writer(part_path, mutk::vcf::make_sites_header(input.header()).get(), true, offset),
+        std::invalid_argument);
+
+    // The resumed run keeps the header of the output and replaces the
+    // records after the offset
+    {
+        mutk::vcf::Writer writer(part_path, input.header(), true, offset);
+        CHECK(bcf_hdr_id2int(writer.header(), BCF_DT_ID, "LL") >= 0);
+        CHECK_THROWS_AS(writer.AddHeaderLine(mutk::vcf::header_line::LL), std::logic_error);
+        annotate(writer, num_saved, num_records);
+        writer.Close();
+    }
+
+    auto read_all = [](const std::filesystem::path &path) {
+        mutk::vcf::Reader reader(path);
+        reader.SetUnpack(mutk::vcf::unpack::ALL);
+        auto ll_buffer = mutk::vcf::make_buffer<float>(1);
+        auto pl_buffer = mutk::vcf::make_buffer<int>(9);
+        std::vector<std::tuple<int, hts_pos_t, float, std::vector<int>>> ret;
+        reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+            REQUIRE(mutk::vcf::get_info_float(header, record, "LL", &ll_buffer) == 1);
+            int n = mutk::vcf::get_format_int32(header, record, "PL", &pl_buffer);
+            REQUIRE(n > 0);
+            ret.emplace_back(record->rid, record->pos, ll_buffer.data[0],
+                std::vector<int>(pl_buffer.data.get(), pl_buffer.data.get()+n));
+        });
+        return ret;
+    };
+    auto full = read_all(full_path);
+    auto part = read_all(part_path);
+    CHECK(full.size() == num_records);
+    CHECK(part == full);
+
+    // The index covers the records of both runs
+    auto regions = mutk::vcf::plan_regions(part_path, 1000);
+    REQUIRE(regions.size() == 2);
+    CHECK(regions[0].num_records + regions[1].num_records == num_records);
+
+    for(auto &&path : {full_path, part_path}) {
+        std::filesystem::remove(path);
+        std::filesystem::remove(path.string() + ".csi");
+    }
+    std::filesystem::remove(vcf_path);
+}
+
+TEST_CASE("Writer.SetThreadPool") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto vcf_path = dir / "mutk-writer-pool-test.vcf";
+    const int num_records = 40;
+    const int num_outputs = 3;
+    write_test_vcf(vcf_path, num_records);
+    std::vector<std::filesystem::path> paths;
+    for(int k = 0; k < num_outputs; ++k) {
+        paths.push_back(dir / ("mutk-writer-pool-test-" + std::to_string(k) + ".vcf.gz"));
+    }
+
+    // Sites-only outputs, as written for each family, share one pool
+    {
+        mutk::vcf::ThreadPool pool{4};
+        mutk::vcf::Reader reader(vcf_path);
+        auto sites_header = mutk::vcf::make_sites_header(reader.header());
+        std::vector<std::unique_ptr<mutk::vcf::Writer>> writers;
+        for(auto &&path : paths) {
+            auto &writer = writers.emplace_back(
+                std::make_unique<mutk::vcf::Writer>(path, sites_header.get(), true));
+            REQUIRE(writer->SetThreadPool(pool) == 0);
+            writer->AddHeaderLine(mutk::vcf::header_line::LL);
+        }
+        std::unique_ptr<bcf1_t, mutk::vcf::detail::bcf_free_t> site{bcf_init()};
+        reader.SetUnpack(mutk::vcf::unpack::ALL);
+        int i = 0;
+        reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+            mutk::vcf::copy_site(header, record, site.get());
+            for(int k = 0; k < num_outputs; ++k) {
+                float ll = -1.0f*k - 0.5f*i;
+                REQUIRE(mutk::vcf::update_info_float(writers[k]->header(), site.get(), "LL", &ll, 1) == 0);
+                writers[k]->Write(site.get());
+            }
+            ++i;
+        });
+        for(auto &&writer : writers) {
+            writer->Close();
+        }
+    }
+
+    for(int k = 0; k < num_outputs; ++k) {
+        CAPTURE(k);
+        mutk::vcf::Reader reader(paths[k]);
+        CHECK(reader.samples().second == 0);
+        reader.SetUnpack(mutk::vcf::unpack::INFO);
+        auto buffer = mutk::vcf::make_buffer<float>(1);
+        std::vector<float> lls;
+        reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+            REQUIRE(mutk::vcf::get_info_float(header, record, "LL", &buffer) == 1);
+            lls.push_back(buffer.data[0]);
+        });
+        std::vector<float> expected;
+        for(int i = 0; i < num_records; ++i) {
+            expected.push_back(-1.0f*k - 0.5f*i);
+        }
+        CHECK(lls == expected);
+        std::filesystem::remove(paths[k]);
+        std::filesystem::remove(paths[k].string() + ".csi");
+    }
+    std::filesystem::remove(vcf_path);
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,66 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#ifndef MUTK_VCF_TESTING_HPP
+#define MUTK_VCF_TESTING_HPP
+
+#include <mutk/vcf.hpp>
+
+#include <filesystem>
+#include <fstream>
+
+// Write a VCF with `num_records` records and samples A, B and C. The first
+// half of the records are on chr1 and the rest on chr2, and chr0 has none.
+// Record i is at position 10*(i+1), has 1 + i%5 alleles, and the PLs of A,
+// B and C start with i, 0 and 1. Every 16th record has a 30 bp reference
+// allele, so that it can overlap the next region.
+inline void write_test_vcf(const std::filesystem::path &path, int num_records) {
+    std::ofstream out(path, std::ios::trunc);
+    out << "##fileformat=VCFv4.2\n"
+        << "##contig=<ID=chr0,length=100000>\n"
+        << "##contig=<ID=chr1,length=100000>\n"
+        << "##contig=<ID=chr2,length=100000>\n"
+        << "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled genotype likelihoods\">\n"
+        << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n";
+    const char *alts[] = {".", "C", "C,G", "C,G,T", "C,G,T,N"};
+    for(int i = 0; i < num_records; ++i) {
+        int n_allele = 1 + i % 5;
+        out << ((i < num_records/2) ? "chr1" : "chr2") << '\t' << 10*(i+1) << "\t.\t"
+            << ((i % 16 == 0) ? std::string(30, 'A') : "A") << '\t' << alts[n_allele-1]
+            << "\t.\t.\t.\tPL\t" << i << ",0,1\t0," << i << ",1\t1,1," << i << '\n';
+    }
+}
+
+// Copy the VCF at `input` to a BCF at `output` and index it
+inline void write_indexed_bcf(const std::filesystem::path &input,
+    const std::filesystem::path &output) {
+    mutk::vcf::Reader reader(input);
+    mutk::vcf::Writer writer(output, reader.header(), true);
+    reader([&](const bcf_hdr_t *, bcf1_t *record) {
+        writer.Write(record);
+    });
+    writer.Close();
+}
+
+#endif // MUTK_VCF_TESTING_HPP
@@ -0,0 +1,130 @@
+/*
+# Copyright (c) 2022 Reed A. Cartwright <racartwright@gmail.com>
+#
+# This file is part of the Ultimate Source Code Project.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+*/
+
+#include <string>
+#include <filesystem>
+
+#include <mutk/mutk.hpp>
+#include <mutk/vcf.hpp>
+#include <mutk/pedigree.hpp>
+#include <mutk/site_store.hpp>
+
+#include <CLI11.hpp>
+
+#include "subcommand.hpp"
+
+using namespace std::string_literals;
+
+namespace {
+struct args_t {
+    int threads{1};
+    int block_size{mutk::SiteStoreWriter::DEFAULT_BLOCK_SIZE};
+
+    std::filesystem::path ped{};
+    std::filesystem::path output{};
+    std::filesystem::path input{};
+};
+}  // anon namespace
+
+int main(int argc, char *argv[]) {
+    MUTK_RUNTIME_CHECK_VERSION_NUMBER_OR_RETURN();
+
+    using namespace mutk::subcommand::string_literals;
+
+    args_t args;
+
+    CLI::App app{mutk::subcommand::create_program_name("pack")};
+
+    #define ADD_OPTION_(name, desc) app.add_option(#name##_opt, args.name, desc, true)
+
+    ADD_OPTION_(ped, "Pedigree file");
+
+    ADD_OPTION_(output, "Output file")->required();
+
+    ADD_OPTION_(threads, "Number of threads");
+    ADD_OPTION_(block_size, "Number of sites per block");
+
+    #undef ADD_OPTION_
+
+    app.add_option("input", args.input, "Input file");
+
+    CLI11_PARSE(app, argc, argv);
+
+    mutk::vcf::Reader reader{args.input};
+
+    auto pedigree = mutk::Pedigree::parse_file(args.ped);
+
+    // Only keep the samples of pedigree members. The store lists the samples
+    // it keeps, in the order of the input, and readers look up their
+    // columns by name.
+    mutk::vcf::SampleIndex sample_index{reader.header()};
+    std::vector<std::string> pedigree_samples = pedigree.SampleNames();
+    std::vector<const char*> used_samples;
+    for(auto &&name : pedigree_samples) {
+        if(sample_index.Find(name) >= 0) {
+            used_samples.push_back(name.c_str());
+        }
+    }
+    if(used_samples.empty()) {
+        throw std::invalid_argument("no samples of the pedigree were found in the input.");
+    }
+    if(reader.SetSamples(used_samples) != 0) {
+        throw std::runtime_error("unable to select the pedigree samples from the input.");
+    }
+
+    // Decompress with htslib's thread pool
+    reader.SetThreads(args.threads);
+
+    int num_contigs = 0;
+    const char **seqnames = bcf_hdr_seqnames(reader.header(), &num_contigs);
+    std::vector<std::string> contig_names(seqnames, seqnames+num_contigs);
+    free(seqnames);  // NOLINT
+
+    auto samples = reader.samples();
+    std::vector<std::string> sample_names(samples.first, samples.first+samples.second);
+    int num_samples = samples.second;
+
+    mutk::SiteStoreWriter writer{args.output, contig_names, sample_names, args.block_size};
+
+    auto pl_buf = mutk::vcf::make_buffer<int>(15*num_samples);
+    // PLs are the only per-sample data that is needed
+    reader.SetUnpack(mutk::vcf::unpack::FORMAT);
+
+    reader([&](const bcf_hdr_t *header, bcf1_t *record) {
+        if(record->n_allele > UINT8_MAX) {
+            // the store can not describe the site
+            return;
+        }
+        int n_pl = mutk::vcf::get_format_int32(header, record, "PL", &pl_buf);
+        int stride = (n_pl > 0 && num_samples > 0) ? n_pl / num_samples : 0;
+        if(stride > UINT8_MAX) {
+            // too wide to store; keep the site but without data
+            stride = 0;
+        }
+        writer.Add(record->rid, record->pos, record->n_allele, pl_buf.data.get(), stride);
+    });
+    writer.Close();
+
+    return EXIT_SUCCESS;
+}